@@ -0,0 +1,496 @@
+/*
+ * Benchmark of encoding CDR documents into recycled buffers
+ *
+ * Copyright: (c) 2015-2016 KINOSHITA minoru
+ * License: GNU GENERAL PUBLIC LICENSE Version 2
+ */
+
+/*! \file
+ *
+ * \brief count heap allocations per record of cdr_mongodb in async mode, i.e.
+ * cdr2doc() into a document from ast_mongo_doc_get(), ast_mongo_queue_push(),
+ * the writer taking a batch and routing it by ast_mongo_docs_route(), then
+ * ast_mongo_docs_put() recycling it, against bson_new(), BSON_APPEND_*() per
+ * field and bson_destroy() as it did before.
+ *
+ * cdr2doc() is copied from cdr_mongodb.c, and ast_mongo_doc_get(),
+ * ast_mongo_docs_put(), ast_mongo_doc_time() and ast_mongo_queue_push() from
+ * res_mongodb.c without their prefix, with struct ast_mongo_queue and struct
+ * ast_mongo_plan reduced to statics and Asterisk locks to pthread ones.
+ * Inserting into MongoDB is left out, the writer only routes each batch and
+ * reads its documents.
+ * malloc() and its family are interposed to count every allocation of the
+ * process, including those of libbson and libc. It requires glibc.
+ * Build and run it standalone;
+ *
+ *     cc -O2 -pthread -o doc_alloc bench/doc_alloc.c $(pkg-config --cflags --libs libbson-1.0) && ./doc_alloc [records]
+ */
+
+#define _GNU_SOURCE
+#include <bson.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof(0[a]))
+
+/*
+ * allocations counted while counting is set
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static volatile int counting = 0;
+static unsigned long allocations = 0;
+
+void *malloc(size_t size)
+{
+    if (counting)
+        __sync_fetch_and_add(&allocations, 1);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    if (counting)
+        __sync_fetch_and_add(&allocations, 1);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (counting)
+        __sync_fetch_and_add(&allocations, 1);
+    return __libc_realloc(ptr, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (counting)
+        __sync_fetch_and_add(&allocations, 1);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    if (counting)
+        __sync_fetch_and_add(&allocations, 1);
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : 12;   // ENOMEM
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+/*
+ * struct ast_cdr, as far as cdr_mongodb.c encodes it
+ */
+enum {
+    AST_MAX_EXTENSION = 80,
+    AST_MAX_CONTEXT = 80,
+    AST_MAX_ACCOUNT_CODE = 80,
+    AST_MAX_UNIQUEID = 150,
+    AST_MAX_USER_FIELD = 256,
+};
+
+struct ast_cdr {
+    char clid[AST_MAX_EXTENSION];
+    char src[AST_MAX_EXTENSION];
+    char dst[AST_MAX_EXTENSION];
+    char dcontext[AST_MAX_EXTENSION];
+    char channel[AST_MAX_EXTENSION];
+    char dstchannel[AST_MAX_EXTENSION];
+    char lastapp[AST_MAX_EXTENSION];
+    char lastdata[AST_MAX_EXTENSION];
+    struct timeval start;
+    struct timeval answer;
+    struct timeval end;
+    long int duration;
+    long int billsec;
+    long int disposition;
+    long int amaflags;
+    char accountcode[AST_MAX_ACCOUNT_CODE];
+    char peeraccount[AST_MAX_ACCOUNT_CODE];
+    unsigned int flags;
+    char uniqueid[AST_MAX_UNIQUEID];
+    char linkedid[AST_MAX_UNIQUEID];
+    char userfield[AST_MAX_USER_FIELD];
+    int sequence;
+};
+
+enum {
+    DOC_SIZE = 1024,
+    SPARES_SIZE = 1024,
+    COLLECTION_NAME_SIZE = 128,
+    BATCH_SIZE = 100,
+    QUEUE_SIZE = 10000,
+};
+
+enum {
+    FIELD_STRING,
+    FIELD_LONG,
+    FIELD_INT,
+    FIELD_TIMEVAL,
+    FIELD_DISPOSITION,
+    FIELD_AMAFLAGS,
+};
+
+struct cdr_field {
+    const char *key;
+    int type;
+    size_t offset;
+};
+
+#define CDR_FIELD(name, type) { #name, type, offsetof(struct ast_cdr, name) }
+
+static const struct cdr_field cdr_fields[] = {
+    CDR_FIELD(clid, FIELD_STRING),
+    CDR_FIELD(src, FIELD_STRING),
+    CDR_FIELD(dst, FIELD_STRING),
+    CDR_FIELD(dcontext, FIELD_STRING),
+    CDR_FIELD(channel, FIELD_STRING),
+    CDR_FIELD(dstchannel, FIELD_STRING),
+    CDR_FIELD(lastapp, FIELD_STRING),
+    CDR_FIELD(lastdata, FIELD_STRING),
+    CDR_FIELD(disposition, FIELD_DISPOSITION),
+    CDR_FIELD(amaflags, FIELD_AMAFLAGS),
+    CDR_FIELD(accountcode, FIELD_STRING),
+    CDR_FIELD(uniqueid, FIELD_STRING),
+    CDR_FIELD(userfield, FIELD_STRING),
+    CDR_FIELD(peeraccount, FIELD_STRING),
+    CDR_FIELD(linkedid, FIELD_STRING),
+    CDR_FIELD(duration, FIELD_LONG),
+    CDR_FIELD(billsec, FIELD_LONG),
+    CDR_FIELD(sequence, FIELD_INT),
+    CDR_FIELD(start, FIELD_TIMEVAL),
+    CDR_FIELD(answer, FIELD_TIMEVAL),
+    CDR_FIELD(end, FIELD_TIMEVAL),
+};
+
+static const char *dispositions[] = { "NO ANSWER", "NO ANSWER", "FAILED", NULL, "BUSY", NULL, NULL, NULL, "ANSWERED" };
+static const char *amaflags[] = { NULL, "OMIT", "BILLING", "DOCUMENTATION" };
+
+struct plan_entry {
+    const struct cdr_field *field;
+    const char *key;
+    int length;
+};
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static bson_t *queue[QUEUE_SIZE];
+static unsigned queue_head = 0;
+static unsigned queue_count = 0;
+
+static bson_t *spares[SPARES_SIZE];     // protected by queue_lock
+static unsigned spares_count = 0;
+static unsigned skip_empty = 0;
+
+static pthread_rwlock_t plan_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct plan_entry plan[ARRAY_LEN(cdr_fields)];
+static unsigned plan_count = 0;
+static const char *time_key = NULL;
+
+static const char *dbcollection = "cdr_%Y%m";
+static bson_oid_t server_oid;
+static bson_oid_t *serverid = &server_oid;
+static const char *spool_path = "cdr.spool";
+
+/*
+ * as of res_mongodb.c and cdr_mongodb.c
+ */
+static bson_t *doc_get(void)
+{
+    bson_t *doc = NULL;
+
+    pthread_mutex_lock(&queue_lock);
+    if (spares_count)
+        doc = spares[--spares_count];
+    pthread_mutex_unlock(&queue_lock);
+
+    if (doc) {
+        // keeps the buffer grown so far
+        bson_reinit(doc);
+        return doc;
+    }
+    return bson_sized_new(DOC_SIZE);
+}
+
+static void docs_put(bson_t **docs, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        if (spares_count < ARRAY_LEN(spares))
+            spares[spares_count++] = docs[i];
+        else
+            bson_destroy(docs[i]);
+    }
+}
+
+static bson_t *cdr2doc(struct ast_cdr *cdr)
+{
+    bson_t *doc = doc_get();
+    unsigned i;
+
+    if(doc == NULL)
+        return NULL;
+    if (spool_path) {
+        bson_oid_t oid;
+        bson_oid_init(&oid, NULL);
+        BSON_APPEND_OID(doc, "_id", &oid);
+    }
+    pthread_rwlock_rdlock(&plan_lock);
+    for (i = 0; i < plan_count; i++) {
+        const struct cdr_field *field = plan[i].field;
+        const char *key = plan[i].key;
+        int length = plan[i].length;
+        const char *value = (const char *)cdr + field->offset;
+
+        switch (field->type) {
+        case FIELD_STRING:
+            if (!skip_empty || *value)
+                bson_append_utf8(doc, key, length, value, -1);
+            break;
+        case FIELD_LONG:
+            bson_append_int32(doc, key, length, *(const long *)value);
+            break;
+        case FIELD_INT:
+            bson_append_int32(doc, key, length, *(const int *)value);
+            break;
+        case FIELD_TIMEVAL:
+            bson_append_timeval(doc, key, length, (struct timeval *)value);
+            break;
+        case FIELD_DISPOSITION:
+            bson_append_utf8(doc, key, length, dispositions[*(const long *)value], -1);
+            break;
+        case FIELD_AMAFLAGS:
+            bson_append_utf8(doc, key, length, amaflags[*(const long *)value], -1);
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&plan_lock);
+    if (serverid)
+        BSON_APPEND_OID(doc, "serverid", serverid);
+    return doc;
+}
+
+static time_t doc_time(const bson_t *doc)
+{
+    bson_iter_t iter;
+    time_t t = 0;
+
+    pthread_rwlock_rdlock(&plan_lock);
+    if (time_key && bson_iter_init_find(&iter, doc, time_key) && BSON_ITER_HOLDS_DATE_TIME(&iter))
+        t = bson_iter_date_time(&iter) / 1000;
+    pthread_rwlock_unlock(&plan_lock);
+
+    if (t == 0 && bson_iter_init_find(&iter, doc, "_id") && BSON_ITER_HOLDS_OID(&iter))
+        t = bson_oid_get_time_t(bson_iter_oid(&iter));
+    return t ? t : time(NULL);
+}
+
+static int queue_push(bson_t *doc)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&queue_lock);
+    if (queue_count < ARRAY_LEN(queue)) {
+        queue[(queue_head + queue_count) % ARRAY_LEN(queue)] = doc;
+        queue_count++;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return ret;
+}
+
+/*
+ * ast_mongo_collection_name() of res_mongodb.c, with ast_localtime() and ast_strftime()
+ */
+static void collection_name(const char* template, time_t time, char* name, size_t size)
+{
+    struct tm tm;
+
+    if (!strchr(template, '%')
+    || !localtime_r(&time, &tm)
+    || strftime(name, size, template, &tm) == 0)
+        snprintf(name, size, "%s", template);
+}
+
+// keep the compiler from dropping the results
+static volatile size_t sink;
+
+/*
+ * what the writer does with a batch but inserting it, i.e. docs_route() and reading documents
+ */
+static void write_docs(const bson_t **docs, size_t count)
+{
+    char name[COLLECTION_NAME_SIZE];
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        collection_name(dbcollection, doc_time(docs[i]), name, sizeof(name));
+        sink += docs[i]->len + name[0];
+    }
+}
+
+/*
+ * take batches from the queue as the writer thread does, in the caller's thread
+ */
+static void writer_drain(void)
+{
+    bson_t *batch[BATCH_SIZE];
+    unsigned count;
+
+    pthread_mutex_lock(&queue_lock);
+    while (queue_count) {
+        for (count = 0; count < ARRAY_LEN(batch) && queue_count > 0; count++, queue_count--) {
+            batch[count] = queue[queue_head];
+            queue_head = (queue_head + 1) % ARRAY_LEN(queue);
+        }
+        pthread_mutex_unlock(&queue_lock);
+        write_docs((const bson_t **)batch, count);
+        pthread_mutex_lock(&queue_lock);
+        docs_put(batch, count);
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/*
+ * cdr2doc() as of before recycling, with the BSON_APPEND_* macros into a new document
+ */
+static bson_t *cdr2doc_old(struct ast_cdr *cdr)
+{
+    bson_t *doc = bson_new();
+
+    if (spool_path) {
+        bson_oid_t oid;
+        bson_oid_init(&oid, NULL);
+        BSON_APPEND_OID(doc, "_id", &oid);
+    }
+    BSON_APPEND_UTF8(doc, "clid", cdr->clid);
+    BSON_APPEND_UTF8(doc, "src", cdr->src);
+    BSON_APPEND_UTF8(doc, "dst", cdr->dst);
+    BSON_APPEND_UTF8(doc, "dcontext", cdr->dcontext);
+    BSON_APPEND_UTF8(doc, "channel", cdr->channel);
+    BSON_APPEND_UTF8(doc, "dstchannel", cdr->dstchannel);
+    BSON_APPEND_UTF8(doc, "lastapp", cdr->lastapp);
+    BSON_APPEND_UTF8(doc, "lastdata", cdr->lastdata);
+    BSON_APPEND_UTF8(doc, "disposition", dispositions[cdr->disposition]);
+    BSON_APPEND_UTF8(doc, "amaflags", amaflags[cdr->amaflags]);
+    BSON_APPEND_UTF8(doc, "accountcode", cdr->accountcode);
+    BSON_APPEND_UTF8(doc, "uniqueid", cdr->uniqueid);
+    BSON_APPEND_UTF8(doc, "userfield", cdr->userfield);
+    BSON_APPEND_UTF8(doc, "peeraccount", cdr->peeraccount);
+    BSON_APPEND_UTF8(doc, "linkedid", cdr->linkedid);
+    BSON_APPEND_INT32(doc, "duration", cdr->duration);
+    BSON_APPEND_INT32(doc, "billsec", cdr->billsec);
+    BSON_APPEND_INT32(doc, "sequence", cdr->sequence);
+    BSON_APPEND_TIMEVAL(doc, "start", &cdr->start);
+    BSON_APPEND_TIMEVAL(doc, "answer", &cdr->answer);
+    BSON_APPEND_TIMEVAL(doc, "end", &cdr->end);
+    if (serverid)
+        BSON_APPEND_OID(doc, "serverid", serverid);
+    return doc;
+}
+
+static void cdr_init(struct ast_cdr *cdr, unsigned n)
+{
+    memset(cdr, 0, sizeof(*cdr));
+    snprintf(cdr->clid, sizeof(cdr->clid), "\"Alice\" <%u>", 6000 + n % 100);
+    snprintf(cdr->src, sizeof(cdr->src), "%u", 6000 + n % 100);
+    snprintf(cdr->dst, sizeof(cdr->dst), "%u", 7000 + n % 100);
+    snprintf(cdr->dcontext, sizeof(cdr->dcontext), "from-internal");
+    snprintf(cdr->channel, sizeof(cdr->channel), "PJSIP/%u-%08x", 6000 + n % 100, n);
+    snprintf(cdr->dstchannel, sizeof(cdr->dstchannel), "PJSIP/%u-%08x", 7000 + n % 100, n + 1);
+    snprintf(cdr->lastapp, sizeof(cdr->lastapp), "Dial");
+    snprintf(cdr->lastdata, sizeof(cdr->lastdata), "PJSIP/%u,30", 7000 + n % 100);
+    snprintf(cdr->uniqueid, sizeof(cdr->uniqueid), "1544000000.%u", n);
+    snprintf(cdr->linkedid, sizeof(cdr->linkedid), "1544000000.%u", n);
+    gettimeofday(&cdr->start, NULL);
+    cdr->answer = cdr->start;
+    cdr->end = cdr->start;
+    cdr->duration = 30;
+    cdr->billsec = 28;
+    cdr->disposition = 8;
+    cdr->amaflags = 3;
+    cdr->sequence = n;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned records = (argc > 1 ? (unsigned)atoi(argv[1]) : 1000000) / BATCH_SIZE * BATCH_SIZE;
+    struct ast_cdr cdrs[BATCH_SIZE];
+    unsigned long new_allocations, old_allocations;
+    double start, new_sec, old_sec;
+    unsigned i, n;
+
+    for (i = 0; i < ARRAY_LEN(cdrs); i++)
+        cdr_init(&cdrs[i], i);
+    for (i = 0; i < ARRAY_LEN(cdr_fields); i++) {
+        plan[i].field = &cdr_fields[i];
+        plan[i].key = cdr_fields[i].key;
+        plan[i].length = strlen(plan[i].key);
+        if (!strcmp(plan[i].key, "start"))
+            time_key = plan[i].key;
+    }
+    plan_count = ARRAY_LEN(cdr_fields);
+    bson_oid_init(&server_oid, NULL);
+
+    // fill the spares and let libc set up time zones before counting
+    for (n = 0; n < 2 * BATCH_SIZE; n++)
+        queue_push(cdr2doc(&cdrs[n % BATCH_SIZE]));
+    writer_drain();
+    bson_destroy(cdr2doc_old(&cdrs[0]));
+
+    allocations = 0;
+    counting = 1;
+    start = now();
+    for (n = 0; n < records; n++) {
+        queue_push(cdr2doc(&cdrs[n % BATCH_SIZE]));
+        if (n % BATCH_SIZE == BATCH_SIZE - 1)
+            writer_drain();
+    }
+    writer_drain();
+    new_sec = now() - start;
+    counting = 0;
+    new_allocations = allocations;
+
+    allocations = 0;
+    counting = 1;
+    start = now();
+    for (n = 0; n < records; n += BATCH_SIZE) {
+        bson_t *batch[BATCH_SIZE];
+
+        for (i = 0; i < BATCH_SIZE; i++)
+            batch[i] = cdr2doc_old(&cdrs[i]);
+        write_docs((const bson_t **)batch, BATCH_SIZE);
+        for (i = 0; i < BATCH_SIZE; i++)
+            bson_destroy(batch[i]);
+    }
+    old_sec = now() - start;
+    counting = 0;
+    old_allocations = allocations;
+
+    printf("%u records in batches of %u\n", records, BATCH_SIZE);
+    printf("bson_new/BSON_APPEND_*/bson_destroy: %6.2f allocations/record, %8.1f ns/record\n",
+        (double)old_allocations / records, old_sec * 1e9 / records);
+    printf("doc_get/cdr2doc/docs_put:            %6.2f allocations/record, %8.1f ns/record\n",
+        (double)new_allocations / records, new_sec * 1e9 / records);
+    return 0;
+}
@@ -0,0 +1,328 @@
+/*
+ * Benchmark of compiled realtime queries
+ *
+ * Copyright: (c) 2015-2016 KINOSHITA minoru
+ * License: GNU GENERAL PUBLIC LICENSE Version 2
+ */
+
+/*! \file
+ *
+ * \brief compare make_query() of res_config_mongodb walking a query_plan found
+ * by query_plan_get() with splitting names of fields into their operators on
+ * every lookup, as it did before.
+ *
+ * Only the handling of names is measured. Values are appended to the query in
+ * the same way by both, so libbson is left out. query_plan_get() and its hash
+ * and comparison are copied from res_config_mongodb.c, with ao2_find() of an
+ * AO2_ALLOC_OPT_LOCK_RWLOCK container reduced to a read lock, a walk of its
+ * bucket and a reference count.
+ * Build and run it standalone;
+ *
+ *     cc -O2 -pthread -o query_plan bench/query_plan.c && ./query_plan [rounds]
+ */
+
+#define _GNU_SOURCE     // for stpcpy()
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+static const int MAXTOKENS = 4;
+
+enum {
+    QUERY_NAME_SIZE = 1024,
+    QUERY_PLANS = 61,
+};
+
+enum query_op {
+    QUERY_EQ, QUERY_LIKE, QUERY_NE, QUERY_GT, QUERY_GTE, QUERY_LT, QUERY_LTE,
+    QUERY_IN, QUERY_NULL, QUERY_NOT_NULL, QUERY_SKIP, QUERY_INVALID,
+};
+
+struct ast_variable {
+    const char *name;
+    const char *value;
+    struct ast_variable *next;
+};
+
+struct query_step {
+    enum query_op op;
+    bool id;
+    const char *key;
+};
+
+struct query_plan {
+    struct query_plan *next;        // in the bucket
+    int refs;
+    const char *signature;
+    unsigned count;
+    struct query_step steps[0];
+};
+
+struct query_key {
+    const char *table;
+    const struct ast_variable *fields;
+};
+
+static const char QUERY_SEPARATOR = '\x1e';
+
+static pthread_rwlock_t plans_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct query_plan *plans[QUERY_PLANS];
+
+static int str_split(char* str, const char* delim, const char* tokens[] ) {
+    char* token;
+    char* saveptr;
+    int count = 0;
+
+    for(token = strtok_r(str, delim, &saveptr);
+        token && count < MAXTOKENS;
+        token = strtok_r(NULL, delim, &saveptr), count++)
+    {
+        tokens[count] = token;
+    }
+    return count;
+}
+
+static const char *key_asterisk2mongo(const char *key)
+{
+    return strcmp(key, "id") == 0 ? "_id" : key;
+}
+
+static unsigned query_hash_add(unsigned hash, const char *str)
+{
+    while (*str)
+        hash = hash * 33 ^ (unsigned char)*str++;
+    return hash;
+}
+
+static int query_key_hash(const struct query_key *key)
+{
+    const struct ast_variable *field;
+    const char separator[] = { QUERY_SEPARATOR, '\0' };
+    unsigned hash = 5381;
+
+    hash = query_hash_add(hash, key->table);
+    for (field = key->fields; field; field = field->next)
+        hash = query_hash_add(query_hash_add(hash, separator), field->name);
+    return (int)(hash & INT_MAX);
+}
+
+static bool query_key_match(const struct query_plan *plan, const struct query_key *key)
+{
+    const struct ast_variable *field;
+    const char *p = plan->signature;
+    size_t len;
+
+    len = strlen(key->table);
+    if (strncmp(p, key->table, len))
+        return false;
+    for (p += len, field = key->fields; field; p += len, field = field->next) {
+        len = strlen(field->name);
+        if (*p++ != QUERY_SEPARATOR || strncmp(p, field->name, len))
+            return false;
+    }
+    return !*p;
+}
+
+/*
+ * the operator of a name, as make_query() did for every field of every lookup,
+ * and as query_plan_compile() does once per signature.
+ */
+static enum query_op name_parse(const char *name, const char **key, char *buf)
+{
+    const char *tokens[MAXTOKENS];
+    enum query_op op = QUERY_INVALID;
+    int n;
+
+    if (strlen(name) >= (QUERY_NAME_SIZE - 1))
+        return QUERY_SKIP;
+    strcpy(buf, name);
+    n = str_split(buf, " ", tokens);
+    if (n == 0)
+        return QUERY_INVALID;
+    if (n == 1)
+        op = QUERY_EQ;
+    else if (n == 2) {
+        if (!strcasecmp(tokens[1], "LIKE"))
+            op = QUERY_LIKE;
+        else if (!strcmp(tokens[1], "="))
+            op = QUERY_EQ;
+        else if (!strcmp(tokens[1], "!=") || !strcmp(tokens[1], "<>"))
+            op = QUERY_NE;
+        else if (!strcmp(tokens[1], ">"))
+            op = QUERY_GT;
+        else if (!strcmp(tokens[1], ">="))
+            op = QUERY_GTE;
+        else if (!strcmp(tokens[1], "<"))
+            op = QUERY_LT;
+        else if (!strcmp(tokens[1], "<="))
+            op = QUERY_LTE;
+        else if (!strcasecmp(tokens[1], "IN"))
+            op = QUERY_IN;
+    }
+    else if (n == 3) {
+        if (!strcasecmp(tokens[1], "IS") && !strcasecmp(tokens[2], "NULL"))
+            op = QUERY_NULL;
+    }
+    else if (n == 4) {
+        if (!strcasecmp(tokens[1], "IS") && !strcasecmp(tokens[2], "NOT") && !strcasecmp(tokens[3], "NULL"))
+            op = QUERY_NOT_NULL;
+    }
+    *key = key_asterisk2mongo(tokens[0]);
+    return op;
+}
+
+static struct query_plan *query_plan_compile(const char *table, const struct ast_variable *fields)
+{
+    const struct ast_variable *field;
+    struct query_plan *plan;
+    size_t size = strlen(table) + 1;
+    unsigned count = 0;
+    unsigned i;
+    char *p;
+
+    for (field = fields; field; field = field->next, count++)
+        size += (strlen(field->name) + 1) * 2 + 1;
+    plan = calloc(1, sizeof(*plan) + count * sizeof(*plan->steps) + size);
+    if (!plan)
+        return NULL;
+    p = (char *)(plan->steps + count);
+    plan->signature = p;
+    p = stpcpy(p, table);
+    for (field = fields; field; field = field->next) {
+        *p++ = QUERY_SEPARATOR;
+        p = stpcpy(p, field->name);
+    }
+    p++;
+    plan->count = count;
+    plan->refs = 1;
+    for (field = fields, i = 0; field; field = field->next, i++) {
+        char buf[QUERY_NAME_SIZE];
+        const char *key = "";
+
+        plan->steps[i].op = name_parse(field->name, &key, buf);
+        plan->steps[i].id = plan->steps[i].op == QUERY_EQ && !strcmp(key, "_id");
+        plan->steps[i].key = strcpy(p, key);
+        p += strlen(p) + 1;
+    }
+    return plan;
+}
+
+static struct query_plan *query_plan_get(const char *table, const struct ast_variable *fields)
+{
+    struct query_key key = { .table = table, .fields = fields };
+    struct query_plan *plan;
+    int bucket;
+
+    bucket = query_key_hash(&key) % QUERY_PLANS;
+    pthread_rwlock_rdlock(&plans_lock);
+    for (plan = plans[bucket]; plan; plan = plan->next) {
+        if (query_key_match(plan, &key)) {
+            __sync_fetch_and_add(&plan->refs, 1);
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&plans_lock);
+    if (plan)
+        return plan;
+
+    plan = query_plan_compile(table, fields);
+    if (plan) {
+        pthread_rwlock_wrlock(&plans_lock);
+        plan->next = plans[bucket];
+        plans[bucket] = plan;
+        __sync_fetch_and_add(&plan->refs, 1);
+        pthread_rwlock_unlock(&plans_lock);
+    }
+    return plan;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// keep the compiler from dropping the results
+static volatile unsigned sink;
+
+/*
+ * lookups of realtime sorcery and of the dialplan, in the shapes Asterisk sends them.
+ */
+static struct ast_variable endpoint[] = {
+    { "id", "6001", NULL },
+};
+static struct ast_variable contacts[] = {
+    { "endpoint LIKE", "6001%", &contacts[1] },
+    { "expiration_time >", "1544000000", NULL },
+};
+static struct ast_variable extensions[] = {
+    { "context", "from-internal", &extensions[1] },
+    { "exten", "6001", &extensions[2] },
+    { "priority", "1", NULL },
+};
+static struct ast_variable voicemail[] = {
+    { "context", "default", &voicemail[1] },
+    { "mailbox", "6001", &voicemail[2] },
+    { "uniqueid IS NOT NULL", "", &voicemail[3] },
+    { "msgnum <=", "100", NULL },
+};
+
+static const struct {
+    const char *table;
+    const struct ast_variable *fields;
+} lookups[] = {
+    { "ps_endpoints", endpoint },
+    { "ps_contacts", contacts },
+    { "extensions", extensions },
+    { "voicemail_messages", voicemail },
+};
+
+int main(int argc, char *argv[])
+{
+    unsigned rounds = argc > 1 ? (unsigned)atoi(argv[1]) : 1000000;
+    size_t count = sizeof(lookups) / sizeof(lookups[0]);
+    double start, old_sec, new_sec;
+    unsigned r;
+    size_t i;
+
+    start = now();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < count; i++) {
+            const struct ast_variable *field;
+
+            for (field = lookups[i].fields; field; field = field->next) {
+                char buf[QUERY_NAME_SIZE];
+                const char *key = "";
+
+                sink += name_parse(field->name, &key, buf) + key[0];
+            }
+        }
+    }
+    old_sec = now() - start;
+
+    start = now();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < count; i++) {
+            struct query_plan *plan = query_plan_get(lookups[i].table, lookups[i].fields);
+            const struct ast_variable *field = lookups[i].fields;
+            unsigned j;
+
+            for (j = 0; j < plan->count; j++, field = field->next)
+                sink += plan->steps[j].op + plan->steps[j].key[0];
+            __sync_fetch_and_sub(&plan->refs, 1);
+        }
+    }
+    new_sec = now() - start;
+
+    printf("%zu lookups x %u rounds\n", count, rounds);
+    printf("split names per lookup: %8.1f ns/lookup\n", old_sec * 1e9 / ((double)rounds * count));
+    printf("walk a compiled plan:   %8.1f ns/lookup\n", new_sec * 1e9 / ((double)rounds * count));
+    printf("speedup:                %8.1fx\n", old_sec / new_sec);
+    return 0;
+}
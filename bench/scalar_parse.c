@@ -0,0 +1,224 @@
+/*
+ * Benchmark of classifying and parsing field values
+ *
+ * Copyright: (c) 2015-2016 KINOSHITA minoru
+ * License: GNU GENERAL PUBLIC LICENSE Version 2
+ */
+
+/*! \file
+ *
+ * \brief compare scalar_parse() of res_config_mongodb with is_bool(), is_real()
+ * and is_integer() followed by atol(), atoll() or atof(), which it replaced.
+ *
+ * Both are copied from res_config_mongodb.c, with bson_type_t reduced to an enum.
+ * Build and run it standalone;
+ *
+ *     cc -O2 -o scalar_parse bench/scalar_parse.c && ./scalar_parse [rounds]
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef enum {
+    BSON_TYPE_DOUBLE,
+    BSON_TYPE_UTF8,
+    BSON_TYPE_BOOL,
+    BSON_TYPE_INT64,
+} bson_type_t;
+
+struct scalar {
+    bson_type_t type;
+    bool b;
+    long long ll;
+    double d;
+};
+
+/*
+ * as of res_config_mongodb.c
+ */
+static bson_type_t scalar_parse(const char* value, struct scalar* scalar)
+{
+    const char* p = value;
+    bool digits = false;
+    bool real = false;
+
+    scalar->type = BSON_TYPE_UTF8;
+    if (*p == 't' || *p == 'f') {
+        if (!strcmp(p, "true") || !strcmp(p, "false")) {
+            scalar->b = *p == 't';
+            scalar->type = BSON_TYPE_BOOL;
+        }
+        return scalar->type;
+    }
+    if (*p == '+' || *p == '-')
+        p++;
+    for (; *p >= '0' && *p <= '9'; p++)
+        digits = true;
+    if (*p == '.') {
+        real = true;
+        for (p++; *p >= '0' && *p <= '9'; p++)
+            digits = true;
+    }
+    if (!digits)
+        return BSON_TYPE_UTF8;
+    if (*p == 'e' || *p == 'E') {
+        real = true;
+        p++;
+        if (*p == '+' || *p == '-')
+            p++;
+        if (!(*p >= '0' && *p <= '9'))
+            return BSON_TYPE_UTF8;
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+    if (*p != '\0')
+        return BSON_TYPE_UTF8;
+
+    if (!real) {
+        errno = 0;
+        scalar->ll = strtoll(value, NULL, 10);
+        if (errno != ERANGE) {
+            scalar->d = (double)scalar->ll;
+            return scalar->type = BSON_TYPE_INT64;
+        }
+    }
+    scalar->d = strtod(value, NULL);
+    return scalar->type = BSON_TYPE_DOUBLE;
+}
+
+/*
+ * as of res_config_mongodb.c before scalar_parse()
+ */
+static bool is_integer(const char* value, long long* result)
+{
+    int len;
+    long long dummy;
+    long long* p = result ? result : &dummy;
+
+    if (sscanf(value, "%Ld%n", p, &len) == 0)
+        return false;
+    if (value[len] != '\0')
+        return false;
+    return true;
+}
+
+static bool is_real(const char* value, double* result)
+{
+    int len;
+    double dummy;
+    double* p = result ? result : &dummy;
+
+    if (sscanf(value, "%lg%n", p, &len) == 0)
+        return false;
+    if (value[len] != '\0')
+        return false;
+    return true;
+}
+
+static bool is_bool(const char* value, bool* result) {
+    bool dummy;
+    bool* p = result ? result : &dummy;
+
+    if (strcmp(value, "true") == 0) {
+        *p = true;
+        return true;
+    }
+    if (strcmp(value, "false") == 0) {
+        *p = false;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * values of realtime fields, e.g. of ps_endpoints and sippeers
+ */
+static const char *values[] = {
+    "true", "false", "yes", "no",
+    "0", "1", "5060", "-1", "1544000000",
+    "0.5", "3.14159", "1e3",
+    "SIP/100-00000001", "from-internal", "ulaw,alaw,g722",
+    "192.168.0.1", "2019-01-01 00:00:00", "6001",
+    "t38", "unicast",
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// keep the compiler from dropping the results
+static volatile double sink;
+
+/*
+ * what fields2doc() did per value, i.e. to classify it and convert it again
+ * for a field registered as integer, and what make_query() did for $gt and $lte.
+ */
+static bson_type_t old_parse(const char *value, struct scalar *scalar)
+{
+    if (is_bool(value, NULL)) {
+        scalar->b = strcmp(value, "true") ? false : true;
+        return BSON_TYPE_BOOL;
+    }
+    if (is_real(value, NULL)) {
+        if (is_integer(value, &scalar->ll))
+            scalar->ll = atoll(value);
+        scalar->d = atof(value);
+        return BSON_TYPE_DOUBLE;
+    }
+    return BSON_TYPE_UTF8;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned rounds = argc > 1 ? (unsigned)atoi(argv[1]) : 200000;
+    size_t count = sizeof(values) / sizeof(values[0]);
+    struct scalar scalar;
+    double start, old_sec, new_sec;
+    unsigned r;
+    size_t i;
+
+    // both must agree on numbers, bools and strings of the set
+    for (i = 0; i < count; i++) {
+        struct scalar a, b;
+        bson_type_t old_type = old_parse(values[i], &a);
+        bson_type_t new_type = scalar_parse(values[i], &b);
+
+        if (new_type == BSON_TYPE_INT64)
+            new_type = BSON_TYPE_DOUBLE;
+        if (old_type != new_type || (old_type == BSON_TYPE_DOUBLE && a.d != b.d)) {
+            fprintf(stderr, "mismatch: %s\n", values[i]);
+            return 1;
+        }
+    }
+
+    start = now();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < count; i++) {
+            old_parse(values[i], &scalar);
+            sink = scalar.d;
+        }
+    }
+    old_sec = now() - start;
+
+    start = now();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < count; i++) {
+            scalar_parse(values[i], &scalar);
+            sink = scalar.d;
+        }
+    }
+    new_sec = now() - start;
+
+    printf("%zu values x %u rounds\n", count, rounds);
+    printf("is_bool/is_real/is_integer + ato*: %8.1f ns/value\n", old_sec * 1e9 / ((double)rounds * count));
+    printf("scalar_parse:                      %8.1f ns/value\n", new_sec * 1e9 / ((double)rounds * count));
+    printf("speedup:                           %8.1fx\n", old_sec / new_sec);
+    return 0;
+}
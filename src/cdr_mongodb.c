@@ -56,92 +56,443 @@ enum {
     CONFIG_REGISTERED = 1 << 0,
 };
 
+enum {
+    INSERT_SUCCEEDED = 0,
+    INSERT_FAILED = -1,
+    INSERT_UNREACHABLE = -2,
+};
+
+enum {
+    DUPLICATE_KEY = 11000,  // error code of MongoDB
+};
+
+/*!
+ * \brief types of cdr fields to be encoded.
+ */
+enum {
+    FIELD_STRING,           // char array
+    FIELD_LONG,             // long, encoded as int32
+    FIELD_INT,              // int
+    FIELD_TIMEVAL,          // struct timeval
+    FIELD_DISPOSITION,      // long, encoded as its name
+    FIELD_AMAFLAGS,         // long, encoded as its name
+};
+
+// key of a field in documents and where the value is in struct ast_cdr
+#define CDR_FIELD(name, type) { #name, type, offsetof(struct ast_cdr, name) }
+
+static const struct ast_mongo_field cdr_fields[] = {
+    CDR_FIELD(clid, FIELD_STRING),
+    CDR_FIELD(src, FIELD_STRING),
+    CDR_FIELD(dst, FIELD_STRING),
+    CDR_FIELD(dcontext, FIELD_STRING),
+    CDR_FIELD(channel, FIELD_STRING),
+    CDR_FIELD(dstchannel, FIELD_STRING),
+    CDR_FIELD(lastapp, FIELD_STRING),
+    CDR_FIELD(lastdata, FIELD_STRING),
+    CDR_FIELD(disposition, FIELD_DISPOSITION),
+    CDR_FIELD(amaflags, FIELD_AMAFLAGS),
+    CDR_FIELD(accountcode, FIELD_STRING),
+    CDR_FIELD(uniqueid, FIELD_STRING),
+    CDR_FIELD(userfield, FIELD_STRING),
+    CDR_FIELD(peeraccount, FIELD_STRING),
+    CDR_FIELD(linkedid, FIELD_STRING),
+    CDR_FIELD(duration, FIELD_LONG),
+    CDR_FIELD(billsec, FIELD_LONG),
+    CDR_FIELD(sequence, FIELD_INT),
+    CDR_FIELD(start, FIELD_TIMEVAL),
+    CDR_FIELD(answer, FIELD_TIMEVAL),
+    CDR_FIELD(end, FIELD_TIMEVAL),
+};
+
+// names of dispositions and amaflags, resolved once
+static const char *dispositions[32];
+static const char *amaflags[8];
+
 static struct ast_flags config = { 0 };
+
+// configuration of writing, replaced on reload under config_lock, which writers hold for reading
+AST_RWLOCK_DEFINE_STATIC(config_lock);
 static char *dbname = NULL;
 static char *dbcollection = NULL;
 static mongoc_client_pool_t *dbpool = NULL;
 static bson_oid_t *serverid = NULL;
-static void* apm_context = NULL;
-static int apm_enabled = 0;
 
-static int mongodb_log(struct ast_cdr *cdr)
+// for asynchronous writing
+static struct ast_mongo_queue queue;
+static pthread_t writer_thread = AST_PTHREADT_NULL;     // protected by queue.lock
+static int writer_stop = 0;
+static unsigned async_enabled = 0;
+static unsigned queue_size = 10000;     // max number of queued records
+static unsigned batch_size = 100;       // max number of records per insertion
+static unsigned max_delay = 1000;       // msec
+
+// for spooling while MongoDB is unreachable
+static struct ast_mongo_spool *spool = NULL;
+static char *spool_path = NULL;
+static unsigned long spool_size = 64 * 1024 * 1024;
+
+// for write concern, built once per load
+static struct ast_mongo_write_opts write_opts;
+static struct ast_mongo_writer_stats stats = { .name = "cdr" };
+
+static unsigned skip_empty = 0;
+
+// fields to be encoded, in order, routed by start
+static struct ast_mongo_plan plan;
+
+// for time-bucketed collections
+static struct ast_mongo_indexer *indexer = NULL;
+
+static const char *disposition2str(long disposition)
+{
+    if (disposition >= 0 && disposition < ARRAY_LEN(dispositions) && dispositions[disposition])
+        return dispositions[disposition];
+    return ast_cdr_disp2str(disposition);
+}
+
+static const char *amaflags2str(long flags)
 {
-    int ret = -1;
-    bson_t *doc = NULL;
-    mongoc_collection_t *collection = NULL;
+    if (flags >= 0 && flags < ARRAY_LEN(amaflags) && amaflags[flags])
+        return amaflags[flags];
+    return ast_channel_amaflags2string(flags);
+}
+
+/*!
+ * \brief make a document from a cdr
+ * \param cdr
+ * \retval a bson document to insert,
+ * \retval NULL if something wrong.
+ */
+static bson_t *cdr2doc(struct ast_cdr *cdr)
+{
+    bson_t *doc = ast_mongo_doc_get(&queue);
+    unsigned i;
+
+    if(doc == NULL) {
+        ast_log(LOG_ERROR, "cannot make a document\n");
+        return NULL;
+    }
+    if (spool_path) {
+        // to ignore duplicates when replaying spooled records
+        bson_oid_t oid;
+        bson_oid_init(&oid, NULL);
+        BSON_APPEND_OID(doc, "_id", &oid);
+    }
+    ast_rwlock_rdlock(&plan.lock);
+    for (i = 0; i < plan.count; i++) {
+        const struct ast_mongo_field *field = plan.entries[i].field;
+        const char *key = plan.entries[i].key;
+        int length = plan.entries[i].length;
+        const char *value = (const char *)cdr + field->offset;
+
+        switch (field->type) {
+        case FIELD_STRING:
+            if (!skip_empty || *value)
+                bson_append_utf8(doc, key, length, value, -1);
+            break;
+        case FIELD_LONG:
+            bson_append_int32(doc, key, length, *(const long *)value);
+            break;
+        case FIELD_INT:
+            bson_append_int32(doc, key, length, *(const int *)value);
+            break;
+        case FIELD_TIMEVAL:
+            bson_append_timeval(doc, key, length, (struct timeval *)value);
+            break;
+        case FIELD_DISPOSITION:
+            bson_append_utf8(doc, key, length, disposition2str(*(const long *)value), -1);
+            break;
+        case FIELD_AMAFLAGS:
+            bson_append_utf8(doc, key, length, amaflags2str(*(const long *)value), -1);
+            break;
+        }
+    }
+    ast_rwlock_unlock(&plan.lock);
+    if (serverid)
+        BSON_APPEND_OID(doc, SERVERID, serverid);
+    return doc;
+}
+
+/*!
+ * \brief insert documents into the cdr collection, a round trip per bucket
+ * \param docs
+ * \param count   is number of documents in docs
+ * \param opts    for insertion, or NULL
+ * \retval INSERT_SUCCEEDED
+ * \retval INSERT_FAILED
+ * \retval INSERT_UNREACHABLE if no server is available to write
+ */
+static int insert_docs(const bson_t **docs, size_t count, const bson_t *opts)
+{
+    int ret = INSERT_SUCCEEDED;
+    mongoc_client_t *dbclient;
+    struct timeval start;
+    size_t begin;
+    size_t n;
 
     if(dbpool == NULL) {
         ast_log(LOG_ERROR, "unexpected error, no connection pool\n");
-        return ret;
+        return INSERT_FAILED;
     }
 
-    mongoc_client_t *dbclient = mongoc_client_pool_pop(dbpool);
+    start = ast_tvnow();
+    dbclient = mongoc_client_pool_pop(dbpool);
+    ast_mongo_histogram_add(&stats.pop, start);
     if(dbclient == NULL) {
         ast_log(LOG_ERROR, "unexpected error, no client allocated\n");
-        return ret;
+        return INSERT_FAILED;
     }
 
-    do {
+    for (begin = 0; begin < count; begin += n) {
+        char name[AST_MONGO_COLLECTION_NAME_SIZE];
+        mongoc_collection_t *collection;
         bson_error_t error;
+        bool unreachable;
+        bool ok;
+
+        n = ast_mongo_docs_route(&plan, dbcollection, indexer, docs + begin, count - begin, name, sizeof(name));
+        collection = ast_mongo_collection_get(dbpool, dbclient, dbname, name);
+        if(collection == NULL) {
+            ast_log(LOG_ERROR, "cannot get such a collection, %s, %s\n", dbname, name);
+            ret = INSERT_FAILED;
+            continue;
+        }
+        start = ast_tvnow();
+        if (n == 1)
+            ok = mongoc_collection_insert_one(collection, docs[begin], opts, NULL, &error);
+        else
+            ok = mongoc_collection_insert_many(collection, docs + begin, n, opts, NULL, &error);
+        ast_mongo_histogram_add(&stats.insert, start);
+        ast_mongo_writer_sent(&stats, docs + begin, n);
+        unreachable = !ok && (error.domain == MONGOC_ERROR_SERVER_SELECTION || error.domain == MONGOC_ERROR_STREAM);
+        // records handed to the spool are counted when replayed
+        if (!unreachable || !spool)
+            ast_mongo_writer_count(&stats, write_opts.write_concern, ok, n);
+        if (!ok) {
+            if (unreachable) {
+                ast_log(LOG_ERROR, "insertion of %zu records failed, %s\n", n, error.message);
+                ret = INSERT_UNREACHABLE;
+                break;  // so will the rest
+            }
+            if (error.code == DUPLICATE_KEY)
+                ast_log(LOG_DEBUG, "insertion of %zu records, %s\n", n, error.message);
+            else
+                ast_log(LOG_ERROR, "insertion of %zu records failed, %s\n", n, error.message);
+            ret = INSERT_FAILED;
+        }
+    }
+
+    ast_mongo_client_push(dbpool, dbclient);
+    return ret;
+}
+
+static int spool_docs(const bson_t **docs, size_t count)
+{
+    int ret = 0;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (ast_mongo_spool_append(spool, docs[i]))
+            ret = -1;
+    }
+    return ret;
+}
+
+/*!
+ * \brief replay spooled records, called back by the spool.
+ * \retval -1 to keep them in the spool while the server is unreachable.
+ */
+static int replay_docs(const bson_t **docs, size_t count, void *data)
+{
+    int ret;
+
+    ast_rwlock_rdlock(&config_lock);
+    ret = insert_docs(docs, count, write_opts.unordered);
+    ast_rwlock_unlock(&config_lock);
+    return ret == INSERT_UNREACHABLE ? -1 : 0;
+}
+
+/*!
+ * \brief write documents into the cdr collection,
+ * or the spool while the server is unreachable.
+ * \retval 0 on success
+ * \retval -1 on failure
+ * \retval INSERT_UNREACHABLE if the server is unreachable without any spool
+ */
+static int write_docs(const bson_t **docs, size_t count)
+{
+    int ret;
+
+    ast_rwlock_rdlock(&config_lock);
+    // keep order of records behind the spooled ones
+    if (spool && (!ast_mongo_pool_writable(dbpool) || !ast_mongo_spool_is_empty(spool)))
+        ret = spool_docs(docs, count);
+    else {
+        ret = insert_docs(docs, count, write_opts.ordered);
+        if (ret == INSERT_UNREACHABLE && spool)
+            ret = spool_docs(docs, count);
+    }
+    ast_rwlock_unlock(&config_lock);
+    return ret;
+}
 
-        doc = bson_new();
-        if(doc == NULL) {
-            ast_log(LOG_ERROR, "cannot make a document\n");
+/*!
+ * \brief background writer which flushes queued records,
+ * when batch_size records are queued or the oldest one has waited max_delay msec.
+ */
+static void *writer_run(void *data)
+{
+    bson_t **batch = ast_calloc(batch_size, sizeof(*batch));
+    unsigned limit = batch_size;
+
+    if (batch == NULL) {
+        ast_log(LOG_ERROR, "not enough memory for batch\n");
+        return NULL;
+    }
+
+    ast_mutex_lock(&queue.lock);
+    for (;;) {
+        unsigned count;
+        int ret = INSERT_SUCCEEDED;
+
+        while (!writer_stop && queue.count < limit) {
+            if (queue.count == 0)
+                ast_cond_wait(&queue.cond, &queue.lock);
+            else {
+                struct timeval deadline = ast_tvadd(queue.oldest, ast_samp2tv(max_delay, 1000));
+                struct timespec ts = {
+                    .tv_sec = deadline.tv_sec,
+                    .tv_nsec = deadline.tv_usec * 1000,
+                };
+                if (ast_cond_timedwait(&queue.cond, &queue.lock, &ts) == ETIMEDOUT)
+                    break;
+            }
+        }
+        if (queue.count == 0 && writer_stop)
             break;
+
+        for (count = 0; count < limit && queue.count > 0; count++, queue.count--) {
+            batch[count] = queue.docs[queue.head];
+            queue.head = (queue.head + 1) % queue.capacity;
         }
-        mongoc_collection_t *collection = mongoc_client_get_collection(dbclient, dbname, dbcollection);
-        if(collection == NULL) {
-            ast_log(LOG_ERROR, "cannot get such a collection, %s, %s\n", dbname, dbcollection);
+        stats.queued = queue.count;
+        if (queue.count)
+            queue.oldest = ast_tvnow();
+        ast_mutex_unlock(&queue.lock);
+
+        if (count)
+            ret = write_docs((const bson_t **)batch, count);
+
+        ast_mutex_lock(&queue.lock);
+        ast_mongo_docs_put(&queue, batch, count);
+        if (ret == INSERT_UNREACHABLE && writer_stop && queue.count) {
+            // each batch would wait for the server selection in vain
+            ast_log(LOG_WARNING, "%u records dropped on shutdown, MongoDB is unreachable\n",
+                ast_mongo_queue_drop(&queue));
+        }
+    }
+    ast_mutex_unlock(&queue.lock);
+
+    ast_free(batch);
+    return NULL;
+}
+
+static int writer_start(void)
+{
+    int res = 0;
+
+    ast_mutex_lock(&queue.lock);
+    do {
+        if (writer_thread != AST_PTHREADT_NULL)
+            break;
+        if (ast_mongo_queue_resize(&queue, queue_size)) {
+            res = -1;
             break;
         }
-        BSON_APPEND_UTF8(doc, "clid", cdr->clid);
-        BSON_APPEND_UTF8(doc, "src", cdr->src);
-        BSON_APPEND_UTF8(doc, "dst", cdr->dst);
-        BSON_APPEND_UTF8(doc, "dcontext", cdr->dcontext);
-        BSON_APPEND_UTF8(doc, "channel", cdr->channel);
-        BSON_APPEND_UTF8(doc, "dstchannel", cdr->dstchannel);
-        BSON_APPEND_UTF8(doc, "lastapp", cdr->lastapp);
-        BSON_APPEND_UTF8(doc, "lastdata", cdr->lastdata);
-        BSON_APPEND_UTF8(doc, "disposition", ast_cdr_disp2str(cdr->disposition));
-        BSON_APPEND_UTF8(doc, "amaflags", ast_channel_amaflags2string(cdr->amaflags));
-        BSON_APPEND_UTF8(doc, "accountcode", cdr->accountcode);
-        BSON_APPEND_UTF8(doc, "uniqueid", cdr->uniqueid);
-        BSON_APPEND_UTF8(doc, "userfield", cdr->userfield);
-        BSON_APPEND_UTF8(doc, "peeraccount", cdr->peeraccount);
-        BSON_APPEND_UTF8(doc, "linkedid", cdr->linkedid);
-        BSON_APPEND_INT32(doc, "duration", cdr->duration);
-        BSON_APPEND_INT32(doc, "billsec", cdr->billsec);
-        BSON_APPEND_INT32(doc, "sequence", cdr->sequence);
-        BSON_APPEND_TIMEVAL(doc, "start", &cdr->start);
-        BSON_APPEND_TIMEVAL(doc, "answer", &cdr->answer);
-        BSON_APPEND_TIMEVAL(doc, "end", &cdr->end);
-        if (serverid)
-            BSON_APPEND_OID(doc, SERVERID, serverid);
-
-        if(!mongoc_collection_insert(collection, MONGOC_INSERT_NONE, doc, NULL, &error))
-            ast_log(LOG_ERROR, "insertion failed, %s\n", error.message);
-
-        ret = 0; // success
+        queue.batch_size = batch_size;
+        writer_stop = 0;
+        if (ast_pthread_create_background(&writer_thread, NULL, writer_run, NULL)) {
+            ast_log(LOG_ERROR, "unable to start the cdr writer\n");
+            writer_thread = AST_PTHREADT_NULL;
+            res = -1;
+            break;
+        }
+        queue.writers = 1;
     } while(0);
+    ast_mutex_unlock(&queue.lock);
+    return res;
+}
 
-    if (collection)
-        mongoc_collection_destroy(collection);
-    if (doc)
-        bson_destroy(doc);
-    mongoc_client_pool_push(dbpool, dbclient);
-    return ret;
+/*!
+ * \brief stop the writer after all of queued records have been flushed.
+ */
+static void writer_shutdown(void)
+{
+    pthread_t thread;
+
+    ast_mutex_lock(&queue.lock);
+    thread = writer_thread;
+    writer_stop = 1;
+    ast_cond_signal(&queue.cond);
+    ast_mutex_unlock(&queue.lock);
+
+    if (thread == AST_PTHREADT_NULL)
+        return;
+    pthread_join(thread, NULL);
+
+    ast_mutex_lock(&queue.lock);
+    writer_thread = AST_PTHREADT_NULL;
+    queue.writers = 0;
+    ast_mutex_unlock(&queue.lock);
+}
+
+static int mongodb_log(struct ast_cdr *cdr)
+{
+    int ret;
+    struct timeval start = ast_tvnow();
+    bson_t *doc = cdr2doc(cdr);
+
+    ast_mongo_histogram_add(&stats.encode, start);
+    if (doc == NULL)
+        return -1;
+
+    if (async_enabled && ast_mongo_queue_push(&queue, doc) == 0)
+        return 0;
+
+    ret = write_docs((const bson_t **)&doc, 1);
+    ast_mutex_lock(&queue.lock);
+    ast_mongo_docs_put(&queue, &doc, 1);
+    ast_mutex_unlock(&queue.lock);
+    return ret ? -1 : 0;
 }
 
 static int mongodb_load_module(int reload)
 {
     int res = -1;
     struct ast_config *cfg = NULL;
-    mongoc_uri_t *uri = NULL;
+    const char *uri = NULL;
+    char *new_dbname = NULL;
+    char *new_dbcollection = NULL;
+    char *new_spool_path = NULL;
+    mongoc_client_pool_t *new_pool = NULL;
+    struct ast_mongo_indexer *new_indexer = NULL;
+    struct ast_mongo_write_opts new_write_opts = { 0 };
+    struct ast_mongo_spool *old_spool;
 
     do {
         const char *tmp;
+        const char *database;
+        const char *collection;
         struct ast_variable *var;
         struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
+        bson_oid_t oid;
+        unsigned new_async = 0;
+        unsigned new_queue_size = 10000;
+        unsigned new_batch_size = 100;
+        unsigned new_max_delay = 1000;
+        unsigned new_skip_empty = 0;
+        unsigned long new_spool_size = 64 * 1024 * 1024;
 
         cfg = ast_config_load(CONFIG_FILE, config_flags);
         if (!cfg || cfg == CONFIG_STATUS_FILEINVALID) {
@@ -162,34 +513,54 @@ static int mongodb_load_module(int reload)
             ast_log(LOG_WARNING, "no uri specified.\n");
             break;
         }
-        uri = mongoc_uri_new(tmp);
-        if (uri == NULL) {
-            ast_log(LOG_ERROR, "parsing uri error, %s\n", tmp);
-            break;
-        }
+        uri = tmp;
 
-        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, DATABSE)) == NULL) {
+        if ((database = ast_variable_retrieve(cfg, CATEGORY, DATABSE)) == NULL) {
             ast_log(LOG_WARNING, "no database specified.\n");
             break;
         }
-        if (dbname)
-            ast_free(dbname);
-        dbname = ast_strdup(tmp);
-        if (dbname == NULL) {
-            ast_log(LOG_ERROR, "not enough memory for dbname\n");
+        if ((collection = ast_variable_retrieve(cfg, CATEGORY, COLLECTION)) == NULL) {
+            ast_log(LOG_WARNING, "no collection specified.\n");
             break;
         }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, SERVERID)) != NULL) {
+            if (!bson_oid_is_valid (tmp, strlen(tmp))) {
+                ast_log(LOG_ERROR, "invalid server id specified.\n");
+                break;
+            }
+            bson_oid_init_from_string(&oid, tmp);
+        }
 
-        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, COLLECTION)) == NULL) {
-            ast_log(LOG_WARNING, "no collection specified.\n");
-            break;
+        // options are parsed into locals, to be applied once the writer has stopped
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "async"))
+        && (sscanf(tmp, "%u", &new_async) != 1)) {
+           ast_log(LOG_WARNING, "async must be a 0|1, not '%s'\n", tmp);
+           new_async = 0;
         }
-        if (dbcollection)
-            ast_free(dbcollection);
-        dbcollection = ast_strdup(tmp);
-        if (dbcollection == NULL) {
-            ast_log(LOG_ERROR, "not enough memory for dbcollection\n");
-            break;
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "queue_size"))
+        && (sscanf(tmp, "%u", &new_queue_size) != 1 || new_queue_size == 0)) {
+           ast_log(LOG_WARNING, "queue_size must be a positive number, not '%s'\n", tmp);
+           new_queue_size = 10000;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "batch_size"))
+        && (sscanf(tmp, "%u", &new_batch_size) != 1 || new_batch_size == 0)) {
+           ast_log(LOG_WARNING, "batch_size must be a positive number, not '%s'\n", tmp);
+           new_batch_size = 100;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "max_delay"))
+        && (sscanf(tmp, "%u", &new_max_delay) != 1)) {
+           ast_log(LOG_WARNING, "max_delay must be a number in msec, not '%s'\n", tmp);
+           new_max_delay = 1000;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "skip_empty"))
+        && (sscanf(tmp, "%u", &new_skip_empty) != 1)) {
+           ast_log(LOG_WARNING, "skip_empty must be a 0|1, not '%s'\n", tmp);
+           new_skip_empty = 0;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "spool_size"))
+        && (sscanf(tmp, "%lu", &new_spool_size) != 1)) {
+           ast_log(LOG_WARNING, "spool_size must be a number in bytes, not '%s'\n", tmp);
+           new_spool_size = 64 * 1024 * 1024;
         }
 
         if (!ast_test_flag(&config, CONFIG_REGISTERED)) {
@@ -201,44 +572,96 @@ static int mongodb_load_module(int reload)
             ast_set_flag(&config, CONFIG_REGISTERED);
         }
 
-        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, SERVERID)) != NULL) {
-            if (!bson_oid_is_valid (tmp, strlen(tmp))) {
-                ast_log(LOG_ERROR, "invalid server id specified.\n");
-                break;
-            }
-            serverid = ast_malloc(sizeof(bson_oid_t));
-            if (serverid == NULL) {
-                ast_log(LOG_ERROR, "not enough memory\n");
+        if (ast_mongo_plan_build(&plan, ast_variable_retrieve(cfg, CATEGORY, "fields"),
+            ast_variable_retrieve(cfg, CATEGORY, "aliases")))
+            break;
+
+        // the new configuration is made apart, then swapped in under config_lock
+        new_dbname = ast_strdup(database);
+        new_dbcollection = ast_strdup(collection);
+        if (new_dbname == NULL || new_dbcollection == NULL) {
+            ast_log(LOG_ERROR, "not enough memory for dbname\n");
+            break;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "spool")) && !ast_strlen_zero(tmp)) {
+            new_spool_path = ast_strdup(tmp);
+            if (new_spool_path == NULL) {
+                ast_log(LOG_ERROR, "not enough memory for spool\n");
                 break;
             }
-            bson_oid_init_from_string(serverid, tmp);
         }
-
-        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "apm"))
-        && (sscanf(tmp, "%u", &apm_enabled) != 1)) {
-           ast_log(LOG_WARNING, "apm must be a 0|1, not '%s'\n", tmp);
-           apm_enabled = 0;
+        if (ast_variable_retrieve(cfg, CATEGORY, SERVERID) && serverid == NULL
+        && (serverid = ast_malloc(sizeof(bson_oid_t))) == NULL) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
         }
-
-        if (apm_context)
-            ast_mongo_apm_stop(apm_context);
-
-        if (dbpool)
-            mongoc_client_pool_destroy(dbpool);
-        dbpool = mongoc_client_pool_new(uri);
-        if (dbpool == NULL) {
+        if (ast_mongo_write_opts_build(&new_write_opts, cfg, CATEGORY)) {
+            ast_log(LOG_ERROR, "not enough memory for write concern\n");
+            break;
+        }
+        // acquire the new one before releasing the current one to keep sharing the same pool
+        new_pool = ast_mongo_pool_acquire(uri, cfg);
+        if (new_pool == NULL) {
             ast_log(LOG_ERROR, "cannot make a connection pool for MongoDB\n");
             break;
         }
+        {
+            bson_t *indexes = ast_mongo_indexes_new(cfg, CATEGORY);
+            if (indexes) {
+                new_indexer = ast_mongo_indexer_start(new_pool, new_dbname, new_dbcollection, indexes);
+                bson_destroy(indexes);
+            }
+        }
 
-        if (apm_enabled)
-            apm_context = ast_mongo_apm_start(dbpool);
+        // flush queued records through the current configuration before replacing it
+        writer_shutdown();
+        // close the spool before opening the same file again, apart from config_lock
+        // which its replayer takes
+        ast_rwlock_wrlock(&config_lock);
+        old_spool = spool;
+        spool = NULL;
+        ast_rwlock_unlock(&config_lock);
+        if (old_spool)
+            ast_mongo_spool_close(old_spool);
+
+        ast_rwlock_wrlock(&config_lock);
+        SWAP(dbname, new_dbname);
+        SWAP(dbcollection, new_dbcollection);
+        SWAP(spool_path, new_spool_path);
+        SWAP(dbpool, new_pool);
+        SWAP(indexer, new_indexer);
+        SWAP(write_opts, new_write_opts);
+        if (ast_variable_retrieve(cfg, CATEGORY, SERVERID))
+            bson_oid_copy(&oid, serverid);
+        async_enabled = new_async;
+        queue_size = new_queue_size;
+        batch_size = new_batch_size;
+        max_delay = new_max_delay;
+        skip_empty = new_skip_empty;
+        spool_size = new_spool_size;
+        if (spool_path) {
+            // its replayer waits for config_lock to write through the new configuration
+            spool = ast_mongo_spool_open(spool_path, spool_size, dbpool, replay_docs, NULL);
+            if (spool == NULL)
+                ast_log(LOG_WARNING, "records will not be spooled\n");
+        }
+        ast_rwlock_unlock(&config_lock);
+
+        if (async_enabled && writer_start()) {
+            ast_log(LOG_WARNING, "records will be written synchronously\n");
+        }
 
         res = 0; // suceess
     } while (0);
 
-    if (uri)
-       mongoc_uri_destroy(uri);
+    // the replaced configuration, or the new one if failed, nobody uses any longer
+    ast_free(new_dbname);
+    ast_free(new_dbcollection);
+    ast_free(new_spool_path);
+    ast_mongo_indexer_stop(new_indexer);
+    ast_mongo_pool_release(new_pool);
+    ast_mongo_write_opts_destroy(&new_write_opts);
+
     if (ast_test_flag(&config, CONFIG_REGISTERED) && (!cfg || dbname == NULL || dbcollection == NULL)) {
         ast_cdr_backend_suspend(NAME);
         ast_clear_flag(&config, CONFIG_REGISTERED);
@@ -252,21 +675,41 @@ static int mongodb_load_module(int reload)
 
 static int load_module(void)
 {
-    return mongodb_load_module(0);
+    int res;
+    unsigned i;
+
+    for (i = 0; i < ARRAY_LEN(dispositions); i++)
+        dispositions[i] = ast_cdr_disp2str(i);
+    for (i = 0; i < ARRAY_LEN(amaflags); i++)
+        amaflags[i] = ast_channel_amaflags2string(i);
+
+    ast_mongo_queue_init(&queue, &stats);
+    ast_mongo_plan_init(&plan, cdr_fields, ARRAY_LEN(cdr_fields), "start");
+    res = mongodb_load_module(0);
+    if (res == 0)
+        ast_mongo_writer_register(&stats);
+    return res;
 }
 
 static int unload_module(void)
 {
     if (ast_cdr_unregister(NAME))
         return -1;
+    writer_shutdown();
+    ast_mongo_queue_destroy(&queue);
+    ast_mongo_plan_destroy(&plan);
+    if (spool)
+        ast_mongo_spool_close(spool);
+    if (spool_path)
+        ast_free(spool_path);
     if (dbname)
         ast_free(dbname);
     if (dbcollection)
         ast_free(dbcollection);
-    if (apm_context)
-        ast_mongo_apm_stop(apm_context);
-    if (dbpool)
-        mongoc_client_pool_destroy(dbpool);
+    ast_mongo_indexer_stop(indexer);
+    ast_mongo_pool_release(dbpool);
+    ast_mongo_write_opts_destroy(&write_opts);
+    ast_mongo_writer_unregister(&stats);
     return 0;
 }
 
@@ -69,109 +69,593 @@ enum {
     CONFIG_REGISTERED = 1 << 0,
 };
 
+enum {
+    INSERT_SUCCEEDED = 0,
+    INSERT_FAILED = -1,
+    INSERT_UNREACHABLE = -2,
+};
+
+enum {
+    DUPLICATE_KEY = 11000,  // error code of MongoDB
+};
+
+/*!
+ * \brief types of cel fields to be encoded.
+ */
+enum {
+    FIELD_STRING,           // const char *
+    FIELD_INT,              // int
+    FIELD_TIMEVAL,          // struct timeval
+    FIELD_EVENTNAME,        // event_name, or user_defined_name of user defined events
+};
+
+// key of a field in documents and where the value is in struct ast_cel_event_record
+#define CEL_FIELD(key, member, type) { key, type, offsetof(struct ast_cel_event_record, member) }
+
+static const struct ast_mongo_field cel_fields[] = {
+    CEL_FIELD("eventtype", event_type, FIELD_INT),
+    CEL_FIELD("eventname", event_name, FIELD_EVENTNAME),
+    CEL_FIELD("cid_name", caller_id_name, FIELD_STRING),
+    CEL_FIELD("cid_num", caller_id_num, FIELD_STRING),
+    CEL_FIELD("cid_ani", caller_id_ani, FIELD_STRING),
+    CEL_FIELD("cid_rdnis", caller_id_rdnis, FIELD_STRING),
+    CEL_FIELD("cid_dnid", caller_id_dnid, FIELD_STRING),
+    CEL_FIELD("exten", extension, FIELD_STRING),
+    CEL_FIELD("context", context, FIELD_STRING),
+    CEL_FIELD("channame", channel_name, FIELD_STRING),
+    CEL_FIELD("appname", application_name, FIELD_STRING),
+    CEL_FIELD("appdata", application_data, FIELD_STRING),
+    CEL_FIELD("accountcode", account_code, FIELD_STRING),
+    CEL_FIELD("peeraccount", peer_account, FIELD_STRING),
+    CEL_FIELD("uniqueid", unique_id, FIELD_STRING),
+    CEL_FIELD("linkedid", linked_id, FIELD_STRING),
+    CEL_FIELD("userfield", user_field, FIELD_STRING),
+    CEL_FIELD("peer", peer, FIELD_STRING),
+    CEL_FIELD("extra", extra, FIELD_STRING),
+    CEL_FIELD("eventtime", event_time, FIELD_TIMEVAL),
+};
+
 static struct ast_flags config = { 0 };
+
+// configuration of writing, replaced on reload under config_lock, which writers hold for reading
+AST_RWLOCK_DEFINE_STATIC(config_lock);
 static char *dbname = NULL;
 static char *dbcollection = NULL;
 static mongoc_client_pool_t *dbpool = NULL;
 static bson_oid_t *serverid = NULL;
-static void* apm_context = NULL;
-static int apm_enabled = 0;
 
-static void mongodb_log(struct ast_event *event)
+// for pipelined bulk writing
+static struct ast_mongo_queue queue;
+static pthread_t *writers = NULL;       // protected by queue.lock, as the rest
+static int writers_stop = 0;
+static unsigned stats_batches = 0;
+static unsigned stats_inserted = 0;
+static unsigned stats_failed = 0;
+static unsigned bulk_enabled = 0;
+static unsigned writers_size = 2;       // max number of batches in flight
+static unsigned queue_size = 10000;     // max number of queued events
+static unsigned batch_size = 100;       // max number of events per batch
+static unsigned flush_interval = 1000;  // msec
+
+// for spooling while MongoDB is unreachable
+static struct ast_mongo_spool *spool = NULL;
+static char *spool_path = NULL;
+static unsigned long spool_size = 64 * 1024 * 1024;
+
+// for write concern, built once per load
+static struct ast_mongo_write_opts write_opts;
+static struct ast_mongo_writer_stats stats = { .name = "cel" };
+
+static unsigned skip_empty = 0;
+
+// fields to be encoded, in order, routed by eventtime
+static struct ast_mongo_plan plan;
+
+// for time-bucketed collections
+static struct ast_mongo_indexer *indexer = NULL;
+
+/*!
+ * \brief make a document from a cel event
+ * \param event
+ * \retval a bson document to insert,
+ * \retval NULL if something wrong.
+ */
+static bson_t *event2doc(struct ast_event *event)
 {
     bson_t *doc = NULL;
+    unsigned i;
+
+    struct ast_cel_event_record record = {
+    	.version = AST_CEL_EVENT_RECORD_VERSION,
+    };
+
+    if (ast_cel_fill_record(event, &record)) {
+        ast_log(LOG_ERROR, "unexpected error, failed to extract event data\n");
+	return NULL;
+    }
+
+    doc = ast_mongo_doc_get(&queue);
+    if(doc == NULL) {
+        ast_log(LOG_ERROR, "cannot make a document\n");
+        return NULL;
+    }
+    if (spool_path) {
+        // to ignore duplicates when replaying spooled events
+        bson_oid_t oid;
+        bson_oid_init(&oid, NULL);
+        BSON_APPEND_OID(doc, "_id", &oid);
+    }
+    ast_rwlock_rdlock(&plan.lock);
+    for (i = 0; i < plan.count; i++) {
+        const struct ast_mongo_field *field = plan.entries[i].field;
+        const char *key = plan.entries[i].key;
+        int length = plan.entries[i].length;
+        const char *value = (const char *)&record + field->offset;
+
+        switch (field->type) {
+        case FIELD_STRING:
+            value = *(const char * const *)value;
+            if (!skip_empty || !ast_strlen_zero(value))
+                bson_append_utf8(doc, key, length, value, -1);
+            break;
+        case FIELD_INT:
+            bson_append_int32(doc, key, length, *(const int *)value);
+            break;
+        case FIELD_TIMEVAL:
+            bson_append_timeval(doc, key, length, (struct timeval *)value);
+            break;
+        case FIELD_EVENTNAME:
+            /* Handle user define events */
+            value = record.event_type == AST_CEL_USER_DEFINED
+                ? record.user_defined_name : record.event_name;
+            bson_append_utf8(doc, key, length, value, -1);
+            break;
+        }
+    }
+    ast_rwlock_unlock(&plan.lock);
+    if (serverid)
+        BSON_APPEND_OID(doc, SERVERID, serverid);
+    return doc;
+}
+
+/*!
+ * \brief check if the error shows no server is available to write.
+ */
+static bool is_unreachable(const bson_error_t *error)
+{
+    return error->domain == MONGOC_ERROR_SERVER_SELECTION || error->domain == MONGOC_ERROR_STREAM;
+}
+
+/*!
+ * \brief insert a document synchronously
+ * \retval INSERT_SUCCEEDED
+ * \retval INSERT_FAILED
+ * \retval INSERT_UNREACHABLE if no server is available to write
+ */
+static int insert_doc(const bson_t *doc)
+{
+    int ret = INSERT_FAILED;
     mongoc_collection_t *collection = NULL;
-    const char *name;
-//    struct ast_tm tm;
-//    char timestr[128];
+    mongoc_client_t *dbclient;
+    struct timeval start;
 
     if(dbpool == NULL) {
         ast_log(LOG_ERROR, "unexpected error, no connection pool\n");
-        return;
+        return ret;
     }
 
-    mongoc_client_t *dbclient = mongoc_client_pool_pop(dbpool);
+    start = ast_tvnow();
+    dbclient = mongoc_client_pool_pop(dbpool);
+    ast_mongo_histogram_add(&stats.pop, start);
     if(dbclient == NULL) {
         ast_log(LOG_ERROR, "unexpected error, no client allocated\n");
-        return;
+        return ret;
     }
 
-    struct ast_cel_event_record record = {
-    	.version = AST_CEL_EVENT_RECORD_VERSION,
-    };
+    do {
+        char name[AST_MONGO_COLLECTION_NAME_SIZE];
+        bson_error_t error;
+        bool ok;
 
-    if (ast_cel_fill_record(event, &record)) {
-        ast_log(LOG_ERROR, "unexpected error, failed to extract event data\n");
-	return;
-    }
-    /* Handle user define events */
-    name = record.event_name;
-    if (record.event_type == AST_CEL_USER_DEFINED) {
-	name = record.user_defined_name;
+        ast_mongo_docs_route(&plan, dbcollection, indexer, &doc, 1, name, sizeof(name));
+        collection = ast_mongo_collection_get(dbpool, dbclient, dbname, name);
+        if(collection == NULL) {
+            ast_log(LOG_ERROR, "cannot get such a collection, %s, %s\n", dbname, name);
+            break;
+        }
+        start = ast_tvnow();
+        ok = mongoc_collection_insert_one(collection, doc, write_opts.ordered, NULL, &error);
+        ast_mongo_histogram_add(&stats.insert, start);
+        ast_mongo_writer_sent(&stats, &doc, 1);
+        if (!ok) {
+            ast_log(LOG_ERROR, "insertion failed, %s\n", error.message);
+            if (is_unreachable(&error))
+                ret = INSERT_UNREACHABLE;
+            // events handed to the spool are counted when replayed
+            if (ret != INSERT_UNREACHABLE || !spool)
+                ast_mongo_writer_count(&stats, write_opts.write_concern, 0, 1);
+            break;
+        }
+        ast_mongo_writer_count(&stats, write_opts.write_concern, 1, 1);
+        ret = INSERT_SUCCEEDED;
+    } while(0);
+
+    ast_mongo_client_push(dbpool, dbclient);
+    return ret;
+}
+
+/*!
+ * \brief count write errors of a bulk operation which show the documents already exist.
+ */
+static int count_duplicates(const bson_t *reply)
+{
+    int duplicates = 0;
+    bson_iter_t iter;
+    bson_iter_t errors;
+
+    if (bson_iter_init_find(&iter, reply, "writeErrors")
+    && BSON_ITER_HOLDS_ARRAY(&iter)
+    && bson_iter_recurse(&iter, &errors)) {
+        while (bson_iter_next(&errors)) {
+            bson_iter_t code;
+            if (BSON_ITER_HOLDS_DOCUMENT(&errors)
+            && bson_iter_recurse(&errors, &code)
+            && bson_iter_find(&code, "code")
+            && bson_iter_as_int64(&code) == DUPLICATE_KEY)
+                duplicates++;
+        }
     }
-    
-//  ast_localtime(&record.event_time, &tm, NULL);
-//  ast_strftime(timestr, sizeof(timestr), DATE_FORMAT, &tm);
-    
+    return duplicates;
+}
+
+/*!
+ * \brief insert documents into a collection with an unordered bulk operation,
+ * then report how many of them succeeded or failed.
+ * \param dbclient
+ * \param name    of the collection
+ * \param docs
+ * \param count   is number of documents in docs
+ * \retval INSERT_SUCCEEDED
+ * \retval INSERT_FAILED if any of them failed
+ * \retval INSERT_UNREACHABLE if no server is available to write
+ */
+static int insert_bucket(mongoc_client_t *dbclient, const char *name, const bson_t **docs, unsigned count)
+{
+    int ret = INSERT_FAILED;
+    mongoc_collection_t *collection = NULL;
+    mongoc_bulk_operation_t *bulk = NULL;
+    bson_t reply = BSON_INITIALIZER;
+    int inserted = 0;
+    int duplicates = 0;
+    int failed = count;
+
     do {
+        struct timeval start;
         bson_error_t error;
+        bson_iter_t iter;
+        unsigned i;
+        bool ok;
 
-        doc = bson_new();
-        if(doc == NULL) {
-            ast_log(LOG_ERROR, "cannot make a document\n");
+        collection = ast_mongo_collection_get(dbpool, dbclient, dbname, name);
+        if(collection == NULL) {
+            ast_log(LOG_ERROR, "cannot get such a collection, %s, %s\n", dbname, name);
             break;
         }
-        mongoc_collection_t *collection = mongoc_client_get_collection(dbclient, dbname, dbcollection);
-        if(collection == NULL) {
-            ast_log(LOG_ERROR, "cannot get such a collection, %s, %s\n", dbname, dbcollection);
+        bulk = mongoc_collection_create_bulk_operation_with_opts(collection, write_opts.unordered);
+        if (bulk == NULL) {
+            ast_log(LOG_ERROR, "cannot make a bulk operation\n");
             break;
         }
-        BSON_APPEND_INT32(doc, "eventtype", record.event_type);
-        BSON_APPEND_UTF8(doc, "eventname", name);
-        BSON_APPEND_UTF8(doc, "cid_name", record.caller_id_name);
-        BSON_APPEND_UTF8(doc, "cid_num", record.caller_id_num);
-        BSON_APPEND_UTF8(doc, "cid_ani", record.caller_id_ani);
-        BSON_APPEND_UTF8(doc, "cid_rdnis", record.caller_id_rdnis);
-        BSON_APPEND_UTF8(doc, "cid_dnid", record.caller_id_dnid);
-        BSON_APPEND_UTF8(doc, "exten", record.extension);
-        BSON_APPEND_UTF8(doc, "context", record.context);
-        BSON_APPEND_UTF8(doc, "channame", record.channel_name);
-        BSON_APPEND_UTF8(doc, "appname", record.application_name);
-        BSON_APPEND_UTF8(doc, "appdata", record.application_data);
-        BSON_APPEND_UTF8(doc, "accountcode", record.account_code);
-        BSON_APPEND_UTF8(doc, "peeraccount", record.peer_account);
-        BSON_APPEND_UTF8(doc, "uniqueid", record.unique_id);
-        BSON_APPEND_UTF8(doc, "linkedid", record.linked_id);
-        BSON_APPEND_UTF8(doc, "userfield", record.user_field);
-        BSON_APPEND_UTF8(doc, "peer", record.peer);
-        BSON_APPEND_UTF8(doc, "extra", record.extra);
-        BSON_APPEND_TIMEVAL(doc, "eventtime", &record.event_time);
-        if (serverid)
-            BSON_APPEND_OID(doc, SERVERID, serverid);
-
-        if(!mongoc_collection_insert(collection, MONGOC_INSERT_NONE, doc, NULL, &error))
-            ast_log(LOG_ERROR, "insertion failed, %s\n", error.message);
+        for (i = 0; i < count; i++)
+            mongoc_bulk_operation_insert(bulk, docs[i]);
+
+        start = ast_tvnow();
+        ok = mongoc_bulk_operation_execute(bulk, &reply, &error);
+        ast_mongo_histogram_add(&stats.insert, start);
+        ast_mongo_writer_sent(&stats, docs, count);
+        if (ok)
+            ret = INSERT_SUCCEEDED;
+        else if (is_unreachable(&error))
+            ret = INSERT_UNREACHABLE;
+        else
+            ast_log(LOG_DEBUG, "bulk insertion partially failed, %s\n", error.message);
+
+        if (ret == INSERT_SUCCEEDED && write_opts.write_concern
+        && !mongoc_write_concern_is_acknowledged(write_opts.write_concern))
+            inserted = count;   // no reply for unacknowledged writes
+        else if (bson_iter_init_find(&iter, &reply, "nInserted") && BSON_ITER_HOLDS_INT32(&iter))
+            inserted = bson_iter_int32(&iter);
+        duplicates = count_duplicates(&reply);
+        failed = count - inserted - duplicates;
+        // the rest, handed to the spool, is counted when replayed
+        if (ret == INSERT_UNREACHABLE && spool)
+            failed = 0;
+    } while(0);
+
+    ast_mongo_writer_count(&stats, write_opts.write_concern, 1, inserted);
+    ast_mongo_writer_count(&stats, write_opts.write_concern, 0, failed);
+
+    ast_mutex_lock(&queue.lock);
+    stats_batches++;
+    stats_inserted += inserted;
+    stats_failed += failed;
+    ast_mutex_unlock(&queue.lock);
+
+    if (ret == INSERT_UNREACHABLE)
+        ast_log(LOG_WARNING, "bulk of %u events, %d inserted, server unreachable\n", count, inserted);
+    else if (failed)
+        ast_log(LOG_WARNING, "bulk of %u events, %d inserted, %d failed\n", count, inserted, failed);
+    else
+        ast_log(LOG_DEBUG, "bulk of %u events, %d inserted, %d already exist\n", count, inserted, duplicates);
+
+    bson_destroy(&reply);
+    if (bulk)
+        mongoc_bulk_operation_destroy(bulk);
+    return ret;
+}
+
+/*!
+ * \brief insert documents with unordered bulk operations, one per bucket.
+ * \param docs
+ * \param count   is number of documents in docs
+ * \retval INSERT_SUCCEEDED
+ * \retval INSERT_FAILED if any of them failed
+ * \retval INSERT_UNREACHABLE if no server is available to write
+ */
+static int insert_bulk(const bson_t **docs, unsigned count)
+{
+    int ret = INSERT_SUCCEEDED;
+    mongoc_client_t *dbclient;
+    struct timeval start;
+    unsigned begin;
+    unsigned n;
+
+    if(dbpool == NULL) {
+        ast_log(LOG_ERROR, "unexpected error, no connection pool\n");
+        return INSERT_FAILED;
+    }
+
+    start = ast_tvnow();
+    dbclient = mongoc_client_pool_pop(dbpool);
+    ast_mongo_histogram_add(&stats.pop, start);
+    if(dbclient == NULL) {
+        ast_log(LOG_ERROR, "unexpected error, no client allocated\n");
+        return INSERT_FAILED;
+    }
+
+    for (begin = 0; begin < count; begin += n) {
+        char name[AST_MONGO_COLLECTION_NAME_SIZE];
+        int res;
+
+        n = ast_mongo_docs_route(&plan, dbcollection, indexer, docs + begin, count - begin, name, sizeof(name));
+        res = insert_bucket(dbclient, name, docs + begin, n);
+        if (res == INSERT_UNREACHABLE) {
+            ret = res;
+            break;  // so will the rest
+        }
+        if (res != INSERT_SUCCEEDED)
+            ret = res;
+    }
+
+    ast_mongo_client_push(dbpool, dbclient);
+    return ret;
+}
+
+/*!
+ * \brief replay spooled events, called back by the spool.
+ * \retval -1 to keep them in the spool while the server is unreachable.
+ */
+static int replay_docs(const bson_t **docs, size_t count, void *data)
+{
+    int ret;
+
+    ast_rwlock_rdlock(&config_lock);
+    ret = insert_bulk(docs, count);
+    ast_rwlock_unlock(&config_lock);
+    return ret == INSERT_UNREACHABLE ? -1 : 0;
+}
+
+/*!
+ * \brief write documents into the cel collection,
+ * or the spool while the server is unreachable.
+ * \param docs
+ * \param count   is number of documents in docs
+ * \param bulk    is non-zero to insert them with a bulk operation
+ * \retval INSERT_SUCCEEDED, also if spooled
+ * \retval INSERT_FAILED
+ * \retval INSERT_UNREACHABLE if the server is unreachable without any spool
+ */
+static int write_docs(const bson_t **docs, unsigned count, int bulk)
+{
+    int ret = INSERT_UNREACHABLE;
+    unsigned i;
+
+    ast_rwlock_rdlock(&config_lock);
+    // keep order of events behind the spooled ones
+    if (!spool || (ast_mongo_pool_writable(dbpool) && ast_mongo_spool_is_empty(spool)))
+        ret = bulk ? insert_bulk(docs, count) : insert_doc(docs[0]);
+    if (ret == INSERT_UNREACHABLE && spool) {
+        for (i = 0; i < count; i++)
+            ast_mongo_spool_append(spool, docs[i]);
+        ret = INSERT_SUCCEEDED;
+    }
+    ast_rwlock_unlock(&config_lock);
+    return ret;
+}
+
+/*!
+ * \brief one of background writers, each of them keeps a batch in flight.
+ * A batch is flushed when batch_size events are queued
+ * or the oldest one has waited flush_interval msec.
+ */
+static void *writer_run(void *data)
+{
+    bson_t **batch = ast_calloc(batch_size, sizeof(*batch));
+    unsigned limit = batch_size;
+
+    if (batch == NULL) {
+        ast_log(LOG_ERROR, "not enough memory for batch\n");
+        return NULL;
+    }
+
+    ast_mutex_lock(&queue.lock);
+    for (;;) {
+        unsigned count;
+        int ret = INSERT_SUCCEEDED;
+
+        while (!writers_stop && queue.count < limit) {
+            if (queue.count == 0)
+                ast_cond_wait(&queue.cond, &queue.lock);
+            else {
+                struct timeval deadline = ast_tvadd(queue.oldest, ast_samp2tv(flush_interval, 1000));
+                struct timespec ts = {
+                    .tv_sec = deadline.tv_sec,
+                    .tv_nsec = deadline.tv_usec * 1000,
+                };
+                if (ast_cond_timedwait(&queue.cond, &queue.lock, &ts) == ETIMEDOUT)
+                    break;
+            }
+        }
+        if (queue.count == 0 && writers_stop)
+            break;
 
+        for (count = 0; count < limit && queue.count > 0; count++, queue.count--) {
+            batch[count] = queue.docs[queue.head];
+            queue.head = (queue.head + 1) % queue.capacity;
+        }
+        stats.queued = queue.count;
+        if (queue.count) {
+            queue.oldest = ast_tvnow();
+            // let another writer take the rest while this batch is in flight
+            ast_cond_signal(&queue.cond);
+        }
+        ast_mutex_unlock(&queue.lock);
+
+        if (count)
+            ret = write_docs((const bson_t **)batch, count, 1);
+
+        ast_mutex_lock(&queue.lock);
+        ast_mongo_docs_put(&queue, batch, count);
+        if (ret == INSERT_UNREACHABLE && writers_stop && queue.count) {
+            // each batch would wait for the server selection in vain
+            ast_log(LOG_WARNING, "%u events dropped on shutdown, MongoDB is unreachable\n",
+                ast_mongo_queue_drop(&queue));
+        }
+    }
+    ast_mutex_unlock(&queue.lock);
+
+    ast_free(batch);
+    return NULL;
+}
+
+static int writers_start(void)
+{
+    int res = 0;
+
+    ast_mutex_lock(&queue.lock);
+    do {
+        if (queue.writers)
+            break;
+        if (ast_mongo_queue_resize(&queue, queue_size)) {
+            res = -1;
+            break;
+        }
+        writers = ast_calloc(writers_size, sizeof(*writers));
+        if (writers == NULL) {
+            ast_log(LOG_ERROR, "not enough memory for writers\n");
+            res = -1;
+            break;
+        }
+        queue.batch_size = batch_size;
+        writers_stop = 0;
+        for (; queue.writers < writers_size; queue.writers++) {
+            if (ast_pthread_create_background(&writers[queue.writers], NULL, writer_run, NULL)) {
+                ast_log(LOG_ERROR, "unable to start a cel writer\n");
+                break;
+            }
+        }
+        if (queue.writers == 0) {
+            ast_free(writers);
+            writers = NULL;
+            res = -1;
+        }
     } while(0);
+    ast_mutex_unlock(&queue.lock);
+    return res;
+}
+
+/*!
+ * \brief stop the writers after all of queued events have been flushed.
+ */
+static void writers_shutdown(void)
+{
+    unsigned i;
+
+    ast_mutex_lock(&queue.lock);
+    writers_stop = 1;
+    ast_cond_broadcast(&queue.cond);
+    ast_mutex_unlock(&queue.lock);
+
+    if (writers == NULL)
+        return;
+    for (i = 0; i < queue.writers; i++)
+        pthread_join(writers[i], NULL);
+
+    ast_mutex_lock(&queue.lock);
+    ast_free(writers);
+    writers = NULL;
+    queue.writers = 0;
+    ast_mutex_unlock(&queue.lock);
+
+    ast_log(LOG_DEBUG, "%u batches, %u events inserted, %u events failed\n",
+        stats_batches, stats_inserted, stats_failed);
+}
+
+static void mongodb_log(struct ast_event *event)
+{
+    struct timeval start = ast_tvnow();
+    bson_t *doc = event2doc(event);
 
-    if (collection)
-        mongoc_collection_destroy(collection);
-    if (doc)
-        bson_destroy(doc);
-    mongoc_client_pool_push(dbpool, dbclient);
-    return;
+    ast_mongo_histogram_add(&stats.encode, start);
+    if (doc == NULL)
+        return;
+
+    if (bulk_enabled && ast_mongo_queue_push(&queue, doc) == 0)
+        return;
+
+    write_docs((const bson_t **)&doc, 1, 0);
+    ast_mutex_lock(&queue.lock);
+    ast_mongo_docs_put(&queue, &doc, 1);
+    ast_mutex_unlock(&queue.lock);
 }
 
 static int _load_module(int reload)
 {
     int res = -1;
     struct ast_config *cfg = NULL;
-    mongoc_uri_t *uri = NULL;
+    const char *uri = NULL;
+    char *new_dbname = NULL;
+    char *new_dbcollection = NULL;
+    char *new_spool_path = NULL;
+    mongoc_client_pool_t *new_pool = NULL;
+    struct ast_mongo_indexer *new_indexer = NULL;
+    struct ast_mongo_write_opts new_write_opts = { 0 };
+    struct ast_mongo_spool *old_spool;
 
     do {
         const char *tmp;
+        const char *database;
+        const char *collection;
         struct ast_variable *var;
         struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
+        bson_oid_t oid;
+        unsigned new_bulk = 0;
+        unsigned new_writers = 2;
+        unsigned new_queue_size = 10000;
+        unsigned new_batch_size = 100;
+        unsigned new_flush_interval = 1000;
+        unsigned new_skip_empty = 0;
+        unsigned long new_spool_size = 64 * 1024 * 1024;
 
         cfg = ast_config_load(CONFIG_FILE, config_flags);
         if (!cfg || cfg == CONFIG_STATUS_FILEINVALID) {
@@ -192,34 +676,59 @@ static int _load_module(int reload)
             ast_log(LOG_WARNING, "no uri specified.\n");
             break;
         }
-        uri = mongoc_uri_new(tmp);
-        if (uri == NULL) {
-            ast_log(LOG_ERROR, "parsing uri error, %s\n", tmp);
-            break;
-        }
+        uri = tmp;
 
-        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, DATABSE)) == NULL) {
+        if ((database = ast_variable_retrieve(cfg, CATEGORY, DATABSE)) == NULL) {
             ast_log(LOG_WARNING, "no database specified.\n");
             break;
         }
-        if (dbname)
-            ast_free(dbname);
-        dbname = ast_strdup(tmp);
-        if (dbname == NULL) {
-            ast_log(LOG_ERROR, "not enough memory for dbname\n");
+        if ((collection = ast_variable_retrieve(cfg, CATEGORY, COLLECTION)) == NULL) {
+            ast_log(LOG_WARNING, "no collection specified.\n");
             break;
         }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, SERVERID)) != NULL) {
+            if (!bson_oid_is_valid (tmp, strlen(tmp))) {
+                ast_log(LOG_ERROR, "invalid server id specified.\n");
+                break;
+            }
+            bson_oid_init_from_string(&oid, tmp);
+        }
 
-        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, COLLECTION)) == NULL) {
-            ast_log(LOG_WARNING, "no collection specified.\n");
-            break;
+        // options are parsed into locals, to be applied once the writers have stopped
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "bulk"))
+        && (sscanf(tmp, "%u", &new_bulk) != 1)) {
+           ast_log(LOG_WARNING, "bulk must be a 0|1, not '%s'\n", tmp);
+           new_bulk = 0;
         }
-        if (dbcollection)
-            ast_free(dbcollection);
-        dbcollection = ast_strdup(tmp);
-        if (dbcollection == NULL) {
-            ast_log(LOG_ERROR, "not enough memory for dbcollection\n");
-            break;
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "writers"))
+        && (sscanf(tmp, "%u", &new_writers) != 1 || new_writers == 0)) {
+           ast_log(LOG_WARNING, "writers must be a positive number, not '%s'\n", tmp);
+           new_writers = 2;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "queue_size"))
+        && (sscanf(tmp, "%u", &new_queue_size) != 1 || new_queue_size == 0)) {
+           ast_log(LOG_WARNING, "queue_size must be a positive number, not '%s'\n", tmp);
+           new_queue_size = 10000;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "batch_size"))
+        && (sscanf(tmp, "%u", &new_batch_size) != 1 || new_batch_size == 0)) {
+           ast_log(LOG_WARNING, "batch_size must be a positive number, not '%s'\n", tmp);
+           new_batch_size = 100;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "flush_interval"))
+        && (sscanf(tmp, "%u", &new_flush_interval) != 1)) {
+           ast_log(LOG_WARNING, "flush_interval must be a number in msec, not '%s'\n", tmp);
+           new_flush_interval = 1000;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "skip_empty"))
+        && (sscanf(tmp, "%u", &new_skip_empty) != 1)) {
+           ast_log(LOG_WARNING, "skip_empty must be a 0|1, not '%s'\n", tmp);
+           new_skip_empty = 0;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "spool_size"))
+        && (sscanf(tmp, "%lu", &new_spool_size) != 1)) {
+           ast_log(LOG_WARNING, "spool_size must be a number in bytes, not '%s'\n", tmp);
+           new_spool_size = 64 * 1024 * 1024;
         }
 
         if (ast_test_flag(&config, CONFIG_REGISTERED)){
@@ -236,44 +745,96 @@ static int _load_module(int reload)
             ast_set_flag(&config, CONFIG_REGISTERED);
         }
 
-        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, SERVERID)) != NULL) {
-            if (!bson_oid_is_valid (tmp, strlen(tmp))) {
-                ast_log(LOG_ERROR, "invalid server id specified.\n");
-                break;
-            }
-            serverid = ast_malloc(sizeof(bson_oid_t));
-            if (serverid == NULL) {
-                ast_log(LOG_ERROR, "not enough memory\n");
+        if (ast_mongo_plan_build(&plan, ast_variable_retrieve(cfg, CATEGORY, "fields"),
+            ast_variable_retrieve(cfg, CATEGORY, "aliases")))
+            break;
+
+        // the new configuration is made apart, then swapped in under config_lock
+        new_dbname = ast_strdup(database);
+        new_dbcollection = ast_strdup(collection);
+        if (new_dbname == NULL || new_dbcollection == NULL) {
+            ast_log(LOG_ERROR, "not enough memory for dbname\n");
+            break;
+        }
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "spool")) && !ast_strlen_zero(tmp)) {
+            new_spool_path = ast_strdup(tmp);
+            if (new_spool_path == NULL) {
+                ast_log(LOG_ERROR, "not enough memory for spool\n");
                 break;
             }
-            bson_oid_init_from_string(serverid, tmp);
         }
-
-        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "apm"))
-        && (sscanf(tmp, "%u", &apm_enabled) != 1)) {
-           ast_log(LOG_WARNING, "apm must be a 0|1, not '%s'\n", tmp);
-           apm_enabled = 0;
+        if (ast_variable_retrieve(cfg, CATEGORY, SERVERID) && serverid == NULL
+        && (serverid = ast_malloc(sizeof(bson_oid_t))) == NULL) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
         }
-
-        if (apm_context)
-            ast_mongo_apm_stop(apm_context);
-
-        if (dbpool)
-            mongoc_client_pool_destroy(dbpool);
-        dbpool = mongoc_client_pool_new(uri);
-        if (dbpool == NULL) {
+        if (ast_mongo_write_opts_build(&new_write_opts, cfg, CATEGORY)) {
+            ast_log(LOG_ERROR, "not enough memory for write concern\n");
+            break;
+        }
+        // acquire the new one before releasing the current one to keep sharing the same pool
+        new_pool = ast_mongo_pool_acquire(uri, cfg);
+        if (new_pool == NULL) {
             ast_log(LOG_ERROR, "cannot make a connection pool for MongoDB\n");
             break;
         }
+        {
+            bson_t *indexes = ast_mongo_indexes_new(cfg, CATEGORY);
+            if (indexes) {
+                new_indexer = ast_mongo_indexer_start(new_pool, new_dbname, new_dbcollection, indexes);
+                bson_destroy(indexes);
+            }
+        }
 
-        if (apm_enabled)
-            apm_context = ast_mongo_apm_start(dbpool);
+        // flush queued events through the current configuration before replacing it
+        writers_shutdown();
+        // close the spool before opening the same file again, apart from config_lock
+        // which its replayer takes
+        ast_rwlock_wrlock(&config_lock);
+        old_spool = spool;
+        spool = NULL;
+        ast_rwlock_unlock(&config_lock);
+        if (old_spool)
+            ast_mongo_spool_close(old_spool);
+
+        ast_rwlock_wrlock(&config_lock);
+        SWAP(dbname, new_dbname);
+        SWAP(dbcollection, new_dbcollection);
+        SWAP(spool_path, new_spool_path);
+        SWAP(dbpool, new_pool);
+        SWAP(indexer, new_indexer);
+        SWAP(write_opts, new_write_opts);
+        if (ast_variable_retrieve(cfg, CATEGORY, SERVERID))
+            bson_oid_copy(&oid, serverid);
+        bulk_enabled = new_bulk;
+        writers_size = new_writers;
+        queue_size = new_queue_size;
+        batch_size = new_batch_size;
+        flush_interval = new_flush_interval;
+        skip_empty = new_skip_empty;
+        spool_size = new_spool_size;
+        if (spool_path) {
+            // its replayer waits for config_lock to write through the new configuration
+            spool = ast_mongo_spool_open(spool_path, spool_size, dbpool, replay_docs, NULL);
+            if (spool == NULL)
+                ast_log(LOG_WARNING, "events will not be spooled\n");
+        }
+        ast_rwlock_unlock(&config_lock);
+
+        if (bulk_enabled && writers_start()) {
+            ast_log(LOG_WARNING, "events will be written synchronously\n");
+        }
 
         res = 0; // suceess
     } while (0);
 
-    if (uri)
-       mongoc_uri_destroy(uri);
+    // the replaced configuration, or the new one if failed, nobody uses any longer
+    ast_free(new_dbname);
+    ast_free(new_dbcollection);
+    ast_free(new_spool_path);
+    ast_mongo_indexer_stop(new_indexer);
+    ast_mongo_pool_release(new_pool);
+    ast_mongo_write_opts_destroy(&new_write_opts);
         
     if (cfg && cfg != CONFIG_STATUS_FILEUNCHANGED && cfg != CONFIG_STATUS_FILEINVALID)
         ast_config_destroy(cfg);        
@@ -283,21 +844,34 @@ static int _load_module(int reload)
 
 static int load_module(void)
 {
-	return _load_module(0);
+	int res;
+	ast_mongo_queue_init(&queue, &stats);
+	ast_mongo_plan_init(&plan, cel_fields, ARRAY_LEN(cel_fields), "eventtime");
+	res = _load_module(0);
+	if (res == 0)
+		ast_mongo_writer_register(&stats);
+	return res;
 }
 
 static int unload_module(void)
 {
     if (ast_cel_backend_unregister(NAME))
         return -1;
+    writers_shutdown();
+    ast_mongo_queue_destroy(&queue);
+    ast_mongo_plan_destroy(&plan);
+    if (spool)
+        ast_mongo_spool_close(spool);
+    if (spool_path)
+        ast_free(spool_path);
     if (dbname)
         ast_free(dbname);
     if (dbcollection)
         ast_free(dbcollection);
-    if (apm_context)
-        ast_mongo_apm_stop(apm_context);
-    if (dbpool)
-        mongoc_client_pool_destroy(dbpool);
+    ast_mongo_indexer_stop(indexer);
+    ast_mongo_pool_release(dbpool);
+    ast_mongo_write_opts_destroy(&write_opts);
+    ast_mongo_writer_unregister(&stats);
     return 0;
 }
 
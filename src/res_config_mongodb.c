@@ -42,6 +42,10 @@ ASTERISK_REGISTER_FILE()
 #include "asterisk/lock.h"
 #include "asterisk/utils.h"
 #include "asterisk/threadstorage.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/dlinkedlists.h"
+#include "asterisk/cli.h"
+#include "asterisk/astdb.h"
 #include "asterisk/res_mongodb.h"
 
 #define HANDLE_ID_AS_OID 1
@@ -55,18 +59,59 @@ ASTERISK_REGISTER_FILE()
             bson_free(str); \
         }
 
-static const int MAXTOKENS = 3;
+static const int MAXTOKENS = 4;
 static const char NAME[] = "mongodb";
 static const char CATEGORY[] = "config";
 static const char CONFIG_FILE[] = "ast_mongo.conf";
 static const char SERVERID[] = "serverid";
 
+enum {
+    DOC_VALUE_SIZE = 32,                // to format a value other than strings
+    CACHE_BUCKETS = 257,
+    CACHE_MEMORY = 4 * 1024 * 1024,     // default bytes of cached results
+    CACHE_CATEGORY_SIZE = 256,          // estimated bytes of an ast_category
+    NEGATIVE_SIZE = 10000,              // default number of results which matched nothing
+    WATCH_NAME_SIZE = 256,              // for database/table
+    WATCH_AWAIT = 1000,                 // msec to wait for changes at once
+    WATCH_RETRY = 10,                   // sec to rewatch after any error
+    QUERY_NAME_SIZE = 1024,             // max length of a name of field with its operator
+    QUERY_PLANS = 61,                   // buckets of compiled queries
+    QUERY_PLANS_MAX = 1024,             // max number of compiled queries to keep
+    PRELOAD_BATCH = 1000,               // documents per batch to preload a table
+    PRELOAD_RETRY = 10,                 // seconds to retry preloading after failure
+    PRELOAD_WAIT = 60,                  // max seconds for the preloader to sleep
+    PRELOAD_DEBOUNCE = 1,               // seconds to gather changes before loading a table again
+    MODEL_TABLES = 31,                  // buckets of models
+    MODEL_FIELDS = 31,                  // buckets of fields of a model
+    SHAPES_MAX = 256,                   // max number of shapes of queries to record
+    SHAPE_FIELDS = 16,                  // max number of fields of a shape
+    SHAPE_KEY_SIZE = 512,               // for database/table/fields
+    SHAPE_BUCKETS = 61,                 // of shapes
+};
+
 AST_MUTEX_DEFINE_STATIC(model_lock);
 static mongoc_client_pool_t* dbpool = NULL;
-static bson_t* models = NULL;
+AO2_GLOBAL_OBJ_STATIC(model_registry);
 static bson_oid_t *serverid = NULL;
-static void* apm_context = NULL;
-static int apm_enabled = 0;
+AST_MUTEX_DEFINE_STATIC(write_concern_lock);
+static mongoc_write_concern_t *configured_write_concern = NULL;  // replaced by config() under write_concern_lock
+static struct ast_mongo_writer_stats stats = { .name = "config" };
+static struct ao2_container *query_plans = NULL;
+
+/*!
+ * \brief copy the write concern to write with, which a reload may replace meanwhile.
+ * \retval NULL for the driver default, or to be destroyed by the caller.
+ */
+static mongoc_write_concern_t *write_concern_copy(void)
+{
+    mongoc_write_concern_t *copy = NULL;
+
+    ast_mutex_lock(&write_concern_lock);
+    if (configured_write_concern)
+        copy = mongoc_write_concern_copy(configured_write_concern);
+    ast_mutex_unlock(&write_concern_lock);
+    return copy;
+}
 
 static int str_split(char* str, const char* delim, const char* tokens[] ) {
     char* token;
@@ -93,65 +138,112 @@ static const char *key_asterisk2mongo(const char *key)
 }
 
 /*!
- *  check if the specified string is integer
- *
- *  \param[in] value
- *  \param[out] result
- *  \retval true if it's an integer
+ *  a value of a field parsed by scalar_parse()
  */
-static bool is_integer(const char* value, long long* result)
-{
-    int len;
-    long long dummy;
-    long long* p = result ? result : &dummy;
-
-    if (sscanf(value, "%Ld%n", p, &len) == 0)
-        return false;
-    if (value[len] != '\0')
-        return false;
-    return true;
-}
+struct scalar {
+    bson_type_t type;   // returned by scalar_parse()
+    bool b;             // for BSON_TYPE_BOOL
+    long long ll;       // for BSON_TYPE_INT64
+    double d;           // for BSON_TYPE_INT64 and BSON_TYPE_DOUBLE
+};
 
 /*!
- *  check if the specified string is real number
+ *  classify the specified string in one pass without sscanf, then parse it once
  *
  *  \param[in] value
- *  \param[out] result
- *  \retval true if it's a real number
+ *  \param[out] scalar  is the parsed value
+ *  \retval BSON_TYPE_BOOL for true or false,
+ *  \retval BSON_TYPE_INT64 for an integer in range of long long,
+ *  \retval BSON_TYPE_DOUBLE for another real number,
+ *  \retval BSON_TYPE_UTF8 otherwise.
  */
-static bool is_real(const char* value, double* result)
+static bson_type_t scalar_parse(const char* value, struct scalar* scalar)
 {
-    int len;
-    double dummy;
-    double* p = result ? result : &dummy;
-
-    if (sscanf(value, "%lg%n", p, &len) == 0)
-        return false;
-    if (value[len] != '\0')
-        return false;
-    return true;
+    const char* p = value;
+    bool digits = false;
+    bool real = false;
+
+    scalar->type = BSON_TYPE_UTF8;
+    if (*p == 't' || *p == 'f') {
+        if (!strcmp(p, "true") || !strcmp(p, "false")) {
+            scalar->b = *p == 't';
+            scalar->type = BSON_TYPE_BOOL;
+        }
+        return scalar->type;
+    }
+    if (*p == '+' || *p == '-')
+        p++;
+    for (; *p >= '0' && *p <= '9'; p++)
+        digits = true;
+    if (*p == '.') {
+        real = true;
+        for (p++; *p >= '0' && *p <= '9'; p++)
+            digits = true;
+    }
+    if (!digits)
+        return BSON_TYPE_UTF8;
+    if (*p == 'e' || *p == 'E') {
+        real = true;
+        p++;
+        if (*p == '+' || *p == '-')
+            p++;
+        if (!(*p >= '0' && *p <= '9'))
+            return BSON_TYPE_UTF8;
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+    if (*p != '\0')
+        return BSON_TYPE_UTF8;
+
+    if (!real) {
+        errno = 0;
+        scalar->ll = strtoll(value, NULL, 10);
+        if (errno != ERANGE) {
+            scalar->d = (double)scalar->ll;
+            return scalar->type = BSON_TYPE_INT64;
+        }
+    }
+    scalar->d = strtod(value, NULL);
+    return scalar->type = BSON_TYPE_DOUBLE;
 }
 
 /*!
- *  check if the specified string is bool
+ *  append a value in the specified type
  *
- *  \param[in] value
- *  \param[out] result
- *  \retval true if it's a real number
+ *  \param[out] doc
+ *  \param[in]  key
+ *  \param[in]  value
+ *  \param[in]  btype   to be stored in
+ *  \param[in]  scalar  is the value parsed by scalar_parse(), or NULL to parse it if needed
+ *  \retval true if success
  */
-static bool is_bool(const char* value, bool* result) {
-    bool dummy;
-    bool* p = result ? result : &dummy;
+static bool value_append(bson_t *doc, const char *key, const char *value,
+    bson_type_t btype, const struct scalar *scalar)
+{
+    struct scalar parsed;
 
-    if (strcmp(value, "true") == 0) {
-        *p = true;
-        return true;
+    if (btype != BSON_TYPE_UTF8 && !scalar) {
+        scalar_parse(value, &parsed);
+        scalar = &parsed;
     }
-    if (strcmp(value, "false") == 0) {
-        *p = false;
-        return true;
+    switch(btype) {
+        case BSON_TYPE_UTF8:
+            return BSON_APPEND_UTF8(doc, key, value);
+        case BSON_TYPE_BOOL:
+            return BSON_APPEND_BOOL(doc, key, scalar->type == BSON_TYPE_BOOL && scalar->b);
+        case BSON_TYPE_INT32:
+            return BSON_APPEND_INT32(doc, key,
+                scalar->type == BSON_TYPE_INT64 ? (int32_t)scalar->ll : atol(value));
+        case BSON_TYPE_INT64:
+            return BSON_APPEND_INT64(doc, key,
+                scalar->type == BSON_TYPE_INT64 ? scalar->ll : atoll(value));
+        case BSON_TYPE_DOUBLE:
+            return BSON_APPEND_DOUBLE(doc, key,
+                scalar->type == BSON_TYPE_INT64 || scalar->type == BSON_TYPE_DOUBLE ? scalar->d : atof(value));
+        default:
+            ast_log(LOG_WARNING, "unexpected data type: key=%s, value=%s\n", key, value);
+            return true;
     }
-    return false;
 }
 
 /*!
@@ -186,19 +278,46 @@ static const char* strcopy(const char* src, char* dst, int size)
     return (const char*)dst;
 }
 
+/*!
+ *  get the prefix of a pattern which has no wildcard but the trailing %.
+ *
+ *  \param[in]  sql     is pattern for sql
+ *  \param[out] prefix  is unescaped
+ *  \param[in]  size    of prefix
+ *  \retval true if the prefix is not empty and consists of ASCII letters only,
+ *  so that incrementing its last letter bounds strings starting with it.
+ */
+static bool like_prefix(const char* sql, char* prefix, int size)
+{
+    int i = 0;
+
+    for (; *sql != '\0'; sql++) {
+        if (*sql == '%')
+            return sql[1] == '\0' && i > 0 && prefix[i - 1] < 0x7f;
+        if (*sql == '\\' && sql[1] != '\0')
+            sql++;
+        if ((unsigned char)*sql >= 0x80 || i >= size - 1)
+            return false;
+        prefix[i++] = *sql;
+        prefix[i] = '\0';
+    }
+    return false;
+}
+
 /*!
  * \brief   make a condition to query
  * \param   sql     is pattern for sql
  * \retval  a bson to query as follows;
  *      sql patern      generated bson to query
  *      ----------      --------------------------------------
- *      %               { $exists: true, $not: { $size: 0} } }
+ *      %               { $ne: null }
  *      %patern%        { $regex: "patern" }
- *      patern%         { $regex: "^patern" }
+ *      patern%         { $gte: "patern", $lt: "paterO" } for ASCII, or
+ *                      { $regex: "^patern" }
  *      %patern         { $regex: "patern$" }
  *      any other       NULL
  */
-static const bson_t* make_condition(const char* sql)
+static bson_t* make_condition(const char* sql)
 {
     bson_t* condition = NULL;
     char patern[1020];
@@ -207,11 +326,14 @@ static const bson_t* make_condition(const char* sql)
     char tail = *(sql + strlen(sql) - 1);
 
     if (strcmp(sql, "%") == 0) {
-        const char* json = "{ \"$exists\": true, \"$not\": {\"$size\": 0}}";
-        bson_error_t error;
-        condition = bson_new_from_json((const uint8_t*)json, -1, &error);
-        if (!condition)
-            ast_log(LOG_ERROR, "cannot generated condition from \"%s\", %d.%d:%s\n", json, error.domain, error.code, error.message);
+        // any value but null, as SQL does, served by an index on the field
+        condition = BCON_NEW("$ne", BCON_NULL);
+    }
+    else if (head != '%' && like_prefix(sql, patern, sizeof(patern))) {
+        // range of strings starting with the prefix, served by an index on the field
+        snprintf(tmp, sizeof(tmp), "%s", patern);
+        tmp[strlen(tmp) - 1]++;
+        condition = BCON_NEW("$gte", BCON_UTF8(patern), "$lt", BCON_UTF8(tmp));
     }
     else if (head == '%' && tail == '%') {
         strcopy(sql+1, patern, sizeof(patern)-1);
@@ -241,196 +363,288 @@ static const bson_t* make_condition(const char* sql)
     else
         ast_log(LOG_WARNING, "no condition generated\n");
 
-    return (const bson_t*)condition;
+    return condition;
 }
 
 /*!
- * \brief make a query
- * \param fields
- * \param orderby
- * \retval  a bson object to query,
- * \retval  NULL if something wrong.
+ * \brief a field of a model
+ */
+struct model_field {
+    bson_type_t btype;
+    char name[0];
+};
+
+/*!
+ * \brief a model of a table registered by require()
+ */
+struct model {
+    struct ao2_container *fields;
+    bson_t *doc;                    // of fields in order of require()
+    char table[0];
+};
+
+/*!
+ * \brief a version of the models library, never modified once published.
+ * Readers only take a reference to the current version, and writers publish
+ * a modified copy under model_lock.
  */
-static bson_t *make_query(const struct ast_variable *fields, const char *orderby)
+struct model_registry {
+    struct ao2_container *models;
+    bson_t *projections;            // tables to find only fields of their models
+};
+
+static int model_field_hash(const void *obj, int flags)
 {
-    bson_t *root = NULL;
-    bson_t *query = NULL;
-    bson_t *order = NULL;
+    const char *name = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY
+        ? obj : ((const struct model_field *)obj)->name;
+    return ast_str_hash(name);
+}
 
-    do {
-        bool err;
+static int model_field_cmp(void *obj, void *arg, int flags)
+{
+    const struct model_field *field = obj;
+    const char *name = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY
+        ? arg : ((const struct model_field *)arg)->name;
+    return strcmp(field->name, name) ? 0 : CMP_MATCH | CMP_STOP;
+}
 
-        query = serverid ? BCON_NEW(SERVERID, BCON_OID(serverid)) : bson_new();
-        order = orderby ? BCON_NEW(key_asterisk2mongo(orderby), BCON_DOUBLE(1)) : bson_new();
+static int model_hash(const void *obj, int flags)
+{
+    const char *table = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY
+        ? obj : ((const struct model *)obj)->table;
+    return ast_str_hash(table);
+}
 
-        for(err = false; fields && !err; fields = fields->next) {
-            const bson_t *condition = NULL;
-            const char *tokens[MAXTOKENS];
-            char buf[1024];
-            int count;
-            long long ll_number;
+static int model_cmp(void *obj, void *arg, int flags)
+{
+    const struct model *model = obj;
+    const char *table = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY
+        ? arg : ((const struct model *)arg)->table;
+    return strcmp(model->table, table) ? 0 : CMP_MATCH | CMP_STOP;
+}
 
-            if (strlen(fields->name) >= (sizeof(buf) - 1)) {
-                ast_log(LOG_WARNING, "too long key, \"%s\".\n", fields->name);
-                continue;
-            }
-            strcpy(buf, fields->name);
-            count = str_split(buf, " ", tokens);
-            err = true;
+static void model_destructor(void *obj)
+{
+    struct model *model = obj;
 
-            switch(count) {
-                case 1:
-#ifdef HANDLE_ID_AS_OID
-                    if ((strcmp(fields->name, "id") == 0)
-                    &&  bson_oid_is_valid(fields->value, strlen(fields->value))) {
-                        bson_oid_t oid;
-                        bson_oid_init_from_string(&oid, fields->value);
-                        err = !BSON_APPEND_OID(query, "_id", &oid);
-                    }
-                    else
-#endif
-                        err = !BSON_APPEND_UTF8(query, key_asterisk2mongo(fields->name), fields->value);
-                    break;
-                case 2:
-                    if (!strcasecmp(tokens[1], "LIKE")) {
-                        condition = make_condition(fields->value);
-                    }
-                    else if (!strcasecmp(tokens[1], "!=")) {
-                        // {
-                        //     tokens[0]: {
-                        //         "$exists" : true,
-                        //         "$ne" : value
-                        //     }
-                        // }
-                        condition = BCON_NEW(
-                            "$exists", BCON_BOOL(1),
-                            "$ne", BCON_UTF8(fields->value)
-                        );
-                    }
-                    else if (!strcasecmp(tokens[1], ">")) {
-                        // {
-                        //     tokens[0]: {
-                        //         "$gt" : value
-                        //     }
-                        // }
-                        if (is_integer(fields->value, &ll_number))
-                            condition = BCON_NEW("$gt", BCON_INT64(ll_number));
-                        else
-                            condition = BCON_NEW("$gt", BCON_UTF8(fields->value));
-                    }
-                    else if (!strcasecmp(tokens[1], "<=")) {
-                        // {
-                        //     tokens[0]: {
-                        //         "$lte" : value
-                        //     }
-                        // }
-                        if (is_integer(fields->value, &ll_number))
-                            condition = BCON_NEW("$lte", BCON_INT64(ll_number));
-                        else
-                            condition = BCON_NEW("$lte", BCON_UTF8(fields->value));
-                    }
-                    else {
-                        ast_log(LOG_WARNING, "unexpected operator \"%s\" of \"%s\" \"%s\".\n", tokens[1], fields->name, fields->value);
-                        break;
-                    }
-                    if (!condition) {
-                        ast_log(LOG_ERROR, "something wrong.\n");
-                        break;
-                    }
+    ao2_cleanup(model->fields);
+    if (model->doc)
+        bson_destroy(model->doc);
+}
 
-                    err = !BSON_APPEND_DOCUMENT(query, key_asterisk2mongo(tokens[0]), condition);
+static void model_registry_destructor(void *obj)
+{
+    struct model_registry *registry = obj;
 
-                    break;
-                default:
-                    ast_log(LOG_WARNING, "not handled, name=%s, value=%s.\n", fields->name, fields->value);
-            }
-            if (condition)
-                bson_destroy((bson_t*)condition);
-            else if (count > 1) {
-                ast_log(LOG_ERROR, "something wrong.\n");
-                break;
-            }
-        }
-        if (err) {
-            ast_log(LOG_ERROR, "something wrong.\n");
-            break;
-        }
-        root = BCON_NEW("$query", BCON_DOCUMENT(query),
-                        "$orderby", BCON_DOCUMENT(order));
-        if (!root) {    // current BCON_NEW might not return any error such as NULL...
-            ast_log(LOG_WARNING, "not enough memory\n");
-            break;
-        }
-    } while(0);
-    if (query)
-        bson_destroy(query);
-    if (order)
-        bson_destroy(order);
-    // if (root) {
-    //     LOG_BSON_AS_JSON(LOG_DEBUG, "generated query is %s\n", root);
-    // }
-    return root;
+    ao2_cleanup(registry->models);
+    if (registry->projections)
+        bson_destroy(registry->projections);
 }
 
 /*!
- * \brief   check if the models library has specified collection.
- * \param   collection  is name of model to be retrieved.
- * \retval  true if the library poses the specified collection or any error,
- * \retval  false if not exist.
+ * \brief make a model from a document of field names and their bson types.
  */
-static bool model_check(const char* collection)
+static struct model *model_new(const char *table, const bson_t *doc)
 {
+    struct model *model;
     bson_iter_t iter;
-    return bson_iter_init(&iter, models) && bson_iter_find(&iter, collection);
+
+    model = ao2_alloc_options(sizeof(*model) + strlen(table) + 1, model_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+    if (!model)
+        return NULL;
+    strcpy(model->table, table);
+    model->doc = bson_copy(doc);
+    model->fields = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0,
+        MODEL_FIELDS, model_field_hash, NULL, model_field_cmp);
+    if (!model->doc || !model->fields || !bson_iter_init(&iter, doc)) {
+        ao2_ref(model, -1);
+        return NULL;
+    }
+    while (bson_iter_next(&iter)) {
+        const char *name = bson_iter_key(&iter);
+        struct model_field *field = ao2_alloc_options(sizeof(*field) + strlen(name) + 1,
+            NULL, AO2_ALLOC_OPT_LOCK_NOLOCK);
+
+        if (!field) {
+            ao2_ref(model, -1);
+            return NULL;
+        }
+        field->btype = (bson_type_t)bson_iter_as_int64(&iter);
+        strcpy(field->name, name);
+        ao2_link(model->fields, field);
+        ao2_ref(field, -1);
+    }
+    return model;
+}
+
+/*!
+ * \brief make a copy of the current version of the models library to be modified.
+ * \param old  is the current version, or NULL.
+ */
+static struct model_registry *model_registry_new(const struct model_registry *old)
+{
+    struct model_registry *registry;
+
+    registry = ao2_alloc_options(sizeof(*registry), model_registry_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+    if (!registry)
+        return NULL;
+    registry->models = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0,
+        MODEL_TABLES, model_hash, NULL, model_cmp);
+    registry->projections = old ? bson_copy(old->projections) : bson_new();
+    if (!registry->models || !registry->projections
+    || (old && ao2_container_dup(registry->models, old->models, 0))) {
+        ao2_ref(registry, -1);
+        return NULL;
+    }
+    return registry;
+}
+
+/*!
+ * \brief get the model of a table.
+ * \retval a model to be released by ao2_ref(),
+ * \retval NULL if not registered.
+ */
+static struct model *model_get(const char *table)
+{
+    struct model_registry *registry = ao2_global_obj_ref(model_registry);
+    struct model *model = NULL;
+
+    if (registry) {
+        model = ao2_find(registry->models, table, OBJ_SEARCH_KEY);
+        ao2_ref(registry, -1);
+    }
+    return model;
 }
 
 /*!
- * \param[in]   model_name  is name of model to be retrieved.
+ * \brief get the type of a field registered by the model.
+ * \param[in]   model       is returned by model_get(), or NULL.
  * \param[in]   property
- * \param[in]   value
- * \retval  bson type
+ * \retval  BSON_TYPE_UNDEFINED if not registered.
  */
-static bson_type_t model_get_btype(const char* model_name, const char* property, const char* value)
+static bson_type_t model_field_btype(const struct model *model, const char* property)
 {
     bson_type_t btype = BSON_TYPE_UNDEFINED;
-    bson_iter_t iroot;
-    bson_iter_t imodel;
+    struct model_field *field;
+
+    if (model && (field = ao2_find(model->fields, property, OBJ_SEARCH_KEY))) {
+        btype = field->btype;
+        ao2_ref(field, -1);
+    }
+    return btype;
+}
+
+/*!
+ * \param[in]   model       is returned by model_get(), or NULL.
+ * \param[in]   property
+ * \param[in]   parsed      is the type of the value returned by scalar_parse().
+ * \retval  bson type
+ */
+static bson_type_t model_get_btype(const struct model *model, const char* property, bson_type_t parsed)
+{
+    bson_type_t btype = model_field_btype(model, property);
+
+    if (btype != BSON_TYPE_UNDEFINED)
+        return btype;
+    // numbers are stored as double unless registered otherwise
+    return parsed == BSON_TYPE_INT64 ? BSON_TYPE_DOUBLE : parsed;
+}
+
+static void model_register(const char *collection, const bson_t *doc)
+{
+    struct model_registry *old;
+    struct model_registry *registry = NULL;
+    struct model *model = NULL;
 
     ast_mutex_lock(&model_lock);
+    old = ao2_global_obj_ref(model_registry);
     do {
-        if (value) {
-            if (is_bool(value, NULL))
-                btype = BSON_TYPE_BOOL;
-            else if (is_real(value, NULL))
-                btype = BSON_TYPE_DOUBLE;
-            else
-                btype = BSON_TYPE_UTF8;
+        if (old && (model = ao2_find(old->models, collection, OBJ_SEARCH_KEY))) {
+            ast_log(LOG_DEBUG, "%s already registered\n", collection);
+            break;
         }
-        if (model_check(model_name) &&
-            bson_iter_init_find (&iroot, models, model_name) &&
-            BSON_ITER_HOLDS_DOCUMENT (&iroot) &&
-            bson_iter_recurse (&iroot, &imodel) &&
-            bson_iter_find(&imodel, property))
-        {
-            btype = (bson_type_t)bson_iter_as_int64(&imodel);
+        model = model_new(collection, doc);
+        registry = model_registry_new(old);
+        if (!model || !registry || !ao2_link(registry->models, model)) {
+            ast_log(LOG_ERROR, "cannot register %s\n", collection);
+            break;
         }
+        ao2_global_obj_replace_unref(model_registry, registry);
+        LOG_BSON_AS_JSON(LOG_DEBUG, "model is \"%s\" for %s\n", doc, collection);
     } while(0);
+    ao2_cleanup(model);
+    ao2_cleanup(registry);
+    ao2_cleanup(old);
     ast_mutex_unlock(&model_lock);
-    return btype;
 }
 
-static void model_register(const char *collection, const bson_t *model)
+/*!
+ * \brief project the field unless projected already, as servers reject path collisions.
+ */
+static void projection_append(bson_t *projection, const char *key)
 {
-    ast_mutex_lock(&model_lock);
+    bson_iter_t iter;
+
+    if (!bson_iter_init_find(&iter, projection, key))
+        BSON_APPEND_INT32(projection, key, 1);
+}
+
+/*!
+ * \brief make a projection of the fields in the model of a table, plus _id.
+ * \param table      is name of model.
+ * \param initfield  is also projected if not NULL, to name categories.
+ * \retval a projection to be destroyed by bson_destroy(),
+ * \retval NULL to find whole documents, if the table is not configured
+ * to be projected or has no model required yet.
+ */
+static bson_t *model_projection(const char *table, const char *initfield)
+{
+    struct model_registry *registry = ao2_global_obj_ref(model_registry);
+    struct model *model = NULL;
+    bson_t *projection = NULL;
+    bson_iter_t iter;
+
     do {
-        if (model_check(collection))
-            ast_log(LOG_DEBUG, "%s already registered\n", collection);
-        else if (!BSON_APPEND_DOCUMENT(models, collection, model))
-            ast_log(LOG_ERROR, "cannot register %s\n", collection);
-        else {
-            LOG_BSON_AS_JSON(LOG_DEBUG, "models is \"%s\"\n", models);
-        }
+        if (!registry || !bson_iter_init_find(&iter, registry->projections, table))
+            break;
+        if (!(model = ao2_find(registry->models, table, OBJ_SEARCH_KEY))
+        || !bson_iter_init(&iter, model->doc))
+            break;
+        projection = BCON_NEW("_id", BCON_INT32(1));
+        while (bson_iter_next(&iter))
+            projection_append(projection, key_asterisk2mongo(bson_iter_key(&iter)));
+        if (initfield)
+            projection_append(projection, key_asterisk2mongo(initfield));
     } while(0);
+    ao2_cleanup(model);
+    ao2_cleanup(registry);
+    return projection;
+}
+
+/*!
+ * \brief publish the tables to be projected, keeping the models registered.
+ */
+static void model_configure(struct ast_config *cfg)
+{
+    struct ast_variable *var;
+    struct model_registry *old;
+    struct model_registry *registry;
+
+    ast_mutex_lock(&model_lock);
+    old = ao2_global_obj_ref(model_registry);
+    registry = model_registry_new(old);
+    if (registry) {
+        bson_reinit(registry->projections);
+        for (var = ast_variable_browse(cfg, CATEGORY); var; var = var->next) {
+            if (!strcasecmp(var->name, "projection"))
+                BSON_APPEND_BOOL(registry->projections, var->value, true);
+        }
+        ao2_global_obj_replace_unref(model_registry, registry);
+        ao2_ref(registry, -1);
+    }
+    else
+        ast_log(LOG_ERROR, "not enough memory\n");
+    ao2_cleanup(old);
     ast_mutex_unlock(&model_lock);
 }
 
@@ -475,180 +689,2662 @@ static bool fields2doc(const char* table, const struct ast_variable *fields, bso
 {
     bool err;
     const char* key;
+    struct model *model = model_get(table);
 
     for (err = false; fields && !err; fields = fields->next) {
-        bson_type_t btype;
+        struct scalar scalar;
 
         if (strlen(fields->value) == 0)
             continue;
         key = key_asterisk2mongo(fields->name);
-        btype = model_get_btype(table, key, fields->value);
-        switch(btype) {
-            case BSON_TYPE_UTF8:
-                err = !BSON_APPEND_UTF8(doc, key, fields->value);
-                break;
-            case BSON_TYPE_BOOL:
-                err = !BSON_APPEND_BOOL(doc, key,
-                    strcmp(fields->value, "true") ? false : true);
-                break;
-            case BSON_TYPE_INT32:
-                err = !BSON_APPEND_INT32(doc, key, atol(fields->value));
-                break;
-            case BSON_TYPE_INT64:
-                err = !BSON_APPEND_INT64(doc, key, atoll(fields->value));
-                break;
-            case BSON_TYPE_DOUBLE:
-                err = !BSON_APPEND_DOUBLE(doc, key, atof(fields->value));
-                break;
-            default:
-                ast_log(LOG_WARNING, "unexpected data type: key=%s, value=%s\n", key, fields->value);
-                break;
-        }
+        err = !value_append(doc, key, fields->value,
+            model_get_btype(model, key, scalar_parse(fields->value, &scalar)), &scalar);
     }
+    ao2_cleanup(model);
     return !err;
 }
 
 /*!
- *  Get a value from a document
- *
- *  \param[in,out]  iter    is a bson iterator of a document
- *  \param[out]     key     is stored pointer to key name of value
- *  \param[out]     value   is a buffer to be stored a string of value
- *  \param[in]      size    is size of buffer for value
- *  \retval  true if value is valid.
-*/
-static bool doc2value(bson_iter_t* iter, const char** key, char value[], int size)
+ *  Append a value to be compared with a field of the type, as a string unless
+ *  the value is of the type, for "abc" or "" not to match 0 of a number field.
+ *
+ *  \param[out] doc
+ *  \param[in]  key
+ *  \param[in]  value
+ *  \param[in]  btype   registered for the field, or BSON_TYPE_UNDEFINED.
+ *  \retval  true if success
+*/
+static bool filter_value_append(bson_t *doc, const char *key, const char *value, bson_type_t btype)
+{
+    struct scalar scalar;
+
+    if (btype == BSON_TYPE_UNDEFINED || btype == BSON_TYPE_UTF8)
+        return value_append(doc, key, value, BSON_TYPE_UTF8, NULL);
+    switch(scalar_parse(value, &scalar)) {
+        case BSON_TYPE_BOOL:
+            if (btype != BSON_TYPE_BOOL)
+                btype = BSON_TYPE_UTF8;
+            break;
+        case BSON_TYPE_INT64:
+            if (btype == BSON_TYPE_BOOL)
+                btype = BSON_TYPE_UTF8;
+            break;
+        case BSON_TYPE_DOUBLE:
+            if (btype != BSON_TYPE_DOUBLE)
+                btype = BSON_TYPE_UTF8;
+            break;
+        default:
+            btype = BSON_TYPE_UTF8;
+            break;
+    }
+    return value_append(doc, key, value, btype, &scalar);
+}
+
+/*!
+ *  Append a value to filter a field, in the type stored by fields2doc()
+ *
+ *  \param[out] doc
+ *  \param[in]  model   is returned by model_get(), or NULL.
+ *  \param[in]  key     in documents
+ *  \param[in]  value
+ *  \retval  true if success
+*/
+static bool filter_append(bson_t *doc, const struct model *model, const char *key, const char *value)
+{
+    // a string unless registered, as it may be stored either way
+    return filter_value_append(doc, key, value, model_field_btype(model, key));
+}
+
+/*!
+ * \brief operators of fields to find documents
+ */
+enum query_op {
+    QUERY_EQ,           // "name" or "name ="
+    QUERY_LIKE,         // "name LIKE"
+    QUERY_NE,           // "name !=" or "name <>"
+    QUERY_GT,           // "name >"
+    QUERY_GTE,          // "name >="
+    QUERY_LT,           // "name <"
+    QUERY_LTE,          // "name <="
+    QUERY_IN,           // "name IN", of comma separated values
+    QUERY_NULL,         // "name IS NULL", null or missing
+    QUERY_NOT_NULL,     // "name IS NOT NULL"
+    QUERY_SKIP,         // too long name to be ignored
+    QUERY_INVALID,      // not supported
+};
+
+/*!
+ * \brief operators of MongoDB for comparisons
+ */
+static const char *query_op_names[] = {
+    [QUERY_GT] = "$gt",
+    [QUERY_GTE] = "$gte",
+    [QUERY_LT] = "$lt",
+    [QUERY_LTE] = "$lte",
+};
+
+struct query_step {
+    enum query_op op;
+    bool id;                        // "id" to be an ObjectId if valid
+    const char *key;                // in documents
+};
+
+/*!
+ * \brief a query compiled for a table and names of fields with their operators,
+ * so that a lookup only appends values of the fields.
+ */
+struct query_plan {
+    const char *signature;          // table and names of fields
+    unsigned count;
+    struct query_step steps[0];     // followed by strings
+};
+
+/*!
+ * \brief a key to find a plan, not to format the signature for every lookup.
+ */
+struct query_key {
+    const char *table;
+    const struct ast_variable *fields;
+};
+
+static const char QUERY_SEPARATOR = '\x1e';      // between the table and names in signatures
+
+/*!
+ * \brief hash a string, which may be chained over its pieces.
+ */
+static unsigned query_hash_add(unsigned hash, const char *str)
+{
+    while (*str)
+        hash = hash * 33 ^ (unsigned char)*str++;
+    return hash;
+}
+
+static int query_plan_hash(const void *obj, int flags)
+{
+    const struct query_key *key = obj;
+    const struct ast_variable *field;
+    const char separator[] = { QUERY_SEPARATOR, '\0' };
+    unsigned hash = 5381;
+
+    if ((flags & OBJ_SEARCH_MASK) != OBJ_SEARCH_KEY)
+        return (int)(query_hash_add(hash, ((const struct query_plan *)obj)->signature) & INT_MAX);
+    hash = query_hash_add(hash, key->table);
+    for (field = key->fields; field; field = field->next)
+        hash = query_hash_add(query_hash_add(hash, separator), field->name);
+    return (int)(hash & INT_MAX);
+}
+
+static int query_plan_cmp(void *obj, void *arg, int flags)
+{
+    const struct query_plan *plan = obj;
+    const struct query_key *key = arg;
+    const struct ast_variable *field;
+    const char *p = plan->signature;
+    size_t len;
+
+    if ((flags & OBJ_SEARCH_MASK) != OBJ_SEARCH_KEY)
+        return strcmp(p, ((const struct query_plan *)arg)->signature) ? 0 : CMP_MATCH | CMP_STOP;
+    len = strlen(key->table);
+    if (strncmp(p, key->table, len))
+        return 0;
+    for (p += len, field = key->fields; field; p += len, field = field->next) {
+        len = strlen(field->name);
+        if (*p++ != QUERY_SEPARATOR || strncmp(p, field->name, len))
+            return 0;
+    }
+    return *p ? 0 : CMP_MATCH | CMP_STOP;
+}
+
+/*!
+ * \brief parse names of fields with their operators.
+ */
+static struct query_plan *query_plan_compile(const char *table, const struct ast_variable *fields)
+{
+    const struct ast_variable *field;
+    struct query_plan *plan;
+    size_t size = strlen(table) + 1;
+    unsigned count = 0;
+    unsigned i;
+    char *p;
+
+    for (field = fields; field; field = field->next, count++)
+        size += (strlen(field->name) + 1) * 2 + 1;  // in the signature, and "id" may be "_id"
+    plan = ao2_alloc_options(sizeof(*plan) + count * sizeof(*plan->steps) + size,
+        NULL, AO2_ALLOC_OPT_LOCK_NOLOCK);
+    if (!plan) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        return NULL;
+    }
+    p = (char *)(plan->steps + count);
+    plan->signature = p;
+    p = stpcpy(p, table);
+    for (field = fields; field; field = field->next) {
+        *p++ = QUERY_SEPARATOR;
+        p = stpcpy(p, field->name);
+    }
+    p++;
+    plan->count = count;
+
+    for (field = fields, i = 0; field; field = field->next, i++) {
+        struct query_step *step = &plan->steps[i];
+        const char *tokens[MAXTOKENS];
+        char buf[QUERY_NAME_SIZE];
+        int n;
+
+        step->op = QUERY_INVALID;
+        step->key = "";
+        if (strlen(field->name) >= (sizeof(buf) - 1)) {
+            step->op = QUERY_SKIP;
+            continue;
+        }
+        strcpy(buf, field->name);
+        n = str_split(buf, " ", tokens);
+        if (n == 0)
+            continue;
+        if (n == 1)
+            step->op = QUERY_EQ;
+        else if (n == 2) {
+            if (!strcasecmp(tokens[1], "LIKE"))
+                step->op = QUERY_LIKE;
+            else if (!strcmp(tokens[1], "="))
+                step->op = QUERY_EQ;
+            else if (!strcmp(tokens[1], "!=") || !strcmp(tokens[1], "<>"))
+                step->op = QUERY_NE;
+            else if (!strcmp(tokens[1], ">"))
+                step->op = QUERY_GT;
+            else if (!strcmp(tokens[1], ">="))
+                step->op = QUERY_GTE;
+            else if (!strcmp(tokens[1], "<"))
+                step->op = QUERY_LT;
+            else if (!strcmp(tokens[1], "<="))
+                step->op = QUERY_LTE;
+            else if (!strcasecmp(tokens[1], "IN"))
+                step->op = QUERY_IN;
+        }
+        else if (n == 3) {
+            if (!strcasecmp(tokens[1], "IS") && !strcasecmp(tokens[2], "NULL"))
+                step->op = QUERY_NULL;
+        }
+        else if (n == 4) {
+            if (!strcasecmp(tokens[1], "IS") && !strcasecmp(tokens[2], "NOT") && !strcasecmp(tokens[3], "NULL"))
+                step->op = QUERY_NOT_NULL;
+        }
+        step->id = step->op == QUERY_EQ && !strcmp(tokens[0], "id");
+        step->key = strcpy(p, key_asterisk2mongo(tokens[0]));
+        p += strlen(p) + 1;
+    }
+    return plan;
+}
+
+/*!
+ * \brief get the compiled query for the table and names of fields.
+ * \retval a plan to be released by ao2_ref(),
+ * \retval NULL on failure.
+ */
+static struct query_plan *query_plan_get(const char *table, const struct ast_variable *fields)
+{
+    struct query_key key = { .table = table, .fields = fields };
+    struct query_plan *plan;
+
+    plan = query_plans ? ao2_find(query_plans, &key, OBJ_SEARCH_KEY) : NULL;
+    if (plan)
+        return plan;
+    plan = query_plan_compile(table, fields);
+    // another one compiled meanwhile is harmless, either is found later
+    if (plan && query_plans && ao2_container_count(query_plans) < QUERY_PLANS_MAX)
+        ao2_link(query_plans, plan);
+    return plan;
+}
+
+/*!
+ * \brief make a condition of IN from comma separated values.
+ * \retval a bson to be destroyed by bson_destroy(), NULL on failure.
+ */
+static bson_t *query_in(const struct model *model, const char *key, const char *values)
+{
+    bson_t *condition = bson_new();
+    bson_t array;
+    char *buf = ast_strdupa(values);
+    char *value;
+    char index[16];
+    unsigned i = 0;
+    bool err;
+    bson_type_t btype = model_field_btype(model, key);
+
+    if (!BSON_APPEND_ARRAY_BEGIN(condition, "$in", &array)) {
+        bson_destroy(condition);
+        return NULL;
+    }
+    for (err = false; !err && (value = strsep(&buf, ",")); ) {
+        value = ast_strip(value);
+        snprintf(index, sizeof(index), "%u", i++);
+        err = !filter_value_append(&array, index, value, btype);
+    }
+    if (!bson_append_array_end(condition, &array) || err) {
+        bson_destroy(condition);
+        return NULL;
+    }
+    return condition;
+}
+
+/*!
+ * \brief make a query
+ * \param table
+ * \param fields
+ * \retval  a bson object to filter documents,
+ * \retval  NULL if something wrong.
+ */
+static bson_t *make_query(const char *table, const struct ast_variable *fields)
+{
+    struct query_plan *plan = query_plan_get(table, fields);
+    struct model *model;
+    bson_t *query = NULL;
+
+    if (!plan)
+        return NULL;
+    model = model_get(table);
+
+    do {
+        bool err;
+        unsigned i;
+
+        query = serverid ? BCON_NEW(SERVERID, BCON_OID(serverid)) : bson_new();
+
+        for(err = false, i = 0; i < plan->count && !err; i++, fields = fields->next) {
+            const struct query_step *step = &plan->steps[i];
+            bson_type_t btype = model_field_btype(model, step->key);
+            bson_t *condition = NULL;
+            struct scalar scalar;
+
+            switch(step->op) {
+                case QUERY_EQ:
+#ifdef HANDLE_ID_AS_OID
+                    if (step->id && bson_oid_is_valid(fields->value, strlen(fields->value))) {
+                        bson_oid_t oid;
+                        bson_oid_init_from_string(&oid, fields->value);
+                        err = !BSON_APPEND_OID(query, step->key, &oid);
+                    }
+                    else
+#endif
+                        err = !filter_append(query, model, step->key, fields->value);
+                    continue;
+                case QUERY_LIKE:
+                    condition = make_condition(fields->value);
+                    break;
+                case QUERY_NE:
+                    // {
+                    //     key: {
+                    //         "$exists" : true,
+                    //         "$ne" : value
+                    //     }
+                    // }
+                    condition = BCON_NEW("$exists", BCON_BOOL(1));
+                    if (!filter_append(condition, model, "$ne", fields->value)) {
+                        bson_destroy(condition);
+                        condition = NULL;
+                    }
+                    break;
+                case QUERY_GT:
+                case QUERY_GTE:
+                case QUERY_LT:
+                case QUERY_LTE:
+                    // {
+                    //     key: {
+                    //         "$gt" : value
+                    //     }
+                    // }
+                    condition = bson_new();
+                    if (btype == BSON_TYPE_UNDEFINED)
+                        btype = scalar_parse(fields->value, &scalar) == BSON_TYPE_INT64
+                            ? BSON_TYPE_INT64 : BSON_TYPE_UTF8;
+                    if (!filter_value_append(condition, query_op_names[step->op], fields->value, btype)) {
+                        bson_destroy(condition);
+                        condition = NULL;
+                    }
+                    break;
+                case QUERY_IN:
+                    // {
+                    //     key: {
+                    //         "$in" : [ value, ... ]
+                    //     }
+                    // }
+                    condition = query_in(model, step->key, fields->value);
+                    break;
+                case QUERY_NULL:
+                    // { key: null }, which matches missing ones as well
+                    err = !BSON_APPEND_NULL(query, step->key);
+                    continue;
+                case QUERY_NOT_NULL:
+                    // {
+                    //     key: {
+                    //         "$ne" : null
+                    //     }
+                    // }
+                    condition = BCON_NEW("$ne", BCON_NULL);
+                    break;
+                case QUERY_SKIP:
+                    ast_log(LOG_WARNING, "too long key, \"%s\".\n", fields->name);
+                    continue;
+                default:
+                    ast_log(LOG_WARNING, "not handled, name=%s, value=%s.\n", fields->name, fields->value);
+                    err = true;
+                    continue;
+            }
+            if (!condition) {
+                ast_log(LOG_ERROR, "something wrong.\n");
+                err = true;
+                continue;
+            }
+            err = !BSON_APPEND_DOCUMENT(query, step->key, condition);
+            bson_destroy(condition);
+        }
+        if (err) {
+            ast_log(LOG_ERROR, "something wrong.\n");
+            bson_destroy(query);
+            query = NULL;
+            break;
+        }
+    } while(0);
+    ao2_cleanup(model);
+    ao2_ref(plan, -1);
+    // if (query) {
+    //     LOG_BSON_AS_JSON(LOG_DEBUG, "generated query is %s\n", query);
+    // }
+    return query;
+}
+
+/*!
+ *  Get a value from a document
+ *
+ *  \param[in,out]  iter    is a bson iterator of a document
+ *  \param[out]     key     is stored pointer to key name of value
+ *  \param[out]     value   is stored pointer to a string of value, which is
+ *                          in the document as it is, or formatted in work.
+ *  \param[out]     work    is a buffer to format a value other than strings
+ *  \param[in]      size    is size of work, at least DOC_VALUE_SIZE
+ *  \retval  true if value is valid.
+*/
+static bool doc2value(bson_iter_t* iter, const char** key, const char** value, char work[], int size)
+{
+    if (size < DOC_VALUE_SIZE) {
+        ast_log(LOG_ERROR, "size of value is too small\n");
+        return false;
+    }
+    *value = work;
+    if (BSON_ITER_HOLDS_OID(iter)) {
+        const bson_oid_t * oid;
+        if (strcmp(bson_iter_key(iter), SERVERID) == 0) {
+            // SERVERID is hidden property for application
+            return false;
+        }
+        oid = bson_iter_oid(iter);
+        bson_oid_to_string(oid, work);
+    }
+    else if (BSON_ITER_HOLDS_UTF8(iter)) {
+        uint32_t length;
+        const char* str = bson_iter_utf8(iter, &length);
+        if (!bson_utf8_validate(str, length, false)) {
+            ast_log(LOG_WARNING, "unexpected invalid bson found\n");
+            return false;
+        }
+        // terminated by nul in the document, without any nul inside as validated
+        *value = str;
+    }
+    else if (BSON_ITER_HOLDS_BOOL(iter)) {
+        bool d = bson_iter_bool(iter);
+        *value = d ? "true" : "false";
+    }
+    else if (BSON_ITER_HOLDS_INT32(iter)) {
+        long d = bson_iter_int32(iter);
+        snprintf(work, size, "%ld", d);
+    }
+    else if (BSON_ITER_HOLDS_INT64(iter)) {
+        long long d = bson_iter_int64(iter);
+        snprintf(work, size, "%Ld", d);
+    }
+    else if (BSON_ITER_HOLDS_DOUBLE(iter)) {
+        double d = bson_iter_double(iter);
+        snprintf(work, size, "%.10g", d);
+    }
+    else {
+        // see http://api.mongodb.org/libbson/current/bson_iter_type.html
+        ast_log(LOG_WARNING, "unexpected bson type, %x\n", bson_iter_type(iter));
+        return false;
+    }
+    *key = key_mongo2asterisk(bson_iter_key(iter));
+    return true;
+}
+
+/*!
+ *  Make a list of variables from a document
+ *
+ *  Each variable is made by ast_variable_new() at the exact size of its name
+ *  and value, so the list is freed by ast_variables_destroy() as usual.
+ *
+ *  \param[in]  doc
+ *  \retval  the list, NULL if no valid field.
+*/
+static struct ast_variable *doc2variables(const bson_t *doc)
+{
+    struct ast_variable *var = NULL;
+    struct ast_variable *prev = NULL;
+    bson_iter_t iter;
+
+    if (!bson_iter_init(&iter, doc)) {
+        ast_log(LOG_ERROR, "unexpected bson error!\n");
+        return NULL;
+    }
+    while (bson_iter_next(&iter)) {
+        struct ast_variable *next;
+        const char* key;
+        const char* value;
+        char work[DOC_VALUE_SIZE];
+
+        if (!doc2value(&iter, &key, &value, work, sizeof(work)))
+            continue;
+        next = ast_variable_new(key, value, "");
+        if (!next) {
+            ast_log(LOG_WARNING, "out of memory!\n");
+            continue;
+        }
+        if (prev)
+            prev->next = next;
+        else
+            var = next;
+        prev = next;
+    }
+    return var;
+}
+
+/*!
+ * \brief Update documents in collection that match selector.
+ * \param[in] collection    is a mongoc_collection_t.
+ * \param[in] selector      is a bson_t containing the query to match documents for updating.
+ * \param[in] update        is a bson_t containing the update to perform.
+ *
+ * \retval number of rows affected
+ * \retval -1 on failure
+*/
+static int _collection_update(
+    mongoc_collection_t *collection, const bson_t *selector, const bson_t *update)
+{
+    int ret = -1;
+    bson_t *cmd = NULL;
+    bson_t *opts = NULL;
+    bson_t *updates = NULL;
+    bson_t array = BSON_INITIALIZER;
+    bson_t reply = BSON_INITIALIZER;
+    mongoc_write_concern_t *write_concern = write_concern_copy();
+
+    LOG_BSON_AS_JSON(LOG_DEBUG, "selector=%s\n", selector);
+    LOG_BSON_AS_JSON(LOG_DEBUG, "update=%s\n", update);
+
+    do {
+        bson_error_t error;
+        bson_iter_t iter;
+
+        opts = bson_new();
+        if (write_concern)
+            mongoc_write_concern_append(write_concern, opts);
+        updates = BCON_NEW(
+            "q", BCON_DOCUMENT(selector),
+            "u", BCON_DOCUMENT(update),
+            "multi", BCON_BOOL(true)
+        );
+        bson_append_document(&array, "0", -1, updates);
+        cmd = BCON_NEW(
+           "update", BCON_UTF8(mongoc_collection_get_name(collection)),
+           "updates", BCON_ARRAY(&array)
+        );
+
+        if (!mongoc_collection_write_command_with_opts(
+            collection, cmd, opts, &reply, &error))
+        {
+            ast_mongo_writer_count(&stats, write_concern, 0, 1);
+            ast_log(LOG_ERROR, "update failed, error=%s\n", error.message);
+            LOG_BSON_AS_JSON(LOG_ERROR, "cmd=%s\n", cmd);
+            break;
+        }
+        ast_mongo_writer_count(&stats, write_concern, 1, 1);
+        LOG_BSON_AS_JSON(LOG_DEBUG, "reply=%s\n", &reply);
+
+        if (write_concern && !mongoc_write_concern_is_acknowledged(write_concern)) {
+            ret = 1;    // nothing is replied, assume a row affected
+            break;
+        }
+
+        if (!bson_iter_init(&iter, &reply)
+        || !bson_iter_find(&iter, "nModified")
+        || !BSON_ITER_HOLDS_INT32(&iter)) {
+            ast_log(LOG_ERROR, "no \"nModified\" field found.\n");
+            break;
+        }
+        ret = bson_iter_int32(&iter);
+    } while(0);
+
+    bson_destroy(&reply);
+    bson_destroy(&array);
+    if (updates)
+        bson_destroy(updates);
+    if (opts)
+        bson_destroy(opts);
+    if (cmd)
+        bson_destroy(cmd);
+    if (write_concern)
+        mongoc_write_concern_destroy(write_concern);
+    return ret;
+}
+
+/*!
+ * \brief time to live of results cached per table
+ */
+struct cache_ttl {
+    unsigned ttl;                   // in sec
+    bool negative;                  // for results which matched nothing
+    AST_LIST_ENTRY(cache_ttl) list;
+    char table[0];                  // or "*" for any table
+};
+
+/*!
+ * \brief a result of realtime() or realtime_multi() kept in the cache
+ */
+struct cache_entry {
+    const char *key;                // kind, database, table and sorted fields
+    const char *database;
+    const char *table;
+    struct ast_variable *var;       // result of realtime()
+    struct ast_config *cfg;         // result of realtime_multi(), or both NULL if nothing matched
+    size_t size;                    // estimated bytes held by this entry
+    struct timeval expires;
+    AST_DLLIST_ENTRY(cache_entry) lru;
+    char buf[0];
+};
+
+/*!
+ * \brief changes of a table seen by the cache, not to keep a result queried before a change
+ */
+struct cache_generation {
+    unsigned generation;
+    const char *database;
+    const char *table;
+    AST_LIST_ENTRY(cache_generation) list;
+    char buf[0];
+};
+
+AST_DLLIST_HEAD_NOLOCK(cache_list, cache_entry);
+
+AST_MUTEX_DEFINE_STATIC(cache_lock);
+static struct ao2_container *cache = NULL;                  // of cache_entry keyed by key
+static struct cache_list cache_lru;                         // most recently used first
+static AST_LIST_HEAD_NOLOCK_STATIC(cache_ttls, cache_ttl);
+static AST_LIST_HEAD_NOLOCK_STATIC(cache_generations, cache_generation);
+static size_t cache_memory = CACHE_MEMORY;                  // max bytes of cached results
+static size_t cache_used = 0;
+static uint64_t cache_hits = 0;
+static uint64_t cache_misses = 0;
+static uint64_t cache_evictions = 0;
+static uint64_t cache_purges = 0;
+
+// results of lookups which matched nothing, bounded apart from the others
+// not to let any flood of them evict the useful ones
+static struct cache_list negative_lru;                      // most recently used first
+static unsigned negative_size = NEGATIVE_SIZE;              // max number of results
+static unsigned negative_count = 0;
+static uint64_t negative_hits = 0;
+static uint64_t negative_misses = 0;
+static uint64_t negative_evictions = 0;
+
+AST_THREADSTORAGE(cache_key_buf);
+
+/*!
+ * \brief background watcher of changes in a cached collection
+ */
+struct watcher {
+    pthread_t thread;
+    const char *database;
+    const char *table;
+    AST_LIST_ENTRY(watcher) list;
+    char buf[0];
+};
+
+AST_MUTEX_DEFINE_STATIC(watchers_lock);
+static ast_cond_t watchers_cond;
+static AST_LIST_HEAD_NOLOCK_STATIC(watchers, watcher);
+static int watchers_stop = 0;
+static int cache_watch = 0;                                 // to watch changes of cached collections
+static const char WATCH_FAMILY[] = "ast_mongo/resume";      // of astdb to keep resume tokens
+
+/*!
+ * \brief a query in flight, whose result is shared by the callers of the same lookup
+ */
+struct flight {
+    const char *key;
+    unsigned passengers;            // callers waiting for the result but the pilot
+    bool landed;
+    struct ast_variable *var;       // copy of the result of realtime()
+    struct ast_config *cfg;         // copy of the result of realtime_multi()
+    AST_LIST_ENTRY(flight) list;
+    char buf[0];
+};
+
+AST_MUTEX_DEFINE_STATIC(flights_lock);
+static ast_cond_t flights_cond;
+static AST_LIST_HEAD_NOLOCK_STATIC(flights, flight);
+static uint64_t flights_shared = 0;                         // lookups which shared a query of another
+
+enum shape_state {
+    SHAPE_UNCHECKED,
+    SHAPE_INDEXED,
+    SHAPE_SCANNING,
+    SHAPE_FAILED,
+};
+
+static struct ao2_container *shapes;                         // by database/table/fields
+static const char SHAPES_FAMILY[] = "ast_mongo/shapes";     // of astdb to keep shapes seen
+AST_THREADSTORAGE(shape_buf);
+
+AST_MUTEX_DEFINE_STATIC(advisor_lock);
+static pthread_t advisor_thread = AST_PTHREADT_NULL;
+static int advisor_running = 0;
+
+/*!
+ * \brief a value of a field in a snapshot, and the record having it
+ */
+struct snapshot_entry {
+    const char *value;
+    size_t record;
+};
+
+/*!
+ * \brief values of a field in a snapshot, sorted to be searched
+ */
+struct snapshot_index {
+    const char *key;                // in documents
+    size_t count;
+    AST_LIST_ENTRY(snapshot_index) list;
+    struct snapshot_entry entries[0];   // followed by key
+};
+
+/*!
+ * \brief documents of a preloaded table in memory, decoded as results of realtime()
+ */
+struct snapshot {
+    size_t count;
+    size_t size;                    // allocated records
+    struct ast_variable **records;  // changed in place under the lock of the snapshot
+    AST_LIST_HEAD_NOLOCK(, snapshot_index) indexes;     // made on demand under the lock of the snapshot
+};
+
+/*!
+ * \brief a table to be preloaded
+ */
+struct preload {
+    const char *database;
+    const char *table;
+    unsigned refresh;               // seconds to reload, 0 to reload only on changes
+    struct snapshot *snapshot;      // NULL until loaded, served even if stale
+    bool stale;                     // changed not by _id, to be loaded again
+    unsigned generation;            // of changes, not to publish a snapshot loaded before a change
+    time_t due;                     // to load the snapshot
+    time_t loaded;
+    AST_LIST_ENTRY(preload) list;
+    char buf[0];
+};
+
+AST_MUTEX_DEFINE_STATIC(preloads_lock);
+static ast_cond_t preloads_cond;
+static AST_LIST_HEAD_NOLOCK_STATIC(preloads, preload);
+static pthread_t preloader = AST_PTHREADT_NULL;
+static int preloader_stop = 0;
+static volatile uint64_t preload_hits = 0;                  // lookups served by snapshots
+static volatile uint64_t preload_misses = 0;                // lookups on preloaded tables sent to MongoDB
+
+static int cache_entry_hash(const void *obj, int flags)
+{
+    const char *key = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY
+        ? obj : ((const struct cache_entry *)obj)->key;
+    return ast_str_hash(key);
+}
+
+static int cache_entry_cmp(void *obj, void *arg, int flags)
+{
+    const struct cache_entry *entry = obj;
+    const char *key = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY
+        ? arg : ((const struct cache_entry *)arg)->key;
+    return strcmp(entry->key, key) ? 0 : CMP_MATCH | CMP_STOP;
+}
+
+static void cache_entry_destructor(void *obj)
+{
+    struct cache_entry *entry = obj;
+
+    if (entry->var)
+        ast_variables_destroy(entry->var);
+    if (entry->cfg)
+        ast_config_destroy(entry->cfg);
+}
+
+static bool cache_entry_is_negative(const struct cache_entry *entry)
+{
+    return !entry->var && !entry->cfg;
+}
+
+/*!
+ * \brief drop an entry from the cache, with cache_lock held.
+ */
+static void cache_remove(struct cache_entry *entry)
+{
+    if (cache_entry_is_negative(entry)) {
+        AST_DLLIST_REMOVE(&negative_lru, entry, lru);
+        negative_count--;
+    }
+    else {
+        AST_DLLIST_REMOVE(&cache_lru, entry, lru);
+        cache_used -= entry->size;
+    }
+    ao2_unlink(cache, entry);
+}
+
+/*!
+ * \brief time to live for results of the table, with cache_lock held.
+ * \param negative  is true for results which matched nothing.
+ * \retval 0 if the table is not cached.
+ */
+static unsigned cache_ttl_find(const char *table, bool negative)
+{
+    struct cache_ttl *ttl;
+    unsigned ret = 0;
+
+    AST_LIST_TRAVERSE(&cache_ttls, ttl, list) {
+        if (ttl->negative != negative)
+            continue;
+        if (!strcmp(ttl->table, table))
+            return ttl->ttl;
+        if (!strcmp(ttl->table, "*"))
+            ret = ttl->ttl;
+    }
+    return ret;
+}
+
+static int field_cmp(const void *a, const void *b)
+{
+    const struct ast_variable *x = *(const struct ast_variable **)a;
+    const struct ast_variable *y = *(const struct ast_variable **)b;
+    int ret = strcmp(x->name, y->name);
+    return ret ? ret : strcmp(x->value, y->value);
+}
+
+/*!
+ * \brief make a key to cache or share the result of a query.
+ * Fields are sorted so that the same lookup in another order shares the result,
+ * except the first one of realtime_multi() which names and orders the categories.
+ * \param kind  is "realtime" or "multi".
+ * \retval a thread local string,
+ * \retval NULL on failure.
+ */
+static const char *cache_key(const char *kind, const char *database, const char *table, const struct ast_variable *fields)
+{
+    const struct ast_variable *field;
+    const struct ast_variable **sorted;
+    struct ast_str *key;
+    unsigned count = 0;
+    unsigned i;
+
+    key = ast_str_thread_get(&cache_key_buf, 256);
+    if (!key)
+        return NULL;
+
+    for (field = fields; field; field = field->next)
+        count++;
+    sorted = ast_alloca(count * sizeof(*sorted));
+    for (field = fields, i = 0; field; field = field->next, i++)
+        sorted[i] = field;
+    if (!strcmp(kind, "multi"))
+        ast_str_set(&key, 0, "%s\x1e%s\x1e%s\x1e%s\x1f%s", kind, database, table, sorted[0]->name, sorted[0]->value);
+    else
+        ast_str_set(&key, 0, "%s\x1e%s\x1e%s", kind, database, table);
+    qsort(sorted, count, sizeof(*sorted), field_cmp);
+    for (i = 0; i < count; i++)
+        ast_str_append(&key, 0, "\x1e%s\x1f%s", sorted[i]->name, sorted[i]->value);
+    return ast_str_buffer(key);
+}
+
+/*!
+ * \brief estimate bytes held by a list of variables.
+ */
+static size_t variables_size(const struct ast_variable *var)
+{
+    size_t size = 0;
+
+    for (; var; var = var->next)
+        size += sizeof(*var) + strlen(var->name) + strlen(var->value) + 3;
+    return size;
+}
+
+/*!
+ * \brief generation of the table, with cache_lock held.
+ * \param create  to add the table if not seen yet.
+ * \retval NULL if not seen yet, or not enough memory.
+ */
+static struct cache_generation *cache_generation_find(const char *database, const char *table, bool create)
+{
+    struct cache_generation *generation;
+    size_t database_len = strlen(database) + 1;
+
+    AST_LIST_TRAVERSE(&cache_generations, generation, list) {
+        if (!strcmp(generation->table, table) && !strcmp(generation->database, database))
+            return generation;
+    }
+    if (!create)
+        return NULL;
+    generation = ast_calloc(1, sizeof(*generation) + database_len + strlen(table) + 1);
+    if (!generation) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        return NULL;
+    }
+    generation->database = strcpy(generation->buf, database);
+    generation->table = strcpy(generation->buf + database_len, table);
+    AST_LIST_INSERT_TAIL(&cache_generations, generation, list);
+    return generation;
+}
+
+/*!
+ * \brief snapshot the generation of the table before querying it, to be passed to cache_put().
+ */
+static unsigned cache_generation(const char *database, const char *table)
+{
+    struct cache_generation *generation;
+    unsigned value = 0;
+
+    ast_mutex_lock(&cache_lock);
+    generation = cache_generation_find(database, table, true);
+    if (generation)
+        value = generation->generation;
+    ast_mutex_unlock(&cache_lock);
+    return value;
+}
+
+/*!
+ * \brief look up a copy of the cached result.
+ * \param[out] var  is a copy of the result of realtime(), if not NULL.
+ * \param[out] cfg  is a copy of the result of realtime_multi(), if not NULL.
+ * \retval true if found, even if it matched nothing.
+ */
+static bool cache_get(const char *key, const char *table, struct ast_variable **var, struct ast_config **cfg)
+{
+    struct cache_entry *entry;
+    bool found = false;
+
+    ast_mutex_lock(&cache_lock);
+    do {
+        if (!cache || !(cache_ttl_find(table, false) || cache_ttl_find(table, true)))
+            break;
+        entry = ao2_find(cache, key, OBJ_SEARCH_KEY);
+        if (!entry) {
+            cache_misses++;
+            break;
+        }
+        if (ast_tvcmp(entry->expires, ast_tvnow()) < 0) {
+            cache_misses++;
+            cache_remove(entry);
+            ao2_ref(entry, -1);
+            break;
+        }
+        if (cache_entry_is_negative(entry)) {
+            AST_DLLIST_REMOVE(&negative_lru, entry, lru);
+            AST_DLLIST_INSERT_HEAD(&negative_lru, entry, lru);
+            if (var)
+                *var = NULL;
+            if (cfg)
+                *cfg = ast_config_new();
+            negative_hits++;
+        }
+        else {
+            AST_DLLIST_REMOVE(&cache_lru, entry, lru);
+            AST_DLLIST_INSERT_HEAD(&cache_lru, entry, lru);
+            if (var)
+                *var = ast_variables_dup(entry->var);
+            if (cfg)
+                *cfg = ast_config_copy(entry->cfg);
+            cache_hits++;
+        }
+        found = true;
+        ao2_ref(entry, -1);
+    } while(0);
+    ast_mutex_unlock(&cache_lock);
+    return found;
+}
+
+/*!
+ * \brief check if the result of realtime() is the document of the id.
+ */
+static bool variables_have_id(const struct ast_variable *var, const char *id)
+{
+    for (; var; var = var->next) {
+        if (!strcmp(var->name, "id"))
+            return !strcmp(var->value, id);
+    }
+    return false;
+}
+
+/*!
+ * \brief find the value of a field of a record.
+ * \param name  in Asterisk, e.g. id.
+ */
+static const char *record_value(const struct ast_variable *record, const char *name)
+{
+    for (; record; record = record->next) {
+        if (!strcmp(record->name, name))
+            return record->value;
+    }
+    return NULL;
+}
+
+/*!
+ * \brief find the preload of a table.
+ * \note preloads_lock must be held.
+ */
+static struct preload *preload_get(const char *database, const char *table)
+{
+    struct preload *preload;
+
+    AST_LIST_TRAVERSE(&preloads, preload, list) {
+        if (!strcmp(preload->table, table) && !strcmp(preload->database, database))
+            break;
+    }
+    return preload;
+}
+
+/*!
+ * \brief mark snapshots of the table stale, as it has changed in an unknown way.
+ * They are still served until loaded again PRELOAD_DEBOUNCE seconds later,
+ * as changes come in bursts.
+ * \param database  is NULL for any database.
+ * \param table     is NULL for any table.
+ */
+static void preload_stale(const char *database, const char *table)
+{
+    struct preload *preload;
+    time_t due = time(NULL) + PRELOAD_DEBOUNCE;
+
+    ast_mutex_lock(&preloads_lock);
+    AST_LIST_TRAVERSE(&preloads, preload, list) {
+        if ((database && strcmp(preload->database, database))
+        || (table && strcmp(preload->table, table)))
+            continue;
+        preload->generation++;
+        if (preload->stale)
+            continue;
+        preload->stale = true;
+        if (!preload->refresh || preload->due > due)
+            preload->due = due;
+        ast_cond_signal(&preloads_cond);
+    }
+    ast_mutex_unlock(&preloads_lock);
+}
+
+/*!
+ * \brief decode a document as snapshot_load() does, if it belongs to this server.
+ * \retval a record to be destroyed by ast_variables_destroy(),
+ * \retval NULL if not to be in the snapshot.
+ */
+static struct ast_variable *preload_record(const char *table, const bson_t *doc)
+{
+    struct ast_variable *record;
+    struct ast_variable *prev = NULL;
+    struct ast_variable *var;
+    struct ast_variable *next;
+    bson_t *projection;
+    bson_iter_t iter;
+
+    if (serverid && !(bson_iter_init_find(&iter, doc, SERVERID) && BSON_ITER_HOLDS_OID(&iter)
+    && !bson_oid_compare(bson_iter_oid(&iter), serverid)))
+        return NULL;
+    record = doc2variables(doc);
+    if (!(projection = model_projection(table, NULL)))
+        return record;
+    for (var = record; var; var = next) {
+        next = var->next;
+        if (bson_has_field(projection, key_asterisk2mongo(var->name))) {
+            prev = var;
+            continue;
+        }
+        if (prev)
+            prev->next = next;
+        else
+            record = next;
+        var->next = NULL;
+        ast_variables_destroy(var);
+    }
+    bson_destroy(projection);
+    return record;
+}
+
+/*!
+ * \brief replace, add or remove the record of the id,
+ * dropping the indexes pointing into the records to be made again on demand.
+ * \param record  is taken by the snapshot, NULL to remove.
+ * \note lock of the snapshot must be held.
+ * \retval 0 on success, -1 on failure.
+ */
+static int snapshot_replace(struct snapshot *snapshot, const char *id, struct ast_variable *record)
+{
+    struct snapshot_index *index;
+    size_t i;
+
+    for (i = 0; i < snapshot->count; i++) {
+        const char *value = record_value(snapshot->records[i], "id");
+        if (value && !strcmp(value, id))
+            break;
+    }
+    if (i < snapshot->count) {
+        ast_variables_destroy(snapshot->records[i]);
+        if (record)
+            snapshot->records[i] = record;
+        else {
+            snapshot->count--;
+            memmove(snapshot->records + i, snapshot->records + i + 1,
+                (snapshot->count - i) * sizeof(*snapshot->records));
+        }
+    }
+    else if (record) {
+        if (snapshot->count == snapshot->size) {
+            size_t grown = snapshot->size ? snapshot->size * 2 : PRELOAD_BATCH;
+            struct ast_variable **records = ast_realloc(snapshot->records, grown * sizeof(*records));
+
+            if (!records) {
+                ast_log(LOG_ERROR, "not enough memory\n");
+                ast_variables_destroy(record);
+                return -1;
+            }
+            snapshot->records = records;
+            snapshot->size = grown;
+        }
+        snapshot->records[snapshot->count++] = record;
+    }
+    while ((index = AST_LIST_REMOVE_HEAD(&snapshot->indexes, list)))
+        ast_free(index);
+    return 0;
+}
+
+/*!
+ * \brief apply a change of a document to the snapshot of the table by its _id.
+ * \param doc  is the whole document after the change, NULL if removed.
+ */
+static void preload_apply(const char *database, const char *table, const char *id, const bson_t *doc)
+{
+    struct preload *preload;
+    struct snapshot *snapshot = NULL;
+    int res;
+
+    ast_mutex_lock(&preloads_lock);
+    preload = preload_get(database, table);
+    if (preload) {
+        // a snapshot being loaded may predate the change
+        preload->generation++;
+        if ((snapshot = preload->snapshot))
+            ao2_ref(snapshot, +1);
+    }
+    ast_mutex_unlock(&preloads_lock);
+    if (!snapshot)
+        return;
+
+    ao2_lock(snapshot);
+    res = snapshot_replace(snapshot, id, doc ? preload_record(table, doc) : NULL);
+    ao2_unlock(snapshot);
+    ao2_ref(snapshot, -1);
+    if (res)
+        preload_stale(database, table);
+}
+
+/*!
+ * \brief drop cached results which a change of the document might affect,
+ * i.e. ones of realtime() having the same id and all others of the table.
+ * \param database  is NULL for any database.
+ * \param table     is NULL for any table.
+ * \param id        is NULL for all results of the table.
+ * \retval number of dropped results.
+ */
+static int cache_evict(const char *database, const char *table, const char *id)
+{
+    struct cache_list *lists[] = { &cache_lru, &negative_lru };
+    struct cache_entry *entry;
+    struct cache_generation *generation;
+    int count = 0;
+    unsigned i;
+
+    // a change by _id has been applied to snapshots already
+    if (!id)
+        preload_stale(database, table);
+    ast_mutex_lock(&cache_lock);
+    // results being queried now may predate the change
+    AST_LIST_TRAVERSE(&cache_generations, generation, list) {
+        if ((database && strcmp(generation->database, database))
+        || (table && strcmp(generation->table, table)))
+            continue;
+        generation->generation++;
+    }
+    for (i = 0; i < ARRAY_LEN(lists); i++) {
+        AST_DLLIST_TRAVERSE_SAFE_BEGIN(lists[i], entry, lru) {
+            if ((database && strcmp(entry->database, database))
+            || (table && strcmp(entry->table, table))
+            || (id && entry->var && !variables_have_id(entry->var, id)))
+                continue;
+            cache_remove(entry);
+            count++;
+        }
+        AST_DLLIST_TRAVERSE_SAFE_END;
+    }
+    cache_purges += count;
+    ast_mutex_unlock(&cache_lock);
+    return count;
+}
+
+/*!
+ * \brief drop cached results of the table.
+ * \param database  is NULL for any database.
+ * \param table     is NULL for any table.
+ * \retval number of dropped results.
+ */
+static int cache_purge(const char *database, const char *table)
+{
+    return cache_evict(database, table, NULL);
+}
+
+/*!
+ * \brief apply a change event of the watched collection to the cache.
+ * \retval 0 to keep watching,
+ * \retval -1 if the stream has been invalidated.
+ */
+static int watcher_apply(struct watcher *watcher, const char *name, const bson_t *change)
+{
+    bson_iter_t iter;
+    bson_iter_t id;
+    const char *op = "";
+    const char *key;
+    const char *value;
+    char work[DOC_VALUE_SIZE];
+    uint32_t length;
+
+    if (bson_iter_init_find(&iter, change, "operationType") && BSON_ITER_HOLDS_UTF8(&iter))
+        op = bson_iter_utf8(&iter, &length);
+    ast_log(LOG_DEBUG, "%s changed by %s\n", name, op);
+
+    if (!strcmp(op, "invalidate")) {
+        ast_db_del(WATCH_FAMILY, name);
+        cache_purge(watcher->database, watcher->table);
+        return -1;
+    }
+    if (bson_iter_init(&iter, change)
+    && bson_iter_find_descendant(&iter, "documentKey._id", &id)
+    && doc2value(&id, &key, &value, work, sizeof(work))) {
+        bson_iter_t full;
+        bool found = bson_iter_init_find(&full, change, "fullDocument");
+
+        // fullDocument is looked up for updates of preloaded tables, null if removed since
+        if (found && BSON_ITER_HOLDS_DOCUMENT(&full)) {
+            const uint8_t *data;
+            bson_t doc;
+
+            bson_iter_document(&full, &length, &data);
+            if (bson_init_static(&doc, data, length))
+                preload_apply(watcher->database, watcher->table, value, &doc);
+            else
+                preload_stale(watcher->database, watcher->table);
+        }
+        else if (!strcmp(op, "delete") || (found && BSON_ITER_HOLDS_NULL(&full)))
+            preload_apply(watcher->database, watcher->table, value, NULL);
+        else
+            preload_stale(watcher->database, watcher->table);
+        cache_evict(watcher->database, watcher->table, value);
+    }
+    else
+        cache_purge(watcher->database, watcher->table);
+
+    // the _id of an event is the token to resume after it
+    if (bson_iter_init_find(&iter, change, "_id") && BSON_ITER_HOLDS_DOCUMENT(&iter)) {
+        const uint8_t *data;
+        bson_t token;
+        char *json;
+
+        bson_iter_document(&iter, &length, &data);
+        if (bson_init_static(&token, data, length)
+        && (json = bson_as_json(&token, NULL))) {
+            ast_db_put(WATCH_FAMILY, name, json);
+            bson_free(json);
+        }
+    }
+    return 0;
+}
+
+/*!
+ * \brief watch changes of the collection until any error or shutdown.
+ */
+static void watcher_watch(struct watcher *watcher, mongoc_client_t *dbclient, const char *name)
+{
+    mongoc_collection_t *collection;
+    mongoc_change_stream_t *stream = NULL;
+    bson_t pipeline = BSON_INITIALIZER;
+    bson_t opts = BSON_INITIALIZER;
+    bson_t *token = NULL;
+    char *json = NULL;
+    bool preloaded;
+
+    do {
+        const bson_t *change;
+        const bson_t *reply;
+        bson_error_t error;
+
+        collection = ast_mongo_collection_get(dbpool, dbclient, watcher->database, watcher->table);
+        if (!collection)
+            break;
+
+        BSON_APPEND_INT32(&opts, "maxAwaitTimeMS", WATCH_AWAIT);
+        // to apply updates to the snapshot by _id
+        ast_mutex_lock(&preloads_lock);
+        preloaded = preload_get(watcher->database, watcher->table) != NULL;
+        ast_mutex_unlock(&preloads_lock);
+        if (preloaded)
+            BSON_APPEND_UTF8(&opts, "fullDocument", "updateLookup");
+        if (!ast_db_get_allocated(WATCH_FAMILY, name, &json)
+        && (token = bson_new_from_json((const uint8_t *)json, -1, NULL)))
+            BSON_APPEND_DOCUMENT(&opts, "resumeAfter", token);
+
+        stream = mongoc_collection_watch(collection, &pipeline, &opts);
+        if (mongoc_change_stream_error_document(stream, &error, &reply)) {
+            ast_log(LOG_WARNING, "cannot watch %s, %s\n", name, error.message);
+            // the token may have gone out of the oplog
+            if (token)
+                ast_db_del(WATCH_FAMILY, name);
+            break;
+        }
+        // without the token, results cached before watching may have missed changes
+        if (!token)
+            cache_purge(watcher->database, watcher->table);
+        ast_log(LOG_DEBUG, "watching %s\n", name);
+
+        while (!watchers_stop) {
+            if (mongoc_change_stream_next(stream, &change)) {
+                if (watcher_apply(watcher, name, change))
+                    break;
+            }
+            else if (mongoc_change_stream_error_document(stream, &error, &reply)) {
+                ast_log(LOG_WARNING, "stopped watching %s, %s\n", name, error.message);
+                break;
+            }
+        }
+    } while(0);
+
+    if (stream)
+        mongoc_change_stream_destroy(stream);
+    if (token)
+        bson_destroy(token);
+    ast_free(json);
+    bson_destroy(&opts);
+    bson_destroy(&pipeline);
+}
+
+/*!
+ * \brief background watcher of a cached collection, which rewatches after any error.
+ */
+static void *watcher_run(void *data)
+{
+    struct watcher *watcher = data;
+    char name[WATCH_NAME_SIZE];
+
+    snprintf(name, sizeof(name), "%s/%s", watcher->database, watcher->table);
+
+    while (!watchers_stop) {
+        mongoc_client_t *dbclient = mongoc_client_pool_pop(dbpool);
+        struct timeval deadline;
+        struct timespec ts;
+
+        if (dbclient) {
+            watcher_watch(watcher, dbclient, name);
+            ast_mongo_client_push(dbpool, dbclient);
+        }
+
+        deadline = ast_tvadd(ast_tvnow(), ast_samp2tv(WATCH_RETRY, 1));
+        ts.tv_sec = deadline.tv_sec;
+        ts.tv_nsec = deadline.tv_usec * 1000;
+        ast_mutex_lock(&watchers_lock);
+        if (!watchers_stop)
+            ast_cond_timedwait(&watchers_cond, &watchers_lock, &ts);
+        ast_mutex_unlock(&watchers_lock);
+    }
+    return NULL;
+}
+
+/*!
+ * \brief start watching the collection unless watched already.
+ */
+static void watcher_start(const char *database, const char *table)
+{
+    struct watcher *watcher;
+
+    ast_mutex_lock(&watchers_lock);
+    do {
+        if (!cache_watch || watchers_stop || !dbpool)
+            break;
+        AST_LIST_TRAVERSE(&watchers, watcher, list) {
+            if (!strcmp(watcher->table, table) && !strcmp(watcher->database, database))
+                break;
+        }
+        if (watcher)
+            break;
+
+        watcher = ast_calloc(1, sizeof(*watcher) + strlen(database) + strlen(table) + 2);
+        if (!watcher) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
+        }
+        watcher->database = strcpy(watcher->buf, database);
+        watcher->table = strcpy(watcher->buf + strlen(database) + 1, table);
+        if (ast_pthread_create_background(&watcher->thread, NULL, watcher_run, watcher)) {
+            ast_log(LOG_ERROR, "unable to watch %s.%s\n", database, table);
+            ast_free(watcher);
+            break;
+        }
+        AST_LIST_INSERT_TAIL(&watchers, watcher, list);
+    } while(0);
+    ast_mutex_unlock(&watchers_lock);
+}
+
+/*!
+ * \brief stop all watchers, which hold clients of dbpool.
+ */
+static void watchers_shutdown(void)
+{
+    struct watcher *watcher;
+
+    ast_mutex_lock(&watchers_lock);
+    watchers_stop = 1;
+    ast_cond_broadcast(&watchers_cond);
+    ast_mutex_unlock(&watchers_lock);
+
+    // nobody else adds a watcher while stopping
+    while ((watcher = AST_LIST_REMOVE_HEAD(&watchers, list))) {
+        pthread_join(watcher->thread, NULL);
+        ast_free(watcher);
+    }
+
+    ast_mutex_lock(&watchers_lock);
+    watchers_stop = 0;
+    ast_mutex_unlock(&watchers_lock);
+}
+
+/*!
+ * \brief keep a copy of the result, evicting the least recently used ones
+ * beyond cache_memory, or beyond negative_size if both var and cfg are NULL.
+ * \param generation  of the table snapshot before the query, not to keep the result
+ *                    if the table has changed since.
+ */
+static void cache_put(const char *key, const char *database, const char *table,
+    unsigned generation, struct ast_variable *var, const struct ast_config *cfg)
+{
+    struct cache_entry *entry;
+    struct cache_entry *old;
+    struct cache_generation *current;
+    bool linked = false;
+    size_t key_len = strlen(key) + 1;
+    size_t database_len = strlen(database) + 1;
+    size_t table_len = strlen(table) + 1;
+    unsigned ttl;
+
+    entry = ao2_alloc_options(sizeof(*entry) + key_len + database_len + table_len,
+        cache_entry_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+    if (!entry) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        return;
+    }
+    entry->key = memcpy(entry->buf, key, key_len);
+    entry->database = memcpy(entry->buf + key_len, database, database_len);
+    entry->table = memcpy(entry->buf + key_len + database_len, table, table_len);
+    entry->size = sizeof(*entry) + key_len + database_len + table_len;
+    if (var) {
+        entry->var = ast_variables_dup(var);
+        entry->size += variables_size(entry->var);
+    }
+    if (cfg) {
+        struct ast_category *cat = NULL;
+
+        entry->cfg = ast_config_copy(cfg);
+        while (entry->cfg && (cat = ast_category_browse_filtered(entry->cfg, NULL, cat, NULL)))
+            entry->size += CACHE_CATEGORY_SIZE + variables_size(ast_category_first(cat));
+    }
+    if ((var && !entry->var) || (cfg && !entry->cfg)) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        ao2_ref(entry, -1);
+        return;
+    }
+
+    ast_mutex_lock(&cache_lock);
+    do {
+        if (!cache)
+            break;
+        current = cache_generation_find(database, table, false);
+        if (!current || current->generation != generation)
+            break;
+        ttl = cache_ttl_find(table, cache_entry_is_negative(entry));
+        if (!ttl)
+            break;
+        entry->expires = ast_tvadd(ast_tvnow(), ast_samp2tv(ttl, 1));
+        old = ao2_find(cache, key, OBJ_SEARCH_KEY);
+        if (old) {
+            cache_remove(old);
+            ao2_ref(old, -1);
+        }
+        ao2_link(cache, entry);
+        linked = true;
+        if (cache_entry_is_negative(entry)) {
+            AST_DLLIST_INSERT_HEAD(&negative_lru, entry, lru);
+            negative_count++;
+            negative_misses++;
+            while (negative_count > negative_size && (old = AST_DLLIST_LAST(&negative_lru))) {
+                cache_remove(old);
+                negative_evictions++;
+            }
+            break;
+        }
+        AST_DLLIST_INSERT_HEAD(&cache_lru, entry, lru);
+        cache_used += entry->size;
+        while (cache_used > cache_memory && (old = AST_DLLIST_LAST(&cache_lru))) {
+            cache_remove(old);
+            cache_evictions++;
+        }
+    } while(0);
+    ast_mutex_unlock(&cache_lock);
+    ao2_ref(entry, -1);
+    // nothing to keep fresh for tables which are not cached
+    if (linked)
+        watcher_start(database, table);
+}
+
+/*!
+ * \brief join the query in flight of the same lookup, or take off a new one.
+ * A passenger waits until the query lands.
+ * \param[out] pilot  is set true if the caller has to query and land it.
+ * \retval NULL if no memory to share the query.
+ */
+static struct flight *flight_board(const char *key, bool *pilot)
+{
+    struct flight *flight;
+
+    ast_mutex_lock(&flights_lock);
+    AST_LIST_TRAVERSE(&flights, flight, list) {
+        if (!strcmp(flight->key, key))
+            break;
+    }
+    if (flight) {
+        *pilot = false;
+        flight->passengers++;
+        while (!flight->landed)
+            ast_cond_wait(&flights_cond, &flights_lock);
+    }
+    else {
+        *pilot = true;
+        flight = ast_calloc(1, sizeof(*flight) + strlen(key) + 1);
+        if (flight) {
+            flight->key = strcpy(flight->buf, key);
+            AST_LIST_INSERT_HEAD(&flights, flight, list);
+        }
+    }
+    ast_mutex_unlock(&flights_lock);
+    return flight;
+}
+
+/*!
+ * \brief land the query with its result, to be shared by the passengers.
+ */
+static void flight_land(struct flight *flight, struct ast_variable *var, struct ast_config *cfg)
+{
+    if (!flight)
+        return;
+
+    ast_mutex_lock(&flights_lock);
+    AST_LIST_REMOVE(&flights, flight, list);
+    if (flight->passengers) {
+        flight->var = var ? ast_variables_dup(var) : NULL;
+        flight->cfg = cfg ? ast_config_copy(cfg) : NULL;
+        flight->landed = true;
+        ast_cond_broadcast(&flights_cond);
+    }
+    else
+        ast_free(flight);
+    ast_mutex_unlock(&flights_lock);
+}
+
+/*!
+ * \brief take a copy of the result of the landed query, and leave it.
+ */
+static void flight_leave(struct flight *flight, struct ast_variable **var, struct ast_config **cfg)
+{
+    ast_mutex_lock(&flights_lock);
+    if (var)
+        *var = flight->var ? ast_variables_dup(flight->var) : NULL;
+    if (cfg)
+        *cfg = flight->cfg ? ast_config_copy(flight->cfg) : NULL;
+    flights_shared++;
+    if (--flight->passengers == 0) {
+        if (flight->var)
+            ast_variables_destroy(flight->var);
+        if (flight->cfg)
+            ast_config_destroy(flight->cfg);
+        ast_free(flight);
+    }
+    ast_mutex_unlock(&flights_lock);
+}
+
+/*!
+ * \brief apply 'cache', 'cache_negative' and 'cache_memory' options, and drop all cached results.
+ */
+static void cache_configure(struct ast_config *cfg)
+{
+    struct ast_variable *var;
+    struct cache_ttl *ttl;
+    const char *tmp;
+
+    ast_mutex_lock(&cache_lock);
+    while ((ttl = AST_LIST_REMOVE_HEAD(&cache_ttls, list)))
+        ast_free(ttl);
+    for (var = ast_variable_browse(cfg, CATEGORY); var; var = var->next) {
+        const char *colon;
+        unsigned seconds;
+        bool negative = !strcasecmp(var->name, "cache_negative");
+
+        if (strcasecmp(var->name, "cache") && !negative)
+            continue;
+        colon = strrchr(var->value, ':');
+        if (!colon || colon == var->value || sscanf(colon + 1, "%u", &seconds) != 1) {
+            ast_log(LOG_WARNING, "%s must be table:ttl, not '%s'\n", var->name, var->value);
+            continue;
+        }
+        if (!seconds)
+            continue;
+        ttl = ast_calloc(1, sizeof(*ttl) + (colon - var->value) + 1);
+        if (!ttl) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
+        }
+        ttl->ttl = seconds;
+        ttl->negative = negative;
+        ast_copy_string(ttl->table, var->value, (colon - var->value) + 1);
+        AST_LIST_INSERT_TAIL(&cache_ttls, ttl, list);
+    }
+    cache_memory = CACHE_MEMORY;
+    if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "cache_memory"))
+    && sscanf(tmp, "%zu", &cache_memory) != 1) {
+        ast_log(LOG_WARNING, "cache_memory must be a number of bytes, not '%s'\n", tmp);
+        cache_memory = CACHE_MEMORY;
+    }
+    cache_watch = (tmp = ast_variable_retrieve(cfg, CATEGORY, "cache_watch")) && ast_true(tmp);
+    negative_size = NEGATIVE_SIZE;
+    if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "cache_negative_size"))
+    && (sscanf(tmp, "%u", &negative_size) != 1 || negative_size == 0)) {
+        ast_log(LOG_WARNING, "cache_negative_size must be a positive number, not '%s'\n", tmp);
+        negative_size = NEGATIVE_SIZE;
+    }
+    ast_mutex_unlock(&cache_lock);
+    cache_purge(NULL, NULL);
+}
+
+static char *handle_cli_show_cache(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    struct cache_ttl *ttl;
+    struct watcher *watcher;
+
+    switch (cmd) {
+    case CLI_INIT:
+        e->command = "mongodb show realtime cache";
+        e->usage =
+            "Usage: mongodb show realtime cache\n"
+            "       Shows the number of results cached for realtime lookups,\n"
+            "       bytes used of the budget, hits, misses, evictions and purges,\n"
+            "       the same of results which matched nothing,\n"
+            "       the number of lookups which shared a query in flight of another,\n"
+            "       then time to live of each cached table, of its results which matched\n"
+            "       nothing, and watched collections.\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+    if (a->argc != 4)
+        return CLI_SHOWUSAGE;
+
+    ast_mutex_lock(&cache_lock);
+    ast_cli(a->fd, "%d results, %zu of %zu bytes, %lu hits, %lu misses, %lu evictions, %lu purges\n",
+        cache ? ao2_container_count(cache) - (int)negative_count : 0, cache_used, cache_memory,
+        (unsigned long)cache_hits, (unsigned long)cache_misses,
+        (unsigned long)cache_evictions, (unsigned long)cache_purges);
+    ast_cli(a->fd, "%u of %u results which matched nothing, %lu hits, %lu misses, %lu evictions\n",
+        negative_count, negative_size,
+        (unsigned long)negative_hits, (unsigned long)negative_misses,
+        (unsigned long)negative_evictions);
+    ast_cli(a->fd, "%lu lookups shared a query in flight\n", (unsigned long)flights_shared);
+    AST_LIST_TRAVERSE(&cache_ttls, ttl, list)
+        ast_cli(a->fd, "  %-32s %u sec%s\n", ttl->table, ttl->ttl, ttl->negative ? " if nothing matched" : "");
+    ast_mutex_unlock(&cache_lock);
+
+    ast_mutex_lock(&watchers_lock);
+    AST_LIST_TRAVERSE(&watchers, watcher, list)
+        ast_cli(a->fd, "  watching %s.%s\n", watcher->database, watcher->table);
+    ast_mutex_unlock(&watchers_lock);
+    return CLI_SUCCESS;
+}
+
+/*!
+ * \brief a shape of queries on a table, which an index serves
+ */
+struct shape {
+    const char *database;
+    const char *table;
+    const char *fields;             // to be indexed in order, see ast_mongo_index_new()
+    unsigned equals;                // leading fields every query compares for equality
+    uint64_t lookups;               // since loaded
+    enum shape_state state;         // with shapes locked
+    char key[0];                    // database/table/fields, followed by each of them
+};
+
+static const char *shape_state_names[] = {
+    [SHAPE_UNCHECKED] = "unchecked",
+    [SHAPE_INDEXED] = "indexed",
+    [SHAPE_SCANNING] = "scanning",
+    [SHAPE_FAILED] = "failed",
+};
+
+static int shape_hash(const void *obj, int flags)
+{
+    const char *key = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY
+        ? obj : ((const struct shape *)obj)->key;
+    return ast_str_hash(key);
+}
+
+static int shape_cmp(void *obj, void *arg, int flags)
+{
+    const struct shape *shape = obj;
+    const char *key = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY
+        ? arg : ((const struct shape *)arg)->key;
+    return strcmp(shape->key, key) ? 0 : CMP_MATCH | CMP_STOP;
+}
+
+/*!
+ * \brief find a shape, or add it unless known.
+ * \param key     is database/table/fields.
+ * \param equals  is number of leading fields compared for equality.
+ * \retval the shape with a reference, NULL if too many shapes or no memory.
+ */
+static struct shape *shape_add(const char *key, const char *database, const char *table, const char *fields,
+    unsigned equals)
+{
+    struct shape *shape;
+    size_t key_len = strlen(key) + 1;
+    size_t database_len = strlen(database) + 1;
+    size_t table_len = strlen(table) + 1;
+
+    shape = ao2_find(shapes, key, OBJ_SEARCH_KEY);
+    if (shape)
+        return shape;
+
+    ao2_lock(shapes);
+    do {
+        // another thread may have added it meanwhile
+        shape = ao2_find(shapes, key, OBJ_SEARCH_KEY | OBJ_NOLOCK);
+        if (shape || ao2_container_count(shapes) >= SHAPES_MAX)
+            break;
+        shape = ao2_alloc_options(sizeof(*shape) + key_len + database_len + table_len + strlen(fields) + 1,
+            NULL, AO2_ALLOC_OPT_LOCK_NOLOCK);
+        if (!shape) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
+        }
+        shape->database = memcpy(shape->key + key_len, database, database_len);
+        shape->table = memcpy(shape->key + key_len + database_len, table, table_len);
+        shape->fields = strcpy(shape->key + key_len + database_len + table_len, fields);
+        memcpy(shape->key, key, key_len);
+        shape->equals = equals;
+        shape->state = SHAPE_UNCHECKED;
+        ao2_link_flags(shapes, shape, OBJ_NOLOCK);
+    } while(0);
+    ao2_unlock(shapes);
+    return shape;
+}
+
+static int str_cmp(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/*!
+ * \brief append a field to the comma separated list unless listed.
+ */
+static void shape_append(struct ast_str **buf, const char *field)
+{
+    const char *list = ast_str_buffer(*buf);
+    size_t length = strlen(field);
+    const char *p;
+
+    for (p = list; (p = strstr(p, field)); p += length) {
+        if ((p == list || p[-1] == ',') && (p[length] == ',' || p[length] == '\0'))
+            return;
+    }
+    ast_str_append(buf, 0, "%s%s", *list ? "," : "", field);
+}
+
+/*!
+ * \brief record the shape of a query to find documents, i.e. serverid,
+ * fields compared for equality, the field to sort by, then the others,
+ * which is the order of fields an index serves best.
+ * New shapes are kept in astdb to be checked on the next startup.
+ */
+static void shape_record(const char *database, const char *table, const struct ast_variable *fields, const char *orderby)
+{
+    const struct ast_variable *field;
+    const char *equals[SHAPE_FIELDS];
+    const char *ranges[SHAPE_FIELDS];
+    unsigned n_equals = 0;
+    unsigned n_ranges = 0;
+    unsigned i;
+    unsigned prefix;
+    unsigned old;
+    struct ast_str *buf;
+    struct shape *shape;
+    char key[SHAPE_KEY_SIZE];
+    char value[16];
+    bool seen;
+    bool lowered = false;
+    const char *p;
+
+    for (field = fields; field; field = field->next) {
+        char *name = ast_strdupa(field->name);
+        char *op = strchr(name, ' ');
+
+        if (op) {
+            *op++ = '\0';
+            op = ast_skip_blanks(op);
+        }
+        name = (char *)key_asterisk2mongo(name);
+        if (!op || !*op || !strcmp(op, "=") || !strcasecmp(op, "IN") || !strncasecmp(op, "IS", 2)) {
+            if (!strcmp(name, "_id"))
+                return;     // the _id index serves it
+            if (n_equals < SHAPE_FIELDS)
+                equals[n_equals++] = name;
+        }
+        else if (n_ranges < SHAPE_FIELDS)
+            ranges[n_ranges++] = name;
+    }
+
+    buf = ast_str_thread_get(&shape_buf, 128);
+    if (!buf)
+        return;
+    ast_str_set(&buf, 0, "%s", serverid ? SERVERID : "");
+    qsort(equals, n_equals, sizeof(*equals), str_cmp);
+    for (i = 0; i < n_equals; i++)
+        shape_append(&buf, equals[i]);
+    // which an index may have in any order
+    for (prefix = ast_str_strlen(buf) ? 1 : 0, p = ast_str_buffer(buf); *p; p++) {
+        if (*p == ',')
+            prefix++;
+    }
+    if (orderby)
+        shape_append(&buf, key_asterisk2mongo(orderby));
+    for (i = 0; i < n_ranges; i++)
+        shape_append(&buf, ranges[i]);
+    if (!ast_str_strlen(buf))
+        return;
+    if (snprintf(key, sizeof(key), "%s/%s/%s", database, table, ast_str_buffer(buf)) >= (int)sizeof(key))
+        return;
+
+    shape = shape_add(key, database, table, ast_str_buffer(buf), prefix);
+    if (!shape)
+        return;
+    seen = __sync_fetch_and_add(&shape->lookups, 1) != 0;
+    // an index must serve every query of the shape, i.e. the fewest equalities
+    for (old = shape->equals; prefix < old; old = shape->equals) {
+        if ((lowered = __sync_bool_compare_and_swap(&shape->equals, old, prefix)))
+            break;
+    }
+    snprintf(value, sizeof(value), "%u", shape->equals);
+    ao2_ref(shape, -1);
+    // written once per shape since loaded, or lowered, apart from any lock
+    if (!seen || lowered)
+        ast_db_put(SHAPES_FAMILY, key, value);
+}
+
+/*!
+ * \brief load the shapes recorded before.
+ */
+static void shapes_load(void)
+{
+    struct ast_db_entry *entries = ast_db_gettree(SHAPES_FAMILY, NULL);
+    struct ast_db_entry *entry;
+
+    for (entry = entries; entry; entry = entry->next) {
+        // key is /family/database/table/fields
+        const char *name = entry->key + strlen(SHAPES_FAMILY) + 2;
+        char *key = ast_strdupa(name);
+        char *database = strsep(&key, "/");
+        char *table = strsep(&key, "/");
+        unsigned equals;
+
+        // recorded without equals, the fields are to be indexed in order
+        if (sscanf(entry->data, "%u", &equals) != 1)
+            equals = 0;
+        if (!ast_strlen_zero(database) && !ast_strlen_zero(table) && !ast_strlen_zero(key))
+            ao2_cleanup(shape_add(name, database, table, key, equals));
+    }
+    if (entries)
+        ast_db_freetree(entries);
+}
+
+/*!
+ * \brief check if the index keys begin with the fields,
+ * the first equals of which are compared for equality, so in any order.
+ */
+static bool index_serves(const bson_t *key, const char *fields, unsigned equals)
+{
+    bson_iter_t iter;
+    char *list = ast_strdupa(fields);
+    char *field;
+    const char *prefix[SHAPE_FIELDS + 1];   // and serverid
+    unsigned count = 0;
+    unsigned i;
+    unsigned j;
+
+    if (!bson_iter_init(&iter, key))
+        return false;
+    while (count < equals && count < ARRAY_LEN(prefix) && (field = strsep(&list, ",")))
+        prefix[count++] = field;
+    for (i = 0; i < count; i++) {
+        if (!bson_iter_next(&iter))
+            return false;
+        for (j = i; j < count && strcmp(bson_iter_key(&iter), prefix[j]); j++)
+            ;
+        if (j == count)
+            return false;
+        // the matched one aside
+        SWAP(prefix[i], prefix[j]);
+    }
+    // then the field to sort by and the others, in order
+    while ((field = strsep(&list, ","))) {
+        if (!bson_iter_next(&iter) || strcmp(bson_iter_key(&iter), field))
+            return false;
+    }
+    return true;
+}
+
+/*!
+ * \brief check if any index of the collection serves the shape,
+ * and create one if asked.
+ */
+static enum shape_state shape_check(const char *database, const char *table, const char *fields,
+    unsigned equals, bool create)
+{
+    enum shape_state state = SHAPE_FAILED;
+    mongoc_client_t *dbclient = mongoc_client_pool_pop(dbpool);
+    mongoc_cursor_t *cursor = NULL;
+    bson_t *indexes = NULL;
+    bson_t *index = NULL;
+
+    do {
+        mongoc_collection_t *collection;
+        const bson_t *doc;
+        bson_error_t error;
+
+        if (!dbclient) {
+            ast_log(LOG_ERROR, "no client allocated\n");
+            break;
+        }
+        collection = ast_mongo_collection_get(dbpool, dbclient, database, table);
+        if (!collection)
+            break;
+
+        // a collection not created yet has no index
+        cursor = mongoc_collection_find_indexes_with_opts(collection, NULL);
+        state = SHAPE_SCANNING;
+        while (state == SHAPE_SCANNING && mongoc_cursor_next(cursor, &doc)) {
+            bson_iter_t iter;
+            const uint8_t *data;
+            uint32_t length;
+            bson_t key;
+
+            if (bson_iter_init_find(&iter, doc, "key") && BSON_ITER_HOLDS_DOCUMENT(&iter)) {
+                bson_iter_document(&iter, &length, &data);
+                if (bson_init_static(&key, data, length) && index_serves(&key, fields, equals))
+                    state = SHAPE_INDEXED;
+            }
+        }
+        if (mongoc_cursor_error(cursor, &error))
+            ast_log(LOG_DEBUG, "cannot list indexes of %s.%s, %s\n", database, table, error.message);
+        if (state == SHAPE_INDEXED || !create)
+            break;
+
+        index = ast_mongo_index_new(fields);
+        indexes = index ? BCON_NEW("0", BCON_DOCUMENT(index)) : NULL;
+        if (!indexes) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
+        }
+        // pop no other client of the pool meanwhile
+        mongoc_cursor_destroy(cursor);
+        cursor = NULL;
+        ast_mongo_client_push(dbpool, dbclient);
+        dbclient = NULL;
+        state = ast_mongo_indexes_create(dbpool, database, table, indexes) ? SHAPE_FAILED : SHAPE_INDEXED;
+    } while(0);
+
+    if (cursor)
+        mongoc_cursor_destroy(cursor);
+    if (index)
+        bson_destroy(index);
+    if (indexes)
+        bson_destroy(indexes);
+    if (dbclient)
+        ast_mongo_client_push(dbpool, dbclient);
+    return state;
+}
+
+/*!
+ * \brief background task to check all shapes, creating missing indexes if asked.
+ */
+static void *advisor_run(void *data)
+{
+    bool create = data != NULL;
+    struct ao2_iterator iter;
+    struct shape *shape;
+
+    // shapes added meanwhile are checked next time
+    iter = ao2_iterator_init(shapes, 0);
+    for (; (shape = ao2_iterator_next(&iter)); ao2_ref(shape, -1)) {
+        enum shape_state state = shape_check(shape->database, shape->table, shape->fields,
+            shape->equals, create);
+
+        ao2_lock(shapes);
+        shape->state = state;
+        ao2_unlock(shapes);
+        if (state == SHAPE_INDEXED)
+            ast_log(LOG_DEBUG, "%s.%s is indexed on %s\n", shape->database, shape->table, shape->fields);
+        else
+            ast_log(LOG_NOTICE, "%s.%s is scanned to find %s, no index on them\n",
+                shape->database, shape->table, shape->fields);
+    }
+    ao2_iterator_destroy(&iter);
+
+    ast_mutex_lock(&advisor_lock);
+    advisor_running = 0;
+    ast_mutex_unlock(&advisor_lock);
+    return NULL;
+}
+
+/*!
+ * \brief wait for the advisor, which uses dbpool.
+ */
+static void advisor_join(void)
+{
+    pthread_t thread;
+
+    ast_mutex_lock(&advisor_lock);
+    thread = advisor_thread;
+    advisor_thread = AST_PTHREADT_NULL;
+    ast_mutex_unlock(&advisor_lock);
+    if (thread != AST_PTHREADT_NULL)
+        pthread_join(thread, NULL);
+}
+
+/*!
+ * \brief start the advisor in background unless running.
+ * \param create  is true to create missing indexes.
+ * \retval 0 on success, -1 if running already or failed.
+ */
+static int advisor_start(bool create)
+{
+    int res = -1;
+
+    ast_mutex_lock(&advisor_lock);
+    do {
+        if (advisor_running)
+            break;
+        if (advisor_thread != AST_PTHREADT_NULL)
+            pthread_join(advisor_thread, NULL);     // finished already
+        if (ast_pthread_create_background(&advisor_thread, NULL, advisor_run, create ? (void *)1 : NULL)) {
+            ast_log(LOG_ERROR, "unable to start the index advisor\n");
+            advisor_thread = AST_PTHREADT_NULL;
+            break;
+        }
+        advisor_running = 1;
+        res = 0;
+    } while(0);
+    ast_mutex_unlock(&advisor_lock);
+    return res;
+}
+
+static char *handle_cli_show_shapes(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    struct ao2_iterator iter;
+    struct shape *shape;
+
+    switch (cmd) {
+    case CLI_INIT:
+        e->command = "mongodb show realtime shapes";
+        e->usage =
+            "Usage: mongodb show realtime shapes\n"
+            "       Shows shapes of realtime queries on each table, i.e. fields to be\n"
+            "       indexed in order, with the number of lookups and whether any index\n"
+            "       serves them as checked last time.\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+    if (a->argc != 4)
+        return CLI_SHOWUSAGE;
+
+    ast_cli(a->fd, "%-32s %-40s %12s %s\n", "table", "fields", "lookups", "state");
+    iter = ao2_iterator_init(shapes, 0);
+    for (; (shape = ao2_iterator_next(&iter)); ao2_ref(shape, -1)) {
+        enum shape_state state;
+        char table[64];
+
+        ao2_lock(shapes);
+        state = shape->state;
+        ao2_unlock(shapes);
+        snprintf(table, sizeof(table), "%s.%s", shape->database, shape->table);
+        ast_cli(a->fd, "%-32s %-40s %12lu %s\n", table, shape->fields,
+            (unsigned long)shape->lookups, shape_state_names[state]);
+    }
+    ao2_iterator_destroy(&iter);
+    return CLI_SUCCESS;
+}
+
+static char *handle_cli_index_shapes(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    switch (cmd) {
+    case CLI_INIT:
+        e->command = "mongodb index realtime shapes";
+        e->usage =
+            "Usage: mongodb index realtime shapes\n"
+            "       Creates indexes in background for shapes of realtime queries\n"
+            "       which no index serves. See \"mongodb show realtime shapes\".\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+    if (a->argc != 4)
+        return CLI_SHOWUSAGE;
+
+    if (advisor_start(true))
+        ast_cli(a->fd, "indexing in progress, try again later.\n");
+    else
+        ast_cli(a->fd, "indexing in background.\n");
+    return CLI_SUCCESS;
+}
+
+static void snapshot_destructor(void *obj)
+{
+    struct snapshot *snapshot = obj;
+    struct snapshot_index *index;
+    size_t i;
+
+    for (i = 0; i < snapshot->count; i++)
+        ast_variables_destroy(snapshot->records[i]);
+    ast_free(snapshot->records);
+    while ((index = AST_LIST_REMOVE_HEAD(&snapshot->indexes, list)))
+        ast_free(index);
+}
+
+static int snapshot_entry_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct snapshot_entry *)a)->value, ((const struct snapshot_entry *)b)->value);
+}
+
+/*!
+ * \brief load all documents of the table, filtered by serverid.
+ * \retval a snapshot to be released by ao2_ref(),
+ * \retval NULL on failure.
+ */
+static struct snapshot *snapshot_load(const char *database, const char *table)
+{
+    struct snapshot *snapshot;
+    mongoc_client_t *dbclient;
+    mongoc_collection_t *collection;
+    mongoc_cursor_t *cursor = NULL;
+    const bson_t *doc;
+    bson_t *query = NULL;
+    bson_t *opts = NULL;
+    bson_t *projection = NULL;
+    bool completed = false;
+
+    snapshot = ao2_alloc_options(sizeof(*snapshot), snapshot_destructor, AO2_ALLOC_OPT_LOCK_MUTEX);
+    if (!snapshot) {
+        ast_log(LOG_ERROR, "not enough memory\n");
+        return NULL;
+    }
+    dbclient = mongoc_client_pool_pop(dbpool);
+    if (!dbclient) {
+        ast_log(LOG_ERROR, "no client allocated\n");
+        ao2_ref(snapshot, -1);
+        return NULL;
+    }
+
+    do {
+        bson_error_t error;
+        bool err = false;
+
+        query = serverid ? BCON_NEW(SERVERID, BCON_OID(serverid)) : bson_new();
+        opts = BCON_NEW("batchSize", BCON_INT64(PRELOAD_BATCH));
+        if ((projection = model_projection(table, NULL)))
+            BSON_APPEND_DOCUMENT(opts, "projection", projection);
+
+        collection = ast_mongo_collection_get(dbpool, dbclient, database, table);
+        if (!collection)
+            break;
+        cursor = mongoc_collection_find_with_opts(collection, query, opts, NULL);
+        if (!cursor) {
+            ast_log(LOG_ERROR, "cannot preload %s.%s\n", database, table);
+            break;
+        }
+        while (!err && mongoc_cursor_next(cursor, &doc)) {
+            struct ast_variable *var = doc2variables(doc);
+
+            if (!var)
+                continue;
+            if (snapshot->count == snapshot->size) {
+                size_t grown = snapshot->size ? snapshot->size * 2 : PRELOAD_BATCH;
+                struct ast_variable **records = ast_realloc(snapshot->records, grown * sizeof(*records));
+
+                if (!records) {
+                    ast_log(LOG_ERROR, "not enough memory to preload %s.%s\n", database, table);
+                    ast_variables_destroy(var);
+                    err = true;
+                    break;
+                }
+                snapshot->records = records;
+                snapshot->size = grown;
+            }
+            snapshot->records[snapshot->count++] = var;
+        }
+        if (mongoc_cursor_error(cursor, &error)) {
+            ast_log(LOG_ERROR, "cannot preload %s.%s, error=%s\n", database, table, error.message);
+            break;
+        }
+        completed = !err;
+    } while(0);
+
+    if (query)
+        bson_destroy(query);
+    if (opts)
+        bson_destroy(opts);
+    if (projection)
+        bson_destroy(projection);
+    if (cursor)
+        mongoc_cursor_destroy(cursor);
+    ast_mongo_client_push(dbpool, dbclient);
+    if (!completed) {
+        ao2_ref(snapshot, -1);
+        return NULL;
+    }
+    ast_log(LOG_DEBUG, "%zu documents preloaded from %s.%s\n", snapshot->count, database, table);
+    return snapshot;
+}
+
+/*!
+ * \brief get values of a field sorted, made at the first use.
+ * \note lock of the snapshot must be held.
+ * \retval the index, which lives until the snapshot changes,
+ * \retval NULL on failure.
+ */
+static const struct snapshot_index *snapshot_index_get(struct snapshot *snapshot, const char *key)
+{
+    struct snapshot_index *index;
+    const char *name = key_mongo2asterisk(key);
+    size_t count = 0;
+    size_t i;
+
+    do {
+        AST_LIST_TRAVERSE(&snapshot->indexes, index, list) {
+            if (!strcmp(index->key, key))
+                break;
+        }
+        if (index)
+            break;
+
+        for (i = 0; i < snapshot->count; i++) {
+            if (record_value(snapshot->records[i], name))
+                count++;
+        }
+        index = ast_calloc(1, sizeof(*index) + count * sizeof(*index->entries) + strlen(key) + 1);
+        if (!index) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
+        }
+        index->key = strcpy((char *)(index->entries + count), key);
+        for (i = 0; i < snapshot->count; i++) {
+            const char *value = record_value(snapshot->records[i], name);
+
+            if (!value)
+                continue;
+            index->entries[index->count].value = value;
+            index->entries[index->count].record = i;
+            index->count++;
+        }
+        qsort(index->entries, index->count, sizeof(*index->entries), snapshot_entry_cmp);
+        AST_LIST_INSERT_HEAD(&snapshot->indexes, index, list);
+    } while(0);
+    return index;
+}
+
+/*!
+ * \brief check if a record matches fields compared for equality, or LIKE '%'.
+ */
+static bool snapshot_match(const struct ast_variable *record,
+    const struct query_plan *plan, const struct ast_variable *fields)
+{
+    unsigned i;
+
+    for (i = 0; i < plan->count; i++, fields = fields->next) {
+        const char *value;
+
+        if (plan->steps[i].op == QUERY_SKIP)
+            continue;
+        value = record_value(record, key_mongo2asterisk(plan->steps[i].key));
+        if (!value)
+            return false;
+        if (plan->steps[i].op == QUERY_EQ && strcmp(value, fields->value))
+            return false;
+    }
+    return true;
+}
+
+/*!
+ * \brief get the snapshot of a preloaded table.
+ * \param[out] preloaded  is set true if the table is preloaded, even if not loaded yet.
+ * \retval a snapshot to be released by ao2_ref(),
+ * \retval NULL if not loaded.
+ */
+static struct snapshot *preload_snapshot(const char *database, const char *table, bool *preloaded)
+{
+    struct preload *preload;
+    struct snapshot *snapshot = NULL;
+
+    ast_mutex_lock(&preloads_lock);
+    preload = preload_get(database, table);
+    if (preload) {
+        *preloaded = true;
+        if ((snapshot = preload->snapshot))
+            ao2_ref(snapshot, +1);
+    }
+    ast_mutex_unlock(&preloads_lock);
+    return snapshot;
+}
+
+/*!
+ * \brief look up the snapshot of a preloaded table instead of MongoDB.
+ * Only fields compared for equality, or LIKE '%', are served.
+ * \param[out] var  is the first matched record for realtime(), if not NULL.
+ * \param[out] cfg  is the matched records for realtime_multi(), if not NULL.
+ * \retval true if served, even if nothing matched,
+ * \retval false to query MongoDB.
+ */
+static bool preload_find(const char *database, const char *table, const struct ast_variable *fields,
+    struct ast_variable **var, struct ast_config **cfg)
+{
+    struct snapshot *snapshot;
+    struct query_plan *plan = NULL;
+    const struct snapshot_index *index = NULL;
+    const struct ast_variable *field;
+    struct snapshot_entry *matched = NULL;
+    const char *value = NULL;
+    size_t count = 0;
+    size_t begin = 0;
+    size_t end;
+    size_t i;
+    bool preloaded = false;
+    bool served = false;
+
+    snapshot = preload_snapshot(database, table, &preloaded);
+    if (!preloaded)
+        return false;
+    // against changes applied in place
+    if (snapshot)
+        ao2_lock(snapshot);
+
+    do {
+        char *initfield;
+        char *op;
+
+        if (!snapshot)
+            break;
+        plan = query_plan_get(table, fields);
+        if (!plan)
+            break;
+        for (i = 0, field = fields; i < plan->count; i++, field = field->next) {
+            const struct query_step *step = &plan->steps[i];
+
+            if (step->op == QUERY_EQ) {
+                size_t hi;
+
+                if (index)
+                    continue;
+                if (!(index = snapshot_index_get(snapshot, step->key)))
+                    break;
+                // the first entry of the value
+                value = field->value;
+                for (begin = 0, hi = index->count; begin < hi; ) {
+                    size_t mid = begin + (hi - begin) / 2;
+                    if (strcmp(index->entries[mid].value, value) < 0)
+                        begin = mid + 1;
+                    else
+                        hi = mid;
+                }
+            }
+            else if (step->op == QUERY_LIKE && !strcmp(field->value, "%"))
+                continue;
+            else if (step->op != QUERY_SKIP)
+                break;
+        }
+        if (i < plan->count)
+            break;
+
+        end = index ? index->count : snapshot->count;
+        if (cfg && !(matched = ast_malloc((end - begin + 1) * sizeof(*matched)))) {
+            ast_log(LOG_ERROR, "not enough memory\n");
+            break;
+        }
+        initfield = ast_strdupa(fields->name);
+        if ((op = strchr(initfield, ' ')))
+            *op = '\0';
+        for (i = begin; i < end; i++) {
+            size_t record = i;
+
+            if (index) {
+                if (strcmp(index->entries[i].value, value))
+                    break;
+                record = index->entries[i].record;
+            }
+            if (!snapshot_match(snapshot->records[record], plan, fields))
+                continue;
+            if (!cfg) {
+                *var = ast_variables_dup(snapshot->records[record]);
+                break;
+            }
+            matched[count].value = S_OR(record_value(snapshot->records[record], initfield), "");
+            matched[count].record = record;
+            count++;
+        }
+        if (cfg) {
+            // ordered by the first field as find_all() does
+            qsort(matched, count, sizeof(*matched), snapshot_entry_cmp);
+            if (!(*cfg = ast_config_new())) {
+                ast_log(LOG_WARNING, "out of memory!\n");
+                break;
+            }
+            for (i = 0; i < count; i++) {
+                struct ast_category *cat = ast_category_new(matched[i].value, "", 99999);
+
+                if (!cat) {
+                    ast_log(LOG_WARNING, "out of memory!\n");
+                    break;
+                }
+                ast_variable_append(cat, ast_variables_dup(snapshot->records[matched[i].record]));
+                ast_category_append(*cfg, cat);
+            }
+        }
+        served = true;
+    } while(0);
+
+    ast_free(matched);
+    ao2_cleanup(plan);
+    if (snapshot) {
+        ao2_unlock(snapshot);
+        ao2_ref(snapshot, -1);
+    }
+    if (served)
+        __sync_fetch_and_add(&preload_hits, 1);
+    else
+        __sync_fetch_and_add(&preload_misses, 1);
+    return served;
+}
+
+/*!
+ * \brief load snapshots of preloaded tables when due, until stopped.
+ */
+static void *preloader_run(void *data)
+{
+    ast_mutex_lock(&preloads_lock);
+    while (!preloader_stop) {
+        struct preload *preload;
+        time_t now = time(NULL);
+        time_t next = now + PRELOAD_WAIT;
+        struct timespec ts;
+
+        // nobody else adds or removes a preload while running
+        AST_LIST_TRAVERSE(&preloads, preload, list) {
+            struct snapshot *snapshot;
+            unsigned generation;
+
+            if (preloader_stop)
+                break;
+            if (preload->snapshot && !preload->refresh && !preload->stale)
+                continue;
+            if (now < preload->due) {
+                if (preload->due < next)
+                    next = preload->due;
+                continue;
+            }
+            generation = preload->generation;
+            ast_mutex_unlock(&preloads_lock);
+            snapshot = snapshot_load(preload->database, preload->table);
+            if (snapshot)
+                watcher_start(preload->database, preload->table);
+            ast_mutex_lock(&preloads_lock);
+
+            now = time(NULL);
+            if (!snapshot)
+                preload->due = now + PRELOAD_RETRY;
+            else if (generation != preload->generation) {
+                // changed while loading, to be loaded again, soon if nothing is served
+                ao2_ref(snapshot, -1);
+                preload->due = preload->snapshot ? now + PRELOAD_DEBOUNCE : now;
+            }
+            else {
+                ao2_cleanup(preload->snapshot);
+                preload->snapshot = snapshot;
+                preload->stale = false;
+                preload->loaded = now;
+                preload->due = now + preload->refresh;
+            }
+            if (preload->due < next && (!preload->snapshot || preload->refresh || preload->stale))
+                next = preload->due;
+        }
+        if (preloader_stop || next <= now)
+            continue;
+        ts.tv_sec = next;
+        ts.tv_nsec = 0;
+        ast_cond_timedwait(&preloads_cond, &preloads_lock, &ts);
+    }
+    ast_mutex_unlock(&preloads_lock);
+    return NULL;
+}
+
+/*!
+ * \brief stop the preloader, which holds clients of dbpool, and drop all snapshots.
+ */
+static void preloads_shutdown(void)
 {
-    if (size < 25) {
-        ast_log(LOG_ERROR, "size of value is too small\n");
-        return false;
-    }
-    if (BSON_ITER_HOLDS_OID(iter)) {
-        const bson_oid_t * oid;
-        if (strcmp(bson_iter_key(iter), SERVERID) == 0) {
-            // SERVERID is hidden property for application
-            return false;
-        }
-        oid = bson_iter_oid(iter);
-        bson_oid_to_string(oid, value);
-    }
-    else if (BSON_ITER_HOLDS_UTF8(iter)) {
-        uint32_t length;
-        const char* str = bson_iter_utf8(iter, &length);
-        if (!bson_utf8_validate(str, length, false)) {
-            ast_log(LOG_WARNING, "unexpected invalid bson found\n");
-            return false;
-        }
-        snprintf(value, size, "%s", str);
-    }
-    else if (BSON_ITER_HOLDS_BOOL(iter)) {
-        bool d = bson_iter_bool(iter);
-        snprintf(value, size, "%s", d ? "true" : "false");
-    }
-    else if (BSON_ITER_HOLDS_INT32(iter)) {
-        long d = bson_iter_int32(iter);
-        snprintf(value, size, "%ld", d);
-    }
-    else if (BSON_ITER_HOLDS_INT64(iter)) {
-        long long d = bson_iter_int64(iter);
-        snprintf(value, size, "%Ld", d);
-    }
-    else if (BSON_ITER_HOLDS_DOUBLE(iter)) {
-        double d = bson_iter_double(iter);
-        snprintf(value, size, "%.10g", d);
+    struct preload *preload;
+
+    ast_mutex_lock(&preloads_lock);
+    preloader_stop = 1;
+    ast_cond_signal(&preloads_cond);
+    ast_mutex_unlock(&preloads_lock);
+    if (preloader != AST_PTHREADT_NULL) {
+        pthread_join(preloader, NULL);
+        preloader = AST_PTHREADT_NULL;
     }
-    else {
-        // see http://api.mongodb.org/libbson/current/bson_iter_type.html
-        ast_log(LOG_WARNING, "unexpected bson type, %x\n", bson_iter_type(iter));
-        return false;
+
+    ast_mutex_lock(&preloads_lock);
+    while ((preload = AST_LIST_REMOVE_HEAD(&preloads, list))) {
+        ao2_cleanup(preload->snapshot);
+        ast_free(preload);
     }
-    *key = key_mongo2asterisk(bson_iter_key(iter));
-    return true;
+    preloader_stop = 0;
+    ast_mutex_unlock(&preloads_lock);
 }
 
 /*!
- * \brief Update documents in collection that match selector.
- * \param[in] collection    is a mongoc_collection_t.
- * \param[in] selector      is a bson_t containing the query to match documents for updating.
- * \param[in] update        is a bson_t containing the update to perform.
- *
- * \retval number of rows affected
- * \retval -1 on failure
-*/
-static int _collection_update(
-    mongoc_collection_t *collection, const bson_t *selector, const bson_t *update)
+ * \brief start preloading tables configured by preload=database.table[:refresh].
+ */
+static void preloads_configure(struct ast_config *cfg)
 {
-    int ret = -1;
-    bson_t *cmd = NULL;
-    bson_t *opts = NULL;
-    bson_t *updates = NULL;
-    bson_t array = BSON_INITIALIZER;
-    bson_t reply = BSON_INITIALIZER;
-
-    LOG_BSON_AS_JSON(LOG_DEBUG, "selector=%s\n", selector);
-    LOG_BSON_AS_JSON(LOG_DEBUG, "update=%s\n", update);
+    struct ast_variable *var;
+    struct preload *preload;
 
-    do {
-        bson_error_t error;
-        bson_iter_t iter;
-
-        opts = bson_new();
-        updates = BCON_NEW(
-            "q", BCON_DOCUMENT(selector),
-            "u", BCON_DOCUMENT(update),
-            "multi", BCON_BOOL(true)
-        );
-        bson_append_document(&array, "0", -1, updates);
-        cmd = BCON_NEW(
-           "update", BCON_UTF8(mongoc_collection_get_name(collection)),
-           "updates", BCON_ARRAY(&array)
-        );
+    ast_mutex_lock(&preloads_lock);
+    for (var = ast_variable_browse(cfg, CATEGORY); var; var = var->next) {
+        const char *dot;
+        const char *colon;
+        unsigned refresh = 0;
 
-        if (!mongoc_collection_write_command_with_opts(
-            collection, cmd, opts, &reply, &error))
-        {
-            ast_log(LOG_ERROR, "update failed, error=%s\n", error.message);
-            LOG_BSON_AS_JSON(LOG_ERROR, "cmd=%s\n", cmd);
-            break;
+        if (strcasecmp(var->name, "preload"))
+            continue;
+        dot = strchr(var->value, '.');
+        colon = strrchr(var->value, ':');
+        if (!colon)
+            colon = var->value + strlen(var->value);
+        if (!dot || dot == var->value || dot + 1 >= colon
+        || (*colon && sscanf(colon + 1, "%u", &refresh) != 1)) {
+            ast_log(LOG_WARNING, "preload must be database.table[:refresh], not '%s'\n", var->value);
+            continue;
         }
-        LOG_BSON_AS_JSON(LOG_DEBUG, "reply=%s\n", &reply);
-
-        if (!bson_iter_init(&iter, &reply)
-        || !bson_iter_find(&iter, "nModified")
-        || !BSON_ITER_HOLDS_INT32(&iter)) {
-            ast_log(LOG_ERROR, "no \"nModified\" field found.\n");
+        preload = ast_calloc(1, sizeof(*preload) + (colon - var->value) + 1);
+        if (!preload) {
+            ast_log(LOG_ERROR, "not enough memory\n");
             break;
         }
-        ret = bson_iter_int32(&iter);
-    } while(0);
+        ast_copy_string(preload->buf, var->value, (colon - var->value) + 1);
+        preload->buf[dot - var->value] = '\0';
+        preload->database = preload->buf;
+        preload->table = preload->buf + (dot - var->value) + 1;
+        preload->refresh = refresh;
+        AST_LIST_INSERT_TAIL(&preloads, preload, list);
+    }
+    if (!AST_LIST_EMPTY(&preloads)
+    && ast_pthread_create_background(&preloader, NULL, preloader_run, NULL)) {
+        ast_log(LOG_ERROR, "unable to start preloading\n");
+        preloader = AST_PTHREADT_NULL;
+    }
+    ast_mutex_unlock(&preloads_lock);
+}
 
-    bson_destroy(&reply);
-    bson_destroy(&array);
-    if (updates)
-        bson_destroy(updates);
-    if (opts)
-        bson_destroy(opts);
-    if (cmd)
-        bson_destroy(cmd);
-    return ret;
+static char *handle_cli_show_preload(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    struct preload *preload;
+    time_t now = time(NULL);
+
+    switch (cmd) {
+    case CLI_INIT:
+        e->command = "mongodb show realtime preload";
+        e->usage =
+            "Usage: mongodb show realtime preload\n"
+            "       Shows the number of lookups served by snapshots of preloaded tables\n"
+            "       and sent to MongoDB instead, then records of each snapshot,\n"
+            "       seconds since loaded and seconds to refresh.\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+    if (a->argc != 4)
+        return CLI_SHOWUSAGE;
+
+    ast_cli(a->fd, "%lu hits, %lu misses\n", (unsigned long)preload_hits, (unsigned long)preload_misses);
+    ast_cli(a->fd, "%-32s %10s %10s %10s\n", "table", "records", "age", "refresh");
+    ast_mutex_lock(&preloads_lock);
+    AST_LIST_TRAVERSE(&preloads, preload, list) {
+        char table[64];
+
+        snprintf(table, sizeof(table), "%s.%s", preload->database, preload->table);
+        if (preload->snapshot)
+            ast_cli(a->fd, "%-32s %10zu %10ld %10u\n", table, preload->snapshot->count,
+                (long)(now - preload->loaded), preload->refresh);
+        else
+            ast_cli(a->fd, "%-32s %10s %10s %10u\n", table, "loading", "-", preload->refresh);
+    }
+    ast_mutex_unlock(&preloads_lock);
+    return CLI_SUCCESS;
 }
 
+static struct ast_cli_entry cli_realtime[] = {
+    AST_CLI_DEFINE(handle_cli_show_cache, "Show the cache of realtime lookups"),
+    AST_CLI_DEFINE(handle_cli_show_shapes, "Show shapes of realtime queries"),
+    AST_CLI_DEFINE(handle_cli_index_shapes, "Create indexes for shapes of realtime queries"),
+    AST_CLI_DEFINE(handle_cli_show_preload, "Show snapshots of preloaded tables"),
+};
+
 /*!
- * \brief Execute an SQL query and return ast_variable list
- * \param database  is name of database
- * \param table     is name of collection to find specified records
- * \param ap list containing one or more field/operator/value set.
- *
- * Select database and perform query on table, prepare the sql statement
- * Sub-in the values to the prepared statement and execute it. Return results
- * as a ast_variable list.
- *
+ * \brief find the first document matching fields.
+ * \param[out] completed  is set true if the query has completed, even if nothing matched.
  * \retval var on success
- * \retval NULL on failure
- *
- * \see http://api.mongodb.org/c/current/finding-document.html
-*/
-static struct ast_variable *realtime(const char *database, const char *table, const struct ast_variable *fields)
+ * \retval NULL if nothing matched or on failure
+ */
+static struct ast_variable *find_one(const char *database, const char *table, const struct ast_variable *fields, bool *completed)
 {
     struct ast_variable *var = NULL;
     mongoc_client_t *dbclient;
@@ -656,12 +3352,11 @@ static struct ast_variable *realtime(const char *database, const char *table, co
     mongoc_cursor_t *cursor = NULL;
     const bson_t *doc = NULL;
     bson_t *query = NULL;
+    bson_t *opts = NULL;
+    bson_t *projection = NULL;
 
-    if (!database || !table || !fields) {
-        ast_log(LOG_ERROR, "not enough arguments\n");
-        return NULL;
-    }
     ast_log(LOG_DEBUG, "database=%s, table=%s.\n", database, table);
+    shape_record(database, table, fields, NULL);
 
     if(dbpool == NULL) {
         ast_log(LOG_ERROR, "no connection pool\n");
@@ -675,76 +3370,108 @@ static struct ast_variable *realtime(const char *database, const char *table, co
     }
 
     do {
-        query = make_query(fields, NULL);
+        bson_error_t error;
+
+        query = make_query(table, fields);
         if(query == NULL) {
             ast_log(LOG_ERROR, "cannot make a query to find\n");
             break;
         }
         LOG_BSON_AS_JSON(LOG_DEBUG, "query=%s, database=%s, table=%s\n", query, database, table);
 
-        collection = mongoc_client_get_collection(dbclient, database, table);
-        cursor = mongoc_collection_find(collection, MONGOC_QUERY_NONE, 0, 1, 0, query, NULL, NULL);
+        collection = ast_mongo_collection_get(dbpool, dbclient, database, table);
+        if (!collection)
+            break;
+        opts = BCON_NEW("limit", BCON_INT64(1), "singleBatch", BCON_BOOL(true));
+        if ((projection = model_projection(table, NULL)))
+            BSON_APPEND_DOCUMENT(opts, "projection", projection);
+        cursor = mongoc_collection_find_with_opts(collection, query, opts, NULL);
         if (!cursor) {
             LOG_BSON_AS_JSON(LOG_ERROR, "query failed with query=%s, database=%s, table=%s\n", query, database, table);
             break;
         }
         if (mongoc_cursor_next(cursor, &doc)) {
-            bson_iter_t iter;
-            const char* key;
-            const char* value;
-            char work[128];
-            struct ast_variable *prev = NULL;
-
             LOG_BSON_AS_JSON(LOG_DEBUG, "query found %s\n", doc);
-
-            if (!bson_iter_init(&iter, doc)) {
-                ast_log(LOG_ERROR, "unexpected bson error!\n");
-                break;
-            }
-            while (bson_iter_next(&iter)) {
-                if (!doc2value(&iter, &key, work, sizeof(work)))
-                    continue;
-                value = work;
-                if (prev) {
-                    prev->next = ast_variable_new(key, value, "");
-                    if (prev->next)
-                        prev = prev->next;
-                }
-                else
-                    prev = var = ast_variable_new(key, value, "");
-            }
+            var = doc2variables(doc);
         }
+        if (mongoc_cursor_error(cursor, &error)) {
+            ast_log(LOG_ERROR, "query failed, database=%s, table=%s, error=%s\n", database, table, error.message);
+            break;
+        }
+        *completed = true;
     } while(0);
 
     if (doc)
         bson_destroy((bson_t *)doc);
     if (query)
         bson_destroy((bson_t *)query);
+    if (opts)
+        bson_destroy(opts);
+    if (projection)
+        bson_destroy(projection);
     if (cursor)
         mongoc_cursor_destroy(cursor);
-    if (collection)
-        mongoc_collection_destroy(collection);
-    mongoc_client_pool_push(dbpool, dbclient);
+    ast_mongo_client_push(dbpool, dbclient);
     return var;
 }
 
 /*!
- * \brief Execute an Select query and return ast_config list
+ * \brief Execute an SQL query and return ast_variable list
  * \param database  is name of database
  * \param table     is name of collection to find specified records
- * \param fields    is a list containing one or more field/operator/value set.
+ * \param ap list containing one or more field/operator/value set.
  *
- * Select database and preform query on table, prepare the sql statement
- * Sub-in the values to the prepared statement and execute it.
- * Execute this prepared query against MongoDB.
- * Return results as an ast_config variable.
+ * Select database and perform query on table, prepare the sql statement
+ * Sub-in the values to the prepared statement and execute it. Return results
+ * as a ast_variable list.
  *
  * \retval var on success
  * \retval NULL on failure
  *
  * \see http://api.mongodb.org/c/current/finding-document.html
 */
-static struct ast_config* realtime_multi(const char *database, const char *table, const struct ast_variable *fields)
+static struct ast_variable *realtime(const char *database, const char *table, const struct ast_variable *fields)
+{
+    struct ast_variable *var = NULL;
+    struct flight *flight = NULL;
+    const char *key;
+    unsigned generation = 0;
+    bool completed = false;
+    bool pilot = true;
+
+    if (!database || !table || !fields) {
+        ast_log(LOG_ERROR, "not enough arguments\n");
+        return NULL;
+    }
+
+    if (preload_find(database, table, fields, &var, NULL))
+        return var;
+    key = cache_key("realtime", database, table, fields);
+    if (key) {
+        if (cache_get(key, table, &var, NULL))
+            return var;
+        flight = flight_board(key, &pilot);
+        if (!pilot) {
+            flight_leave(flight, &var, NULL);
+            return var;
+        }
+        generation = cache_generation(database, table);
+    }
+
+    var = find_one(database, table, fields, &completed);
+    if (key && completed)
+        cache_put(key, database, table, generation, var, NULL);
+    flight_land(flight, var, NULL);
+    return var;
+}
+
+/*!
+ * \brief find all documents matching fields, ordered by the first one.
+ * \param[out] completed  is set true if the query has completed, even if nothing matched.
+ * \retval cfg on success
+ * \retval NULL on failure
+ */
+static struct ast_config* find_all(const char *database, const char *table, const struct ast_variable *fields, bool *completed)
 {
     struct ast_config *cfg = NULL;
     struct ast_category *cat = NULL;
@@ -754,13 +3481,11 @@ static struct ast_config* realtime_multi(const char *database, const char *table
     mongoc_client_t* dbclient = NULL;
     const bson_t* doc = NULL;
     const bson_t* query = NULL;
+    bson_t *opts = NULL;
+    bson_t *projection = NULL;
     const char *initfield;
     char *op;
 
-    if (!database || !table || !fields) {
-        ast_log(LOG_ERROR, "not enough arguments\n");
-        return NULL;
-    }
     ast_log(LOG_DEBUG, "database=%s, table=%s.\n", database, table);
 
     if(dbpool == NULL) {
@@ -777,8 +3502,11 @@ static struct ast_config* realtime_multi(const char *database, const char *table
     if ((op = strchr(initfield, ' '))) {
         *op = '\0';
     }
+    shape_record(database, table, fields, initfield);
     do {
-        query = make_query(fields, initfield);
+        bson_error_t error;
+
+        query = make_query(table, fields);
         if(query == NULL) {
             ast_log(LOG_ERROR, "cannot make a query to find\n");
             break;
@@ -790,54 +3518,110 @@ static struct ast_config* realtime_multi(const char *database, const char *table
             break;
         }
 
-        collection = mongoc_client_get_collection(dbclient, database, table);
+        collection = ast_mongo_collection_get(dbpool, dbclient, database, table);
+        if (!collection)
+            break;
 
         LOG_BSON_AS_JSON(LOG_DEBUG, "query=%s, database=%s, table=%s\n", query, database, table);
 
-        cursor = mongoc_collection_find(collection, MONGOC_QUERY_NONE, 0, 0, 0, query, NULL, NULL);
+        opts = BCON_NEW("sort", "{", key_asterisk2mongo(initfield), BCON_DOUBLE(1), "}");
+        if ((projection = model_projection(table, initfield)))
+            BSON_APPEND_DOCUMENT(opts, "projection", projection);
+        cursor = mongoc_collection_find_with_opts(collection, query, opts, NULL);
         if (!cursor) {
             LOG_BSON_AS_JSON(LOG_ERROR, "query failed with query=%s, database=%s, table=%s\n", query, database, table);
             break;
         }
 
         while (mongoc_cursor_next(cursor, &doc)) {
-            bson_iter_t iter;
-            const char* key;
-            const char* value;
-            char work[128];
+            const struct ast_variable *field;
 
             LOG_BSON_AS_JSON(LOG_DEBUG, "query found %s\n", doc);
 
-            if (!bson_iter_init(&iter, doc)) {
-                ast_log(LOG_ERROR, "unexpected bson error!\n");
-                break;
-            }
             cat = ast_category_new("", "", 99999);
             if (!cat) {
                 ast_log(LOG_WARNING, "out of memory!\n");
                 break;
             }
-            while (bson_iter_next(&iter)) {
-                if (!doc2value(&iter, &key, work, sizeof(work)))
-                    continue;
-                value = work;
-                if (!strcmp(initfield, key))
-                    ast_category_rename(cat, value);
-                var = ast_variable_new(key, value, "");
-                ast_variable_append(cat, var);
+            var = doc2variables(doc);
+            for (field = var; field; field = field->next) {
+                if (!strcmp(initfield, field->name)) {
+                    ast_category_rename(cat, field->value);
+                    break;
+                }
             }
+            ast_variable_append(cat, var);
             ast_category_append(cfg, cat);
         }
+        if (mongoc_cursor_error(cursor, &error)) {
+            ast_log(LOG_ERROR, "query failed, database=%s, table=%s, error=%s\n", database, table, error.message);
+            break;
+        }
+        *completed = true;
     } while(0);
     ast_log(LOG_DEBUG, "end of query.\n");
 
     if (query)
         bson_destroy((bson_t *)query);
+    if (opts)
+        bson_destroy(opts);
+    if (projection)
+        bson_destroy(projection);
     if (cursor)
         mongoc_cursor_destroy(cursor);
-    if (collection)
-        mongoc_collection_destroy(collection);
-    mongoc_client_pool_push(dbpool, dbclient);
+    ast_mongo_client_push(dbpool, dbclient);
+    return cfg;
+}
+
+/*!
+ * \brief Execute an Select query and return ast_config list
+ * \param database  is name of database
+ * \param table     is name of collection to find specified records
+ * \param fields    is a list containing one or more field/operator/value set.
+ *
+ * Select database and preform query on table, prepare the sql statement
+ * Sub-in the values to the prepared statement and execute it.
+ * Execute this prepared query against MongoDB.
+ * Return results as an ast_config variable.
+ *
+ * \retval var on success
+ * \retval NULL on failure
+ *
+ * \see http://api.mongodb.org/c/current/finding-document.html
+*/
+static struct ast_config* realtime_multi(const char *database, const char *table, const struct ast_variable *fields)
+{
+    struct ast_config *cfg = NULL;
+    struct flight *flight = NULL;
+    const char *key;
+    unsigned generation = 0;
+    bool completed = false;
+    bool pilot = true;
+
+    if (!database || !table || !fields) {
+        ast_log(LOG_ERROR, "not enough arguments\n");
+        return NULL;
+    }
+
+    if (preload_find(database, table, fields, NULL, &cfg))
+        return cfg;
+    key = cache_key("multi", database, table, fields);
+    if (key) {
+        if (cache_get(key, table, NULL, &cfg))
+            return cfg;
+        flight = flight_board(key, &pilot);
+        if (!pilot) {
+            flight_leave(flight, NULL, &cfg);
+            return cfg;
+        }
+        generation = cache_generation(database, table);
+    }
+
+    cfg = find_all(database, table, fields, &completed);
+    if (key && completed && cfg)
+        cache_put(key, database, table, generation, NULL,
+            ast_category_browse_filtered(cfg, NULL, NULL, NULL) ? cfg : NULL);
+    flight_land(flight, NULL, cfg);
     return cfg;
 }
 
@@ -862,6 +3646,7 @@ static int update(const char *database, const char *table, const char *keyfield,
     bson_t *query = NULL;
     bson_t *data = NULL;
     bson_t *update = NULL;
+    struct model *model = NULL;
     mongoc_client_t *dbclient = NULL;
     mongoc_collection_t *collection = NULL;
 
@@ -887,7 +3672,8 @@ static int update(const char *database, const char *table, const char *keyfield,
             ast_log(LOG_ERROR, "not enough memory\n");
             break;
         }
-        if (!BSON_APPEND_UTF8(query, key_asterisk2mongo(keyfield), lookup)) {
+        model = model_get(table);
+        if (!filter_append(query, model, key_asterisk2mongo(keyfield), lookup)) {
             ast_log(LOG_ERROR, "cannot make a query\n");
             break;
         }
@@ -913,7 +3699,9 @@ static int update(const char *database, const char *table, const char *keyfield,
             break;
         }
 
-        collection = mongoc_client_get_collection(dbclient, database, table);
+        collection = ast_mongo_collection_get(dbpool, dbclient, database, table);
+        if (!collection)
+            break;
         ret = _collection_update(collection, query, update);
     } while(0);
 
@@ -923,10 +3711,10 @@ static int update(const char *database, const char *table, const char *keyfield,
         bson_destroy((bson_t *)update);
     if (query)
         bson_destroy((bson_t *)query);
-    if (collection)
-        mongoc_collection_destroy(collection);
+    ao2_cleanup(model);
 
-    mongoc_client_pool_push(dbpool, dbclient);
+    ast_mongo_client_push(dbpool, dbclient);
+    cache_purge(database, table);
     return ret;
 }
 
@@ -1032,7 +3820,9 @@ static int update2(const char *database, const char *table, const struct ast_var
             break;
         }
 
-        collection = mongoc_client_get_collection(dbclient, database, table);
+        collection = ast_mongo_collection_get(dbpool, dbclient, database, table);
+        if (!collection)
+            break;
         ret = _collection_update(collection, query, update);
 
     } while(0);
@@ -1043,10 +3833,9 @@ static int update2(const char *database, const char *table, const struct ast_var
         bson_destroy((bson_t *)update);
     if (query)
         bson_destroy((bson_t *)query);
-    if (collection)
-        mongoc_collection_destroy(collection);
 
-    mongoc_client_pool_push(dbpool, dbclient);
+    ast_mongo_client_push(dbpool, dbclient);
+    cache_purge(database, table);
     return ret;
 }
 
@@ -1069,6 +3858,7 @@ static int store(const char *database, const char *table, const struct ast_varia
     bson_t *document = NULL;
     mongoc_client_t *dbclient = NULL;
     mongoc_collection_t *collection = NULL;
+    mongoc_write_concern_t *write_concern = NULL;
 
     if (!database || !table || !fields) {
         ast_log(LOG_ERROR, "not enough arguments\n");
@@ -1095,8 +3885,11 @@ static int store(const char *database, const char *table, const struct ast_varia
             break;
         }
 
-        collection = mongoc_client_get_collection(dbclient, database, table);
+        collection = ast_mongo_collection_get(dbpool, dbclient, database, table);
+        if (!collection)
+            break;
 
+        write_concern = write_concern_copy();
         if (!fields2doc(table, fields, document)) {
             ast_log(LOG_ERROR, "cannot make a document to update\n");
             break;
@@ -1104,20 +3897,23 @@ static int store(const char *database, const char *table, const struct ast_varia
 
         LOG_BSON_AS_JSON(LOG_DEBUG, "document=%s\n", document);
 
-        if (!mongoc_collection_insert(collection, MONGOC_INSERT_NONE, document, NULL, &error)) {
+        if (!mongoc_collection_insert(collection, MONGOC_INSERT_NONE, document, write_concern, &error)) {
+            ast_mongo_writer_count(&stats, write_concern, 0, 1);
             ast_log(LOG_ERROR, "store failed, error=%s\n", error.message);
             LOG_BSON_AS_JSON(LOG_ERROR, "document=%s\n", document);
             break;
         }
+        ast_mongo_writer_count(&stats, write_concern, 1, 1);
 
         ret = 1; // success
     } while(0);
 
     if (document)
         bson_destroy((bson_t *)document);
-    if (collection)
-        mongoc_collection_destroy(collection);
-    mongoc_client_pool_push(dbpool, dbclient);
+    if (write_concern)
+        mongoc_write_concern_destroy(write_concern);
+    ast_mongo_client_push(dbpool, dbclient);
+    cache_purge(database, table);
     return ret;
 }
 
@@ -1140,8 +3936,10 @@ static int destroy(const char *database, const char *table, const char *keyfield
 {
     int ret = -1;
     bson_t *selector = NULL;
+    struct model *model = NULL;
     mongoc_client_t *dbclient = NULL;
     mongoc_collection_t *collection = NULL;
+    mongoc_write_concern_t *write_concern = NULL;
 
     if (!database || !table || !keyfield || !lookup) {
         ast_log(LOG_ERROR, "not enough arguments\n");
@@ -1168,26 +3966,34 @@ static int destroy(const char *database, const char *table, const char *keyfield
             ast_log(LOG_ERROR, "not enough memory\n");
             break;
         }
-        if (!BSON_APPEND_UTF8(selector, key_asterisk2mongo(keyfield), lookup)) {
+        model = model_get(table);
+        if (!filter_append(selector, model, key_asterisk2mongo(keyfield), lookup)) {
             ast_log(LOG_ERROR, "cannot make a query\n");
             break;
         }
 
-        collection = mongoc_client_get_collection(dbclient, database, table);
+        collection = ast_mongo_collection_get(dbpool, dbclient, database, table);
+        if (!collection)
+            break;
 
-        if (!mongoc_collection_remove(collection, MONGOC_REMOVE_SINGLE_REMOVE, selector, NULL, &error)) {
+        write_concern = write_concern_copy();
+        if (!mongoc_collection_remove(collection, MONGOC_REMOVE_SINGLE_REMOVE, selector, write_concern, &error)) {
+             ast_mongo_writer_count(&stats, write_concern, 0, 1);
              ast_log(LOG_ERROR, "destroy failed, error=%s\n", error.message);
              break;
         }
+        ast_mongo_writer_count(&stats, write_concern, 1, 1);
 
         ret = 1; // success
     } while(0);
 
     if (selector)
         bson_destroy((bson_t *)selector);
-    if (collection)
-        mongoc_collection_destroy(collection);
-    mongoc_client_pool_push(dbpool, dbclient);
+    if (write_concern)
+        mongoc_write_concern_destroy(write_concern);
+    ao2_cleanup(model);
+    ast_mongo_client_push(dbpool, dbclient);
+    cache_purge(database, table);
     return ret;
 }
 
@@ -1203,7 +4009,7 @@ static struct ast_config *load(
     bson_t *query = NULL;
     const bson_t *doc = NULL;
     const bson_t *order = NULL;
-    const bson_t *root = NULL;
+    const bson_t *opts = NULL;
     const bson_t *fields = NULL;
     const char *last_category = "";
     int last_cat_metric = -1;
@@ -1239,21 +4045,23 @@ static struct ast_config *load(
                             "var_metric", BCON_DOUBLE(1),
                             "category", BCON_DOUBLE(1),
                             "var_name", BCON_DOUBLE(1));
-        root = BCON_NEW(    "$query", BCON_DOCUMENT(query),
-                            "$orderby", BCON_DOCUMENT(order));
         fields = BCON_NEW(  "cat_metric", BCON_DOUBLE(1),
                             "category", BCON_DOUBLE(1),
                             "var_name", BCON_DOUBLE(1),
                             "var_val", BCON_DOUBLE(1));
+        opts = BCON_NEW(    "sort", BCON_DOCUMENT(order),
+                            "projection", BCON_DOCUMENT(fields));
 
-        LOG_BSON_AS_JSON(LOG_DEBUG, "query=%s\n", root);
-        // LOG_BSON_AS_JSON(LOG_DEBUG, "fields=%s\n", fields);
+        LOG_BSON_AS_JSON(LOG_DEBUG, "query=%s\n", query);
+        // LOG_BSON_AS_JSON(LOG_DEBUG, "opts=%s\n", opts);
 
-        collection = mongoc_client_get_collection(dbclient, database, table);
-        cursor = mongoc_collection_find(collection, MONGOC_QUERY_NONE, 0, 0, 0, root, fields, NULL);
+        collection = ast_mongo_collection_get(dbpool, dbclient, database, table);
+        if (!collection)
+            break;
+        cursor = mongoc_collection_find_with_opts(collection, query, opts, NULL);
         if (!cursor) {
-            LOG_BSON_AS_JSON(LOG_ERROR, "query failed with query=%s\n", root);
-            LOG_BSON_AS_JSON(LOG_ERROR, "query failed with fields=%s\n", fields);
+            LOG_BSON_AS_JSON(LOG_ERROR, "query failed with query=%s\n", query);
+            LOG_BSON_AS_JSON(LOG_ERROR, "query failed with opts=%s\n", opts);
             break;
         }
 
@@ -1343,27 +4151,23 @@ static struct ast_config *load(
         bson_destroy((bson_t *)query);
     if (order)
         bson_destroy((bson_t *)order);
-    if (root)
-        bson_destroy((bson_t *)root);
+    if (opts)
+        bson_destroy((bson_t *)opts);
     if (cursor)
         mongoc_cursor_destroy(cursor);
-    if (collection)
-        mongoc_collection_destroy(collection);
-    mongoc_client_pool_push(dbpool, dbclient);
+    ast_mongo_client_push(dbpool, dbclient);
     return cfg;
 }
 
 /*!
  * \brief Callback for clearing any cached info
- * \note We don't currently cache anything
  * \retval 0 If any cache was purged
  * \retval -1 If no cache was found
  */
 static int unload(const char *a, const char *b)
 {
     ast_log(LOG_DEBUG, "database=%s, table=%s\n", a, b);
-    /* We currently do no caching */
-    return -1;
+    return cache_purge(a, b) ? 0 : -1;
 }
 
 
@@ -1371,7 +4175,6 @@ static int config(int reload)
 {
     int res = -1;
     struct ast_config *cfg = NULL;
-    mongoc_uri_t *uri = NULL;
     ast_log(LOG_DEBUG, "reload=%d\n", reload);
 
     do {
@@ -1397,31 +4200,21 @@ static int config(int reload)
             ast_log(LOG_WARNING, "no uri specified.\n");
             break;
         }
-        uri = mongoc_uri_new(tmp);
-        if (uri == NULL) {
-            ast_log(LOG_ERROR, "parsing uri error, %s\n", tmp);
-            break;
-        }
-
-        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "apm"))
-        && (sscanf(tmp, "%u", &apm_enabled) != 1)) {
-           ast_log(LOG_WARNING, "apm must be a 0|1, not '%s'\n", tmp);
-           apm_enabled = 0;
+        // the preloader, watchers and the advisor use clients of the current pool
+        preloads_shutdown();
+        watchers_shutdown();
+        advisor_join();
+        {
+            // acquire the new one first to keep sharing the same pool
+            mongoc_client_pool_t *pool = ast_mongo_pool_acquire(tmp, cfg);
+            ast_mongo_pool_release(dbpool);
+            dbpool = pool;
         }
-        if (apm_context)
-            ast_mongo_apm_stop(apm_context);
-
-        if (dbpool)
-            mongoc_client_pool_destroy(dbpool);
-        dbpool = mongoc_client_pool_new(uri);
         if (dbpool == NULL) {
             ast_log(LOG_ERROR, "cannot make a connection pool for MongoDB\n");
             break;
         }
 
-        if (apm_enabled)
-            apm_context = ast_mongo_apm_start(dbpool);
-
         if ((tmp = ast_variable_retrieve(cfg, CATEGORY, SERVERID)) != NULL) {
             if (!bson_oid_is_valid (tmp, strlen(tmp))) {
                 ast_log(LOG_ERROR, "invalid server id specified.\n");
@@ -1435,17 +4228,35 @@ static int config(int reload)
             bson_oid_init_from_string(serverid, tmp);
         }
 
+        {
+            // writers copy it under the lock, so the old one is destroyed apart
+            mongoc_write_concern_t *new_write_concern = ast_mongo_write_concern_new(cfg, CATEGORY);
+            ast_mutex_lock(&write_concern_lock);
+            SWAP(configured_write_concern, new_write_concern);
+            ast_mutex_unlock(&write_concern_lock);
+            if (new_write_concern)
+                mongoc_write_concern_destroy(new_write_concern);
+        }
+        model_configure(cfg);
+        cache_configure(cfg);
+        preloads_configure(cfg);
+
+        if ((tmp = ast_variable_retrieve(cfg, CATEGORY, "index_advisor"))) {
+            if (!strcasecmp(tmp, "create"))
+                advisor_start(true);
+            else if (!strcasecmp(tmp, "report"))
+                advisor_start(false);
+            else if (strcasecmp(tmp, "no"))
+                ast_log(LOG_WARNING, "index_advisor must be create, report or no, not '%s'\n", tmp);
+        }
+
         res = 0; // success
     } while (0);
 
-    if (uri)
-       mongoc_uri_destroy(uri);
     if (cfg && cfg != CONFIG_STATUS_FILEUNCHANGED && cfg != CONFIG_STATUS_FILEINVALID) {
         ast_config_destroy(cfg);
     }
 
-    models = bson_new();
-
     return res;
 }
 
@@ -1464,22 +4275,80 @@ static struct ast_config_engine mongodb_engine = {
 
 static int unload_module(void)
 {
+    struct cache_ttl *ttl;
+    struct cache_generation *generation;
+
+    ast_cli_unregister_multiple(cli_realtime, ARRAY_LEN(cli_realtime));
     ast_config_engine_deregister(&mongodb_engine);
-    if (models)
-        bson_destroy(models);
-    if (apm_context)
-        ast_mongo_apm_stop(apm_context);
-    if (dbpool)
-        mongoc_client_pool_destroy(dbpool);
+    preloads_shutdown();
+    watchers_shutdown();
+    advisor_join();
+    ast_cond_destroy(&watchers_cond);
+    ast_cond_destroy(&flights_cond);
+    ast_cond_destroy(&preloads_cond);
+    cache_purge(NULL, NULL);
+    ao2_cleanup(shapes);
+    shapes = NULL;
+    ao2_cleanup(query_plans);
+    query_plans = NULL;
+    ast_mutex_lock(&cache_lock);
+    ao2_cleanup(cache);
+    cache = NULL;
+    while ((ttl = AST_LIST_REMOVE_HEAD(&cache_ttls, list)))
+        ast_free(ttl);
+    while ((generation = AST_LIST_REMOVE_HEAD(&cache_generations, list)))
+        ast_free(generation);
+    ast_mutex_unlock(&cache_lock);
+    ao2_global_obj_release(model_registry);
+    ast_mongo_pool_release(dbpool);
+    if (configured_write_concern)
+        mongoc_write_concern_destroy(configured_write_concern);
+    ast_mongo_writer_unregister(&stats);
     ast_log(LOG_DEBUG, "unloaded.\n");
     return 0;
 }
 
 static int load_module(void)
 {
-    if (config(0))
+    cache = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0,
+        CACHE_BUCKETS, cache_entry_hash, NULL, cache_entry_cmp);
+    if (!cache)
         return AST_MODULE_LOAD_DECLINE;
+    query_plans = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0,
+        QUERY_PLANS, query_plan_hash, NULL, query_plan_cmp);
+    shapes = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0,
+        SHAPE_BUCKETS, shape_hash, NULL, shape_cmp);
+    if (!query_plans || !shapes) {
+        ao2_cleanup(shapes);
+        shapes = NULL;
+        ao2_cleanup(query_plans);
+        query_plans = NULL;
+        ao2_cleanup(cache);
+        cache = NULL;
+        return AST_MODULE_LOAD_DECLINE;
+    }
+    ast_cond_init(&watchers_cond, NULL);
+    ast_cond_init(&flights_cond, NULL);
+    ast_cond_init(&preloads_cond, NULL);
+    shapes_load();
+    if (config(0)) {
+        preloads_shutdown();
+        watchers_shutdown();
+        advisor_join();
+        ast_cond_destroy(&watchers_cond);
+        ast_cond_destroy(&flights_cond);
+        ast_cond_destroy(&preloads_cond);
+        ao2_cleanup(shapes);
+        shapes = NULL;
+        ao2_cleanup(query_plans);
+        query_plans = NULL;
+        ao2_cleanup(cache);
+        cache = NULL;
+        return AST_MODULE_LOAD_DECLINE;
+    }
     ast_config_engine_register(&mongodb_engine);
+    ast_mongo_writer_register(&stats);
+    ast_cli_register_multiple(cli_realtime, ARRAY_LEN(cli_realtime));
     return 0;
 }
 
@@ -29,9 +29,14 @@
 ASTERISK_REGISTER_FILE()
 #endif
 
+#include <sys/mman.h>
+
 #include "asterisk/module.h"
 #include "asterisk/res_mongodb.h"
 #include "asterisk/config.h"
+#include "asterisk/linkedlists.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/cli.h"
 
 /*** DOCUMENTATION
     <function name="MongoDB" language="en_US">
@@ -41,17 +46,41 @@ ASTERISK_REGISTER_FILE()
         <description>
             This is the ast_mongo common resource which provides;
             1. functions to init and clean up mongoDB C Driver,
-            2. handlers for Application Performance Monitoring (APM).
+            2. handlers for Application Performance Monitoring (APM),
+            3. connection pools shared among the ast_mongo plugins,
+            4. local spool files to keep records while MongoDB is unreachable,
+            5. collection handles cached for each pooled client,
+            6. write concerns and statistics of the writer plugins,
+            7. background creation of indexes on time-bucketed collections,
+            8. field plans, queues and recycled documents of the writer plugins.
         </description>
     </function>
  ***/
 
 static const char CATEGORY[] = "common";
 static const char CONFIG_FILE[] = "ast_mongo.conf";
+static const char SPOOL_MAGIC[8] = "AMSPOOL1";
+
+enum {
+    SPOOL_DATA_OFFSET = 64,         // records start after the header
+    SPOOL_BATCH = 100,              // max number of records per replay
+    SPOOL_RETRY_INTERVAL = 1000,    // msec
+    CLIENT_CACHE_BUCKETS = 61,      // hash buckets of client_caches
+    CLIENT_CACHE_HANDLES = 16,      // max collection handles cached per client
+    INDEXER_NAME_SIZE = 128,        // max length of collection names
+    INDEXER_DONE = 32,              // number of provisioned collections remembered
+    INDEXER_INTERVAL = 600000,      // msec, to look ahead for upcoming collections
+    INDEXER_LOOKAHEAD = 86400,      // sec, to provision collections ahead of time
+    INDEXER_STEP = 3600,            // sec, granularity of looking ahead
+    INDEXER_RETRY = 60,             // sec, before retrying after failure
+};
 
 typedef struct {
     mongoc_apm_callbacks_t *callbacks;
 
+    // 0 while SDAM reports no writable server
+    int writable;
+
     unsigned started;
     unsigned succeeded;
     unsigned failed;
@@ -67,6 +96,96 @@ typedef struct {
     unsigned heartbeat_failed_events;
 } apm_context_t;
 
+/*!
+ * \brief header of a spool file, followed by records in native BSON.
+ */
+struct spool_header {
+    char magic[8];
+    uint64_t head;      // offset of the oldest record
+    uint64_t tail;      // offset to append the next record
+};
+
+/*!
+ * \brief a connection pool shared by the plugins connecting to the same uri.
+ */
+struct pool_entry {
+    char *uri;
+    mongoc_client_pool_t *pool;
+    void *apm_context;
+    int apm;            // wanted by any section connecting to uri, when made
+    unsigned refs;
+    int transient;      // minPoolSize is set, for which pushing a client may destroy it
+    AST_LIST_ENTRY(pool_entry) list;
+};
+
+AST_MUTEX_DEFINE_STATIC(pools_lock);
+static AST_LIST_HEAD_NOLOCK_STATIC(pools, pool_entry);
+
+/*!
+ * \brief a collection handle cached for a pooled client.
+ */
+struct collection_entry {
+    char *database;
+    char *name;
+    mongoc_collection_t *collection;
+    AST_LIST_ENTRY(collection_entry) list;
+};
+
+/*!
+ * \brief collection handles of a pooled client, keyed by (database, collection).
+ * Only the thread which popped the client touches them, so they need no lock.
+ * The most recently used comes first, and the least recently used ones are
+ * dropped beyond CLIENT_CACHE_HANDLES, e.g. of past time buckets.
+ */
+struct client_cache {
+    mongoc_client_t *client;
+    mongoc_client_pool_t *pool;
+    int transient;      // to be dropped when the client is pushed back
+    unsigned count;
+    AST_LIST_HEAD_NOLOCK(, collection_entry) collections;
+};
+
+// client_cache objects hashed by client
+static struct ao2_container *client_caches;
+
+// statistics of the writer plugins
+AST_MUTEX_DEFINE_STATIC(writers_lock);
+static AST_LIST_HEAD_NOLOCK_STATIC(writers, ast_mongo_writer_stats);
+
+struct ast_mongo_spool {
+    ast_mutex_t lock;
+    char *path;
+    int fd;
+    uint8_t *map;
+    size_t size;
+    struct spool_header *header;
+    int replaying;
+    mongoc_client_pool_t *pool;
+    ast_mongo_spool_flush_fn flush;
+    void *data;
+    pthread_t thread;
+    int stop;
+};
+
+struct ast_mongo_indexer {
+    ast_mutex_t lock;
+    ast_cond_t cond;
+    mongoc_client_pool_t *pool;
+    char *database;
+    char *template;
+    bson_t *indexes;
+    char done[INDEXER_DONE][INDEXER_NAME_SIZE];   // recently provisioned
+    unsigned done_next;
+    char pending[INDEXER_NAME_SIZE];    // notified by the writer
+    time_t retry_after;
+    pthread_t thread;
+    int stop;
+};
+
+// to wake up replayers of spools
+AST_MUTEX_DEFINE_STATIC(spool_lock);
+static ast_cond_t spool_cond;
+
 // 0 = disable monitoring, 0 != enable monitoring
 static unsigned apm_command_monitoring = 0;
 static unsigned apm_sdam_monitoring = 0;
@@ -200,8 +319,19 @@ static void apm_server_closed(const mongoc_apm_server_closed_t *event)
 static void apm_topology_changed(const mongoc_apm_topology_changed_t *event)
 {
     apm_context_t* context = mongoc_apm_topology_changed_get_context(event);
+    int writable = mongoc_topology_description_has_writable_server(
+        (mongoc_topology_description_t *)mongoc_apm_topology_changed_get_new_description(event));
     context->topology_changed_events++;
 
+    if (writable && !context->writable) {
+        ast_mutex_lock(&spool_lock);
+        context->writable = writable;
+        ast_cond_broadcast(&spool_cond);
+        ast_mutex_unlock(&spool_lock);
+    }
+    else
+        context->writable = writable;
+
     if (apm_sdam_monitoring) {
         size_t n_prev_sds;
         size_t n_new_sds;
@@ -322,6 +452,7 @@ void* ast_mongo_apm_start(mongoc_client_pool_t* pool)
     }
 
     mongoc_client_pool_set_error_api(pool, 2);
+    context->writable = 1;  // assume writable until SDAM reports otherwise
     context->callbacks = mongoc_apm_callbacks_new();
 
     // for Command-Monitoring
@@ -357,6 +488,1272 @@ void ast_mongo_apm_stop(void* context)
     ast_free(context);
 }
 
+static int client_cache_hash(const void *obj, int flags)
+{
+    const mongoc_client_t *client = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY
+        ? obj : ((const struct client_cache *)obj)->client;
+    return (int)(((uintptr_t)client >> 4) & INT_MAX);
+}
+
+static int client_cache_cmp(void *obj, void *arg, int flags)
+{
+    const struct client_cache *cache = obj;
+    const mongoc_client_t *client = (flags & OBJ_SEARCH_MASK) == OBJ_SEARCH_KEY
+        ? arg : ((const struct client_cache *)arg)->client;
+    return cache->client == client ? CMP_MATCH | CMP_STOP : 0;
+}
+
+static int client_cache_match_pool(void *obj, void *arg, int flags)
+{
+    const struct client_cache *cache = obj;
+    return cache->pool == arg ? CMP_MATCH : 0;
+}
+
+static void collection_entry_destroy(struct collection_entry *entry)
+{
+    if (entry->collection)
+        mongoc_collection_destroy(entry->collection);
+    ast_free(entry->database);
+    ast_free(entry->name);
+    ast_free(entry);
+}
+
+static void client_cache_destructor(void *obj)
+{
+    struct client_cache *cache = obj;
+    struct collection_entry *entry;
+
+    while ((entry = AST_LIST_REMOVE_HEAD(&cache->collections, list)))
+        collection_entry_destroy(entry);
+}
+
+/*!
+ * \brief check if pushing a client back to the pool may destroy it.
+ */
+static int pool_is_transient(mongoc_client_pool_t* pool)
+{
+    struct pool_entry *entry;
+    int transient = 0;
+
+    ast_mutex_lock(&pools_lock);
+    AST_LIST_TRAVERSE(&pools, entry, list) {
+        if (entry->pool == pool) {
+            transient = entry->transient;
+            break;
+        }
+    }
+    ast_mutex_unlock(&pools_lock);
+    return transient;
+}
+
+mongoc_collection_t* ast_mongo_collection_get(mongoc_client_pool_t* pool,
+    mongoc_client_t* client, const char* database, const char* collection)
+{
+    struct client_cache *cache;
+    struct collection_entry *entry;
+    mongoc_collection_t *handle = NULL;
+
+    if (!client_caches)
+        return NULL;
+
+    cache = ao2_find(client_caches, client, OBJ_SEARCH_KEY);
+    if (!cache) {
+        cache = ao2_alloc_options(sizeof(*cache), client_cache_destructor,
+            AO2_ALLOC_OPT_LOCK_NOLOCK);
+        if (!cache) {
+            ast_log(LOG_ERROR, "not enough memory.\n");
+            return NULL;
+        }
+        cache->client = client;
+        cache->pool = pool;
+        cache->transient = pool_is_transient(pool);
+        AST_LIST_HEAD_INIT_NOLOCK(&cache->collections);
+        // nobody else can hold the same client meanwhile, so no race to link it
+        ao2_link(client_caches, cache);
+    }
+
+    do {
+        AST_LIST_TRAVERSE_SAFE_BEGIN(&cache->collections, entry, list) {
+            if (!strcmp(entry->name, collection) && !strcmp(entry->database, database)) {
+                AST_LIST_REMOVE_CURRENT(list);
+                break;
+            }
+        }
+        AST_LIST_TRAVERSE_SAFE_END;
+        if (entry) {
+            AST_LIST_INSERT_HEAD(&cache->collections, entry, list);
+            handle = entry->collection;
+            break;
+        }
+
+        entry = ast_calloc(1, sizeof(*entry));
+        if (!entry) {
+            ast_log(LOG_ERROR, "not enough memory.\n");
+            break;
+        }
+        entry->database = ast_strdup(database);
+        entry->name = ast_strdup(collection);
+        entry->collection = mongoc_client_get_collection(client, database, collection);
+        if (!entry->database || !entry->name || !entry->collection) {
+            ast_log(LOG_ERROR, "cannot get collection %s.%s\n", database, collection);
+            collection_entry_destroy(entry);
+            break;
+        }
+        AST_LIST_INSERT_HEAD(&cache->collections, entry, list);
+        handle = entry->collection;
+        // the caller uses the new handle, which comes first
+        if (++cache->count > CLIENT_CACHE_HANDLES) {
+            struct collection_entry *last = NULL;
+
+            AST_LIST_TRAVERSE(&cache->collections, entry, list)
+                last = entry;
+            AST_LIST_REMOVE(&cache->collections, last, list);
+            collection_entry_destroy(last);
+            cache->count--;
+        }
+    } while(0);
+
+    ao2_ref(cache, -1);
+    return handle;
+}
+
+void ast_mongo_client_push(mongoc_client_pool_t* pool, mongoc_client_t* client)
+{
+    struct client_cache *cache;
+
+    if (client_caches && (cache = ao2_find(client_caches, client, OBJ_SEARCH_KEY))) {
+        // the pool may destroy the client, and make another one at the same address
+        if (cache->transient)
+            ao2_unlink(client_caches, cache);
+        ao2_ref(cache, -1);
+    }
+    mongoc_client_pool_push(pool, client);
+}
+
+static void pool_entry_destroy(struct pool_entry *entry)
+{
+    // the cached handles must go away before their clients
+    if (entry->pool && client_caches)
+        ao2_callback(client_caches, OBJ_MULTIPLE | OBJ_UNLINK | OBJ_NODATA,
+            client_cache_match_pool, entry->pool);
+    if (entry->pool)
+        mongoc_client_pool_destroy(entry->pool);
+    if (entry->apm_context)
+        ast_mongo_apm_stop(entry->apm_context);
+    if (entry->uri)
+        ast_free(entry->uri);
+    ast_free(entry);
+}
+
+/*!
+ * \brief check if any section connecting to the uri enables APM,
+ * or spools, which relies on SDAM events to know when to replay.
+ */
+static int pool_apm_wanted(const char *uri, struct ast_config *cfg)
+{
+    const char *category = NULL;
+    int wanted = 0;
+
+    while (!wanted && (category = ast_category_browse(cfg, category))) {
+        const char *tmp = ast_variable_retrieve(cfg, category, "uri");
+        unsigned apm = 0;
+
+        if (!tmp || strcmp(tmp, uri))
+            continue;
+        if ((tmp = ast_variable_retrieve(cfg, category, "apm"))
+        && (sscanf(tmp, "%u", &apm) != 1)) {
+           ast_log(LOG_WARNING, "apm must be a 0|1, not '%s' in %s\n", tmp, category);
+           apm = 0;
+        }
+        tmp = ast_variable_retrieve(cfg, category, "spool");
+        wanted = apm || !ast_strlen_zero(tmp);
+    }
+    return wanted;
+}
+
+mongoc_client_pool_t* ast_mongo_pool_acquire(const char* uri, struct ast_config* cfg)
+{
+    struct pool_entry *entry;
+    mongoc_client_pool_t *pool = NULL;
+    mongoc_uri_t *mongoc_uri = NULL;
+    // APM is attached only to a new pool, so one with it is not shared with one without
+    int apm = pool_apm_wanted(uri, cfg);
+
+    ast_mutex_lock(&pools_lock);
+    do {
+        AST_LIST_TRAVERSE(&pools, entry, list) {
+            if (!strcmp(entry->uri, uri) && entry->apm == apm)
+                break;
+        }
+        if (entry) {
+            entry->refs++;
+            pool = entry->pool;
+            break;
+        }
+
+        mongoc_uri = mongoc_uri_new(uri);
+        if (mongoc_uri == NULL) {
+            ast_log(LOG_ERROR, "parsing uri error, %s\n", uri);
+            break;
+        }
+        entry = ast_calloc(1, sizeof(*entry));
+        if (entry == NULL) {
+            ast_log(LOG_ERROR, "not enough memory.\n");
+            break;
+        }
+        entry->uri = ast_strdup(uri);
+        entry->pool = mongoc_client_pool_new(mongoc_uri);
+        if (entry->uri == NULL || entry->pool == NULL) {
+            ast_log(LOG_ERROR, "cannot make a connection pool for MongoDB\n");
+            pool_entry_destroy(entry);
+            break;
+        }
+        // attached only once, before any client is popped
+        entry->apm = apm;
+        if (apm)
+            entry->apm_context = ast_mongo_apm_start(entry->pool);
+        entry->transient = mongoc_uri_get_option_as_int32(mongoc_uri, MONGOC_URI_MINPOOLSIZE, 0) > 0;
+        entry->refs = 1;
+        AST_LIST_INSERT_TAIL(&pools, entry, list);
+        pool = entry->pool;
+        ast_log(LOG_DEBUG, "new pool for %s%s\n", uri, apm ? " with APM" : "");
+    } while(0);
+    ast_mutex_unlock(&pools_lock);
+
+    if (mongoc_uri)
+        mongoc_uri_destroy(mongoc_uri);
+    return pool;
+}
+
+void ast_mongo_pool_release(mongoc_client_pool_t* pool)
+{
+    struct pool_entry *entry;
+    struct pool_entry *unlinked = NULL;
+
+    if (!pool)
+        return;
+
+    ast_mutex_lock(&pools_lock);
+    AST_LIST_TRAVERSE_SAFE_BEGIN(&pools, entry, list) {
+        if (entry->pool != pool)
+            continue;
+        if (--entry->refs == 0) {
+            AST_LIST_REMOVE_CURRENT(list);
+            unlinked = entry;
+        }
+        break;
+    }
+    AST_LIST_TRAVERSE_SAFE_END;
+    ast_mutex_unlock(&pools_lock);
+
+    // destroying the pool joins its monitor, whose callbacks take spool_lock,
+    // while the replayer takes pools_lock under spool_lock.
+    if (unlinked) {
+        ast_log(LOG_DEBUG, "pool for %s destroyed\n", unlinked->uri);
+        pool_entry_destroy(unlinked);
+    }
+}
+
+int ast_mongo_pool_writable(mongoc_client_pool_t* pool)
+{
+    struct pool_entry *entry;
+    int writable = 1;
+
+    ast_mutex_lock(&pools_lock);
+    AST_LIST_TRAVERSE(&pools, entry, list) {
+        if (entry->pool == pool) {
+            apm_context_t* context = entry->apm_context;
+            writable = context ? context->writable : 1;
+            break;
+        }
+    }
+    ast_mutex_unlock(&pools_lock);
+    return writable;
+}
+
+/*!
+ * \brief replay records in the spool until it gets empty or the flush fails.
+ */
+static void spool_replay(struct ast_mongo_spool *spool)
+{
+    bson_t docs[SPOOL_BATCH];
+    const bson_t *batch[SPOOL_BATCH];
+    unsigned replayed = 0;
+
+    for (;;) {
+        uint64_t offset;
+        unsigned count = 0;
+        int res;
+
+        ast_mutex_lock(&spool->lock);
+        for (offset = spool->header->head; count < SPOOL_BATCH && offset < spool->header->tail; count++) {
+            uint32_t length;
+            memcpy(&length, spool->map + offset, sizeof(length));
+            length = BSON_UINT32_FROM_LE(length);
+            if (length < 5 || length > spool->header->tail - offset
+            || !bson_init_static(&docs[count], spool->map + offset, length)) {
+                ast_log(LOG_ERROR, "%s is broken at %lu, discarding the rest\n",
+                    spool->path, (unsigned long)offset);
+                spool->header->tail = offset;
+                break;
+            }
+            batch[count] = &docs[count];
+            offset += length;
+        }
+        if (count == 0) {
+            spool->header->head = spool->header->tail = SPOOL_DATA_OFFSET;
+            ast_mutex_unlock(&spool->lock);
+            break;
+        }
+        spool->replaying = 1;
+        ast_mutex_unlock(&spool->lock);
+
+        res = spool->flush(batch, count, spool->data);
+
+        ast_mutex_lock(&spool->lock);
+        spool->replaying = 0;
+        if (res == 0) {
+            spool->header->head = offset;
+            if (spool->header->head == spool->header->tail)
+                spool->header->head = spool->header->tail = SPOOL_DATA_OFFSET;
+            replayed += count;
+        }
+        ast_mutex_unlock(&spool->lock);
+
+        if (res) {
+            ast_log(LOG_WARNING, "replaying %s suspended, %u records replayed\n", spool->path, replayed);
+            return;
+        }
+    }
+    if (replayed)
+        ast_log(LOG_NOTICE, "%u records replayed from %s\n", replayed, spool->path);
+}
+
+/*!
+ * \brief background replayer, which replays the spool while MongoDB is writable.
+ */
+static void *spool_run(void *data)
+{
+    struct ast_mongo_spool *spool = data;
+
+    ast_mutex_lock(&spool_lock);
+    while (!spool->stop) {
+        struct timeval wait = ast_tvadd(ast_tvnow(), ast_samp2tv(SPOOL_RETRY_INTERVAL, 1000));
+        struct timespec ts = {
+            .tv_sec = wait.tv_sec,
+            .tv_nsec = wait.tv_usec * 1000,
+        };
+
+        if (!ast_mongo_spool_is_empty(spool) && ast_mongo_pool_writable(spool->pool)) {
+            ast_mutex_unlock(&spool_lock);
+            spool_replay(spool);
+            ast_mutex_lock(&spool_lock);
+            continue;
+        }
+        ast_cond_timedwait(&spool_cond, &spool_lock, &ts);
+    }
+    ast_mutex_unlock(&spool_lock);
+    return NULL;
+}
+
+struct ast_mongo_spool *ast_mongo_spool_open(
+    const char *path, size_t size, mongoc_client_pool_t *pool, ast_mongo_spool_flush_fn flush, void *data)
+{
+    struct ast_mongo_spool *spool = NULL;
+    struct stat st;
+
+    do {
+        spool = ast_calloc(1, sizeof(*spool));
+        if (!spool) {
+            ast_log(LOG_ERROR, "not enough memory.\n");
+            break;
+        }
+        ast_mutex_init(&spool->lock);
+        spool->fd = -1;
+        spool->map = MAP_FAILED;
+        spool->thread = AST_PTHREADT_NULL;
+        spool->pool = pool;
+        spool->flush = flush;
+        spool->data = data;
+
+        spool->path = ast_strdup(path);
+        if (!spool->path) {
+            ast_log(LOG_ERROR, "not enough memory.\n");
+            break;
+        }
+        spool->fd = open(path, O_RDWR | O_CREAT, 0640);
+        if (spool->fd < 0 || fstat(spool->fd, &st)) {
+            ast_log(LOG_ERROR, "cannot open %s, %s\n", path, strerror(errno));
+            break;
+        }
+        // keep records of an existing larger spool
+        spool->size = MAX(size, (size_t)st.st_size);
+        if (spool->size <= SPOOL_DATA_OFFSET) {
+            ast_log(LOG_ERROR, "too small spool size %lu\n", (unsigned long)spool->size);
+            break;
+        }
+        if ((size_t)st.st_size < spool->size && ftruncate(spool->fd, spool->size)) {
+            ast_log(LOG_ERROR, "cannot allocate %s, %s\n", path, strerror(errno));
+            break;
+        }
+        spool->map = mmap(NULL, spool->size, PROT_READ | PROT_WRITE, MAP_SHARED, spool->fd, 0);
+        if (spool->map == MAP_FAILED) {
+            ast_log(LOG_ERROR, "cannot map %s, %s\n", path, strerror(errno));
+            break;
+        }
+        spool->header = (struct spool_header *)spool->map;
+        if (memcmp(spool->header->magic, SPOOL_MAGIC, sizeof(SPOOL_MAGIC))
+        || spool->header->head < SPOOL_DATA_OFFSET
+        || spool->header->head > spool->header->tail
+        || spool->header->tail > spool->size) {
+            if (st.st_size)
+                ast_log(LOG_WARNING, "%s is not a valid spool, initialized\n", path);
+            memcpy(spool->header->magic, SPOOL_MAGIC, sizeof(SPOOL_MAGIC));
+            spool->header->head = spool->header->tail = SPOOL_DATA_OFFSET;
+        }
+        else if (spool->header->head != spool->header->tail) {
+            ast_log(LOG_NOTICE, "%s has %lu bytes of records to replay\n",
+                path, (unsigned long)(spool->header->tail - spool->header->head));
+        }
+
+        if (ast_pthread_create_background(&spool->thread, NULL, spool_run, spool)) {
+            ast_log(LOG_ERROR, "unable to start the replayer of %s\n", path);
+            spool->thread = AST_PTHREADT_NULL;
+            break;
+        }
+        return spool;
+    } while(0);
+
+    ast_mongo_spool_close(spool);
+    return NULL;
+}
+
+void ast_mongo_spool_close(struct ast_mongo_spool *spool)
+{
+    if (!spool)
+        return;
+
+    if (spool->thread != AST_PTHREADT_NULL) {
+        ast_mutex_lock(&spool_lock);
+        spool->stop = 1;
+        ast_cond_broadcast(&spool_cond);
+        ast_mutex_unlock(&spool_lock);
+        pthread_join(spool->thread, NULL);
+    }
+    if (spool->map != MAP_FAILED) {
+        msync(spool->map, spool->size, MS_SYNC);
+        munmap(spool->map, spool->size);
+    }
+    if (spool->fd >= 0)
+        close(spool->fd);
+    if (spool->path)
+        ast_free(spool->path);
+    ast_mutex_destroy(&spool->lock);
+    ast_free(spool);
+}
+
+int ast_mongo_spool_append(struct ast_mongo_spool *spool, const bson_t *doc)
+{
+    int res = -1;
+    bson_t tmp = BSON_INITIALIZER;
+    const bson_t *record = doc;
+
+    if (!bson_has_field(doc, "_id")) {
+        // give it an _id to be able to ignore duplicates on replaying
+        bson_oid_t oid;
+        bson_oid_init(&oid, NULL);
+        BSON_APPEND_OID(&tmp, "_id", &oid);
+        bson_concat(&tmp, doc);
+        record = &tmp;
+    }
+
+    ast_mutex_lock(&spool->lock);
+    do {
+        struct spool_header *header = spool->header;
+        uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t begin;
+
+        if (header->tail + record->len > spool->size
+        && header->head > SPOOL_DATA_OFFSET && !spool->replaying) {
+            // compact already replayed area
+            memmove(spool->map + SPOOL_DATA_OFFSET, spool->map + header->head, header->tail - header->head);
+            header->tail -= header->head - SPOOL_DATA_OFFSET;
+            header->head = SPOOL_DATA_OFFSET;
+        }
+        if (header->tail + record->len > spool->size) {
+            ast_log(LOG_ERROR, "%s is full, a record lost\n", spool->path);
+            break;
+        }
+        memcpy(spool->map + header->tail, bson_get_data(record), record->len);
+        begin = ((uintptr_t)(spool->map + header->tail)) & ~(page - 1);
+        header->tail += record->len;
+        msync((void *)begin, (uintptr_t)(spool->map + header->tail) - begin, MS_ASYNC);
+        res = 0;
+    } while(0);
+    ast_mutex_unlock(&spool->lock);
+
+    bson_destroy(&tmp);
+    return res;
+}
+
+int ast_mongo_spool_is_empty(struct ast_mongo_spool *spool)
+{
+    int empty;
+    ast_mutex_lock(&spool->lock);
+    empty = spool->header->head == spool->header->tail;
+    ast_mutex_unlock(&spool->lock);
+    return empty;
+}
+
+mongoc_write_concern_t* ast_mongo_write_concern_new(struct ast_config* cfg, const char* category)
+{
+    mongoc_write_concern_t *write_concern;
+    const char *w = ast_variable_retrieve(cfg, category, "write_concern");
+    const char *journal = ast_variable_retrieve(cfg, category, "journal");
+    const char *tmp = ast_variable_retrieve(cfg, category, "wtimeout");
+    unsigned wtimeout = 0;
+    int n;
+
+    if (ast_strlen_zero(w) && ast_strlen_zero(journal) && ast_strlen_zero(tmp))
+        return NULL;    // driver default
+
+    if (!ast_strlen_zero(tmp) && sscanf(tmp, "%u", &wtimeout) != 1) {
+        ast_log(LOG_WARNING, "wtimeout must be a number in msec, not '%s'\n", tmp);
+        wtimeout = 0;
+    }
+
+    write_concern = mongoc_write_concern_new();
+    if (!write_concern) {
+        ast_log(LOG_ERROR, "not enough memory.\n");
+        return NULL;
+    }
+    if (!ast_strlen_zero(w)) {
+        if (!strcasecmp(w, "majority"))
+            mongoc_write_concern_set_wmajority(write_concern, wtimeout);
+        else if (sscanf(w, "%d", &n) == 1 && n >= 0)
+            mongoc_write_concern_set_w(write_concern, n);
+        else
+            ast_log(LOG_WARNING, "write_concern must be a number or majority, not '%s'\n", w);
+    }
+    if (wtimeout)
+        mongoc_write_concern_set_wtimeout(write_concern, wtimeout);
+    if (!ast_strlen_zero(journal))
+        mongoc_write_concern_set_journal(write_concern, ast_true(journal));
+
+    if (!mongoc_write_concern_is_valid(write_concern)) {
+        ast_log(LOG_WARNING, "invalid write concern in [%s], e.g. journal with write_concern=0, using default\n", category);
+        mongoc_write_concern_destroy(write_concern);
+        return NULL;
+    }
+    return write_concern;
+}
+
+static unsigned histogram_index(uint64_t value)
+{
+    unsigned bits;
+
+    if (value >> AST_MONGO_HISTOGRAM_MAX_BITS)
+        return AST_MONGO_HISTOGRAM_BUCKETS - 1;
+    if (value < (1 << AST_MONGO_HISTOGRAM_SUB_BITS))
+        return value;
+    bits = 63 - __builtin_clzll(value);
+    return ((bits - AST_MONGO_HISTOGRAM_SUB_BITS + 1) << AST_MONGO_HISTOGRAM_SUB_BITS)
+        + ((value >> (bits - AST_MONGO_HISTOGRAM_SUB_BITS)) & ((1 << AST_MONGO_HISTOGRAM_SUB_BITS) - 1));
+}
+
+/*!
+ * \brief the smallest value counted in a bucket.
+ */
+static uint64_t histogram_value(unsigned index)
+{
+    unsigned bits;
+
+    if (index < (1 << AST_MONGO_HISTOGRAM_SUB_BITS))
+        return index;
+    bits = (index >> AST_MONGO_HISTOGRAM_SUB_BITS) + AST_MONGO_HISTOGRAM_SUB_BITS - 1;
+    return ((uint64_t)((1 << AST_MONGO_HISTOGRAM_SUB_BITS) + (index & ((1 << AST_MONGO_HISTOGRAM_SUB_BITS) - 1))))
+        << (bits - AST_MONGO_HISTOGRAM_SUB_BITS);
+}
+
+void ast_mongo_histogram_add(struct ast_mongo_histogram* histogram, struct timeval start)
+{
+    int64_t usec = ast_tvdiff_us(ast_tvnow(), start);
+    __sync_fetch_and_add(&histogram->counts[histogram_index(usec > 0 ? usec : 0)], 1);
+}
+
+/*!
+ * \brief count of a histogram and its percentiles, upper bounds of the buckets in usec.
+ */
+static uint64_t histogram_percentiles(const struct ast_mongo_histogram *histogram,
+    const double *quantiles, uint64_t *values, unsigned n)
+{
+    uint64_t counts[AST_MONGO_HISTOGRAM_BUCKETS];
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    unsigned i;
+    unsigned q = 0;
+
+    for (i = 0; i < AST_MONGO_HISTOGRAM_BUCKETS; i++)
+        total += counts[i] = histogram->counts[i];
+    for (q = 0; q < n; q++)
+        values[q] = 0;
+    if (total == 0)
+        return 0;
+
+    for (i = 0, q = 0; i < AST_MONGO_HISTOGRAM_BUCKETS && q < n; i++) {
+        sum += counts[i];
+        while (q < n && sum >= (uint64_t)(quantiles[q] * total + 0.5) && sum) {
+            values[q++] = i + 1 < AST_MONGO_HISTOGRAM_BUCKETS ? histogram_value(i + 1) - 1 : histogram_value(i);
+        }
+    }
+    return total;
+}
+
+void ast_mongo_writer_register(struct ast_mongo_writer_stats* stats)
+{
+    stats->since = ast_tvnow();
+    ast_mutex_lock(&writers_lock);
+    AST_LIST_INSERT_TAIL(&writers, stats, list);
+    ast_mutex_unlock(&writers_lock);
+}
+
+void ast_mongo_writer_unregister(struct ast_mongo_writer_stats* stats)
+{
+    ast_mutex_lock(&writers_lock);
+    AST_LIST_REMOVE(&writers, stats, list);
+    ast_mutex_unlock(&writers_lock);
+}
+
+void ast_mongo_writer_count(struct ast_mongo_writer_stats* stats,
+    const mongoc_write_concern_t* write_concern, int succeeded, size_t count)
+{
+    if (!succeeded)
+        __sync_fetch_and_add(&stats->failed, count);
+    else if (!write_concern || mongoc_write_concern_is_acknowledged(write_concern))
+        __sync_fetch_and_add(&stats->acknowledged, count);
+    else
+        __sync_fetch_and_add(&stats->unacknowledged, count);
+}
+
+void ast_mongo_writer_sent(struct ast_mongo_writer_stats* stats, const bson_t** docs, size_t count)
+{
+    uint64_t bytes = 0;
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        bytes += docs[i]->len;
+    __sync_fetch_and_add(&stats->bytes, bytes);
+}
+
+static void cli_show_histogram(int fd, const char *name, const struct ast_mongo_histogram *histogram)
+{
+    static const double quantiles[] = { 0.5, 0.99, 0.999 };
+    uint64_t values[ARRAY_LEN(quantiles)];
+    uint64_t count = histogram_percentiles(histogram, quantiles, values, ARRAY_LEN(quantiles));
+
+    if (count == 0)
+        return;
+    ast_cli(fd, "  %-8s %12lu %12lu %12lu %12lu\n", name, (unsigned long)count,
+        (unsigned long)values[0], (unsigned long)values[1], (unsigned long)values[2]);
+}
+
+static char *handle_cli_show_writers(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+    struct ast_mongo_writer_stats *stats;
+
+    switch (cmd) {
+    case CLI_INIT:
+        e->command = "mongodb show writers";
+        e->usage =
+            "Usage: mongodb show writers\n"
+            "       Shows the number of records written by each plugin,\n"
+            "       with and without acknowledgement, the failed ones, bytes sent\n"
+            "       and throughput, the depth of the queue, then percentiles of latency in usec to encode\n"
+            "       a record, to pop a client from the pool and to insert a batch.\n";
+        return NULL;
+    case CLI_GENERATE:
+        return NULL;
+    }
+    if (a->argc != 3)
+        return CLI_SHOWUSAGE;
+
+    ast_mutex_lock(&writers_lock);
+    AST_LIST_TRAVERSE(&writers, stats, list) {
+        uint64_t records = stats->acknowledged + stats->unacknowledged;
+        double seconds = ast_tvdiff_ms(ast_tvnow(), stats->since) / 1000.0;
+
+        ast_cli(a->fd, "%s: %lu acknowledged, %lu unacknowledged, %lu failed, %lu bytes, %.1f records/sec\n",
+            stats->name,
+            (unsigned long)stats->acknowledged,
+            (unsigned long)stats->unacknowledged,
+            (unsigned long)stats->failed,
+            (unsigned long)stats->bytes,
+            seconds > 0 ? records / seconds : 0.0);
+        ast_cli(a->fd, "  queue: %u queued, %u peak, %lu overflowed\n",
+            stats->queued, stats->queue_peak, (unsigned long)stats->overflowed);
+        ast_cli(a->fd, "  %-8s %12s %12s %12s %12s\n", "usec", "count", "p50", "p99", "p999");
+        cli_show_histogram(a->fd, "encode", &stats->encode);
+        cli_show_histogram(a->fd, "pop", &stats->pop);
+        cli_show_histogram(a->fd, "insert", &stats->insert);
+    }
+    ast_mutex_unlock(&writers_lock);
+    return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry cli_mongodb[] = {
+    AST_CLI_DEFINE(handle_cli_show_writers, "Show statistics of the MongoDB writers"),
+};
+
+void ast_mongo_collection_name(const char* template, time_t time, char* name, size_t size)
+{
+    struct timeval tv = { .tv_sec = time };
+    struct ast_tm tm;
+
+    if (!strchr(template, '%')
+    || !ast_localtime(&tv, &tm, NULL)
+    || ast_strftime(name, size, template, &tm) <= 0)
+        ast_copy_string(name, template, size);
+}
+
+bson_t* ast_mongo_indexes_new(struct ast_config* cfg, const char* category)
+{
+    struct ast_variable *var;
+    bson_t *indexes = NULL;
+    unsigned count = 0;
+
+    for (var = ast_variable_browse(cfg, category); var; var = var->next) {
+        bson_t *index;
+        char number[16];
+
+        if (strcasecmp(var->name, "index"))
+            continue;
+
+        index = ast_mongo_index_new(var->value);
+        if (!index) {
+            ast_log(LOG_WARNING, "no field in index '%s' of [%s]\n", var->value, category);
+            continue;
+        }
+        if (!indexes && !(indexes = bson_new())) {
+            ast_log(LOG_ERROR, "not enough memory.\n");
+            bson_destroy(index);
+            break;
+        }
+        snprintf(number, sizeof(number), "%u", count++);
+        BSON_APPEND_DOCUMENT(indexes, number, index);
+        bson_destroy(index);
+    }
+    return indexes;
+}
+
+bson_t* ast_mongo_index_new(const char* fields)
+{
+    bson_t *index = NULL;
+    bson_t key = BSON_INITIALIZER;
+    char name[INDEXER_NAME_SIZE] = "";
+    char *list = ast_strdupa(fields);
+    char *field;
+
+    while ((field = strsep(&list, ","))) {
+        int order = 1;
+
+        field = ast_strip(field);
+        if (*field == '-') {
+            order = -1;
+            field = ast_strip(field + 1);
+        }
+        if (ast_strlen_zero(field))
+            continue;
+        BSON_APPEND_INT32(&key, field, order);
+        snprintf(name + strlen(name), sizeof(name) - strlen(name), "%s%s_%d",
+            *name ? "_" : "", field, order);
+    }
+    if (bson_count_keys(&key))
+        index = BCON_NEW("key", BCON_DOCUMENT(&key), "name", BCON_UTF8(name));
+    bson_destroy(&key);
+    return index;
+}
+
+int ast_mongo_indexes_create(mongoc_client_pool_t* pool,
+    const char* database, const char* name, const bson_t* indexes)
+{
+    int res = -1;
+    mongoc_client_t *client = mongoc_client_pool_pop(pool);
+    bson_t *cmd = NULL;
+    bson_t reply = BSON_INITIALIZER;
+
+    do {
+        mongoc_collection_t *collection;
+        bson_error_t error;
+
+        if (!client) {
+            ast_log(LOG_ERROR, "no client allocated\n");
+            break;
+        }
+        collection = ast_mongo_collection_get(pool, client, database, name);
+        if (!collection)
+            break;
+        cmd = BCON_NEW("createIndexes", BCON_UTF8(name), "indexes", BCON_ARRAY(indexes));
+        if (!mongoc_collection_write_command_with_opts(collection, cmd, NULL, &reply, &error)) {
+            ast_log(LOG_WARNING, "cannot create indexes on %s.%s, %s\n",
+                database, name, error.message);
+            break;
+        }
+        ast_log(LOG_DEBUG, "indexes on %s.%s provisioned\n", database, name);
+        res = 0;
+    } while(0);
+
+    bson_destroy(&reply);
+    if (cmd)
+        bson_destroy(cmd);
+    if (client)
+        ast_mongo_client_push(pool, client);
+    return res;
+}
+
+static int indexer_is_done(struct ast_mongo_indexer *indexer, const char *name)
+{
+    unsigned i;
+
+    for (i = 0; i < INDEXER_DONE; i++) {
+        if (!strcmp(indexer->done[i], name))
+            return 1;
+    }
+    return 0;
+}
+
+/*!
+ * \brief provision a collection unless done recently.
+ * \note indexer->lock must be held, which is released while creating indexes.
+ */
+static void indexer_provision(struct ast_mongo_indexer *indexer, const char *name)
+{
+    int res;
+
+    if (indexer_is_done(indexer, name) || time(NULL) < indexer->retry_after)
+        return;
+
+    ast_mutex_unlock(&indexer->lock);
+    res = ast_mongo_indexes_create(indexer->pool, indexer->database, name, indexer->indexes);
+    ast_mutex_lock(&indexer->lock);
+
+    if (res) {
+        indexer->retry_after = time(NULL) + INDEXER_RETRY;
+        return;
+    }
+    ast_copy_string(indexer->done[indexer->done_next], name, INDEXER_NAME_SIZE);
+    indexer->done_next = (indexer->done_next + 1) % INDEXER_DONE;
+}
+
+/*!
+ * \brief background task to provision the current and upcoming collections.
+ */
+static void *indexer_run(void *data)
+{
+    struct ast_mongo_indexer *indexer = data;
+
+    ast_mutex_lock(&indexer->lock);
+    while (!indexer->stop) {
+        char name[INDEXER_NAME_SIZE];
+        time_t now = time(NULL);
+        time_t t;
+        struct timeval deadline;
+        struct timespec ts;
+
+        if (*indexer->pending) {
+            ast_copy_string(name, indexer->pending, sizeof(name));
+            *indexer->pending = '\0';
+            indexer_provision(indexer, name);
+        }
+        for (t = now; t <= now + INDEXER_LOOKAHEAD && !indexer->stop; t += INDEXER_STEP) {
+            ast_mongo_collection_name(indexer->template, t, name, sizeof(name));
+            indexer_provision(indexer, name);
+        }
+        if (*indexer->pending || indexer->stop)
+            continue;
+
+        deadline = ast_tvadd(ast_tvnow(), ast_samp2tv(INDEXER_INTERVAL, 1000));
+        ts.tv_sec = deadline.tv_sec;
+        ts.tv_nsec = deadline.tv_usec * 1000;
+        ast_cond_timedwait(&indexer->cond, &indexer->lock, &ts);
+    }
+    ast_mutex_unlock(&indexer->lock);
+    return NULL;
+}
+
+struct ast_mongo_indexer* ast_mongo_indexer_start(mongoc_client_pool_t* pool,
+    const char* database, const char* template, const bson_t* indexes)
+{
+    struct ast_mongo_indexer *indexer = ast_calloc(1, sizeof(*indexer));
+
+    if (!indexer) {
+        ast_log(LOG_ERROR, "not enough memory.\n");
+        return NULL;
+    }
+    ast_mutex_init(&indexer->lock);
+    ast_cond_init(&indexer->cond, NULL);
+    indexer->thread = AST_PTHREADT_NULL;
+    indexer->pool = pool;
+    indexer->database = ast_strdup(database);
+    indexer->template = ast_strdup(template);
+    indexer->indexes = bson_copy(indexes);
+    if (!indexer->database || !indexer->template || !indexer->indexes) {
+        ast_log(LOG_ERROR, "not enough memory.\n");
+        ast_mongo_indexer_stop(indexer);
+        return NULL;
+    }
+    if (ast_pthread_create_background(&indexer->thread, NULL, indexer_run, indexer)) {
+        ast_log(LOG_ERROR, "unable to start the indexer of %s.%s\n", database, template);
+        indexer->thread = AST_PTHREADT_NULL;
+        ast_mongo_indexer_stop(indexer);
+        return NULL;
+    }
+    return indexer;
+}
+
+void ast_mongo_indexer_stop(struct ast_mongo_indexer* indexer)
+{
+    if (!indexer)
+        return;
+
+    if (indexer->thread != AST_PTHREADT_NULL) {
+        ast_mutex_lock(&indexer->lock);
+        indexer->stop = 1;
+        ast_cond_signal(&indexer->cond);
+        ast_mutex_unlock(&indexer->lock);
+        pthread_join(indexer->thread, NULL);
+    }
+    if (indexer->indexes)
+        bson_destroy(indexer->indexes);
+    ast_free(indexer->database);
+    ast_free(indexer->template);
+    ast_cond_destroy(&indexer->cond);
+    ast_mutex_destroy(&indexer->lock);
+    ast_free(indexer);
+}
+
+void ast_mongo_indexer_notify(struct ast_mongo_indexer* indexer, const char* name)
+{
+    if (!indexer)
+        return;
+
+    ast_mutex_lock(&indexer->lock);
+    if (!indexer_is_done(indexer, name) && strcmp(indexer->pending, name)
+    && time(NULL) >= indexer->retry_after) {
+        ast_copy_string(indexer->pending, name, sizeof(indexer->pending));
+        ast_cond_signal(&indexer->cond);
+    }
+    ast_mutex_unlock(&indexer->lock);
+}
+
+void ast_mongo_plan_init(struct ast_mongo_plan* plan,
+    const struct ast_mongo_field* fields, size_t count, const char* time_field)
+{
+    memset(plan, 0, sizeof(*plan));
+    ast_rwlock_init(&plan->lock);
+    plan->fields = fields;
+    plan->fields_count = count;
+    plan->time_field = time_field;
+}
+
+static void plan_free(struct ast_mongo_plan_entry *entries, unsigned count)
+{
+    unsigned i;
+
+    if (!entries)
+        return;
+    for (i = 0; i < count; i++)
+        ast_free(entries[i].key);
+    ast_free(entries);
+}
+
+void ast_mongo_plan_destroy(struct ast_mongo_plan* plan)
+{
+    plan_free(plan->entries, plan->count);
+    plan->entries = NULL;
+    plan->count = 0;
+    plan->time_key = NULL;
+    ast_rwlock_destroy(&plan->lock);
+}
+
+static struct ast_mongo_plan_entry *plan_find(struct ast_mongo_plan_entry *entries, unsigned count, const char *name)
+{
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        if (!strcmp(entries[i].field->key, name))
+            return &entries[i];
+    }
+    return NULL;
+}
+
+int ast_mongo_plan_build(struct ast_mongo_plan* plan, const char* fields, const char* aliases)
+{
+    struct ast_mongo_plan_entry *entries = ast_calloc(plan->fields_count, sizeof(*entries));
+    struct ast_mongo_plan_entry *old;
+    unsigned old_count;
+    unsigned count = 0;
+    unsigned i;
+    char *list;
+    char *name;
+
+    if (!entries) {
+        ast_log(LOG_ERROR, "not enough memory for fields\n");
+        return -1;
+    }
+
+    list = ast_strdupa(S_OR(fields, ""));
+    while ((name = strsep(&list, ","))) {
+        name = ast_strip(name);
+        if (ast_strlen_zero(name))
+            continue;
+        for (i = 0; i < plan->fields_count; i++) {
+            if (!strcmp(plan->fields[i].key, name))
+                break;
+        }
+        if (i == plan->fields_count)
+            ast_log(LOG_WARNING, "unknown field '%s' ignored\n", name);
+        else if (!plan_find(entries, count, name))
+            entries[count++].field = &plan->fields[i];
+    }
+    if (count == 0) {
+        if (!ast_strlen_zero(fields))
+            ast_log(LOG_WARNING, "no valid fields specified, all of them are written\n");
+        for (; count < plan->fields_count; count++)
+            entries[count].field = &plan->fields[count];
+    }
+
+    list = ast_strdupa(S_OR(aliases, ""));
+    while ((name = strsep(&list, ","))) {
+        struct ast_mongo_plan_entry *entry;
+        char *key = strchr(name, ':');
+
+        if (key)
+            *key++ = '\0';
+        name = ast_strip(name);
+        key = ast_strip(S_OR(key, ""));
+        if (ast_strlen_zero(name))
+            continue;
+        if (ast_strlen_zero(key) || *key == '$' || strchr(key, '.')) {
+            ast_log(LOG_WARNING, "invalid alias of '%s' ignored\n", name);
+            continue;
+        }
+        if (!(entry = plan_find(entries, count, name))) {
+            ast_log(LOG_WARNING, "alias of '%s' ignored, no such field written\n", name);
+            continue;
+        }
+        ast_free(entry->key);
+        entry->key = ast_strdup(key);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (!entries[i].key)
+            entries[i].key = ast_strdup(entries[i].field->key);
+        if (!entries[i].key) {
+            ast_log(LOG_ERROR, "not enough memory for fields\n");
+            plan_free(entries, count);
+            return -1;
+        }
+        entries[i].length = strlen(entries[i].key);
+    }
+    for (i = 0; i < count; i++) {
+        unsigned j;
+        for (j = 0; j < i; j++) {
+            if (!strcmp(entries[i].key, entries[j].key))
+                ast_log(LOG_WARNING, "key '%s' is used for %s and %s\n",
+                    entries[i].key, entries[j].field->key, entries[i].field->key);
+        }
+    }
+
+    ast_rwlock_wrlock(&plan->lock);
+    old = plan->entries;
+    old_count = plan->count;
+    plan->entries = entries;
+    plan->count = count;
+    plan->time_key = NULL;
+    for (i = 0; i < count; i++) {
+        if (!strcmp(entries[i].field->key, plan->time_field))
+            plan->time_key = entries[i].key;
+    }
+    ast_rwlock_unlock(&plan->lock);
+
+    plan_free(old, old_count);
+    return 0;
+}
+
+time_t ast_mongo_doc_time(struct ast_mongo_plan* plan, const bson_t* doc)
+{
+    bson_iter_t iter;
+    time_t t = 0;
+
+    ast_rwlock_rdlock(&plan->lock);
+    if (plan->time_key && bson_iter_init_find(&iter, doc, plan->time_key) && BSON_ITER_HOLDS_DATE_TIME(&iter))
+        t = bson_iter_date_time(&iter) / 1000;
+    ast_rwlock_unlock(&plan->lock);
+
+    if (t == 0 && bson_iter_init_find(&iter, doc, "_id") && BSON_ITER_HOLDS_OID(&iter))
+        t = bson_oid_get_time_t(bson_iter_oid(&iter));
+    return t ? t : time(NULL);
+}
+
+size_t ast_mongo_docs_route(struct ast_mongo_plan* plan, const char* template,
+    struct ast_mongo_indexer* indexer, const bson_t** docs, size_t count, char* name, size_t size)
+{
+    char next[AST_MONGO_COLLECTION_NAME_SIZE];
+    size_t n;
+
+    if (!strchr(template, '%')) {
+        ast_copy_string(name, template, size);
+        return count;
+    }
+    ast_mongo_collection_name(template, ast_mongo_doc_time(plan, docs[0]), name, size);
+    for (n = 1; n < count; n++) {
+        ast_mongo_collection_name(template, ast_mongo_doc_time(plan, docs[n]), next, sizeof(next));
+        if (strcmp(name, next))
+            break;
+    }
+    ast_mongo_indexer_notify(indexer, name);
+    return n;
+}
+
+void ast_mongo_queue_init(struct ast_mongo_queue* queue, struct ast_mongo_writer_stats* stats)
+{
+    memset(queue, 0, sizeof(*queue));
+    ast_mutex_init(&queue->lock);
+    ast_cond_init(&queue->cond, NULL);
+    queue->stats = stats;
+}
+
+void ast_mongo_queue_destroy(struct ast_mongo_queue* queue)
+{
+    unsigned i;
+
+    for (i = 0; i < queue->count; i++)
+        bson_destroy(queue->docs[(queue->head + i) % queue->capacity]);
+    if (queue->docs)
+        ast_free(queue->docs);
+    queue->docs = NULL;
+    queue->capacity = queue->head = queue->count = 0;
+    while (queue->spares_count)
+        bson_destroy(queue->spares[--queue->spares_count]);
+    ast_cond_destroy(&queue->cond);
+    ast_mutex_destroy(&queue->lock);
+}
+
+int ast_mongo_queue_resize(struct ast_mongo_queue* queue, unsigned size)
+{
+    bson_t **docs;
+    unsigned i;
+
+    if (size < queue->count)
+        size = queue->count;
+    if (size == queue->capacity)
+        return 0;
+    docs = ast_calloc(size, sizeof(*docs));
+    if (docs == NULL) {
+        ast_log(LOG_ERROR, "not enough memory for queue\n");
+        return -1;
+    }
+    for (i = 0; i < queue->count; i++)
+        docs[i] = queue->docs[(queue->head + i) % queue->capacity];
+    if (queue->docs)
+        ast_free(queue->docs);
+    queue->docs = docs;
+    queue->capacity = size;
+    queue->head = 0;
+    return 0;
+}
+
+int ast_mongo_queue_push(struct ast_mongo_queue* queue, bson_t* doc)
+{
+    struct ast_mongo_writer_stats *stats = queue->stats;
+    int ret = -1;
+
+    ast_mutex_lock(&queue->lock);
+    if (queue->writers && queue->count < queue->capacity) {
+        queue->docs[(queue->head + queue->count) % queue->capacity] = doc;
+        if (queue->count++ == 0)
+            queue->oldest = ast_tvnow();
+        if (queue->count == 1 || queue->count >= queue->batch_size)
+            ast_cond_signal(&queue->cond);
+        stats->queued = queue->count;
+        if (queue->count > stats->queue_peak)
+            stats->queue_peak = queue->count;
+        ret = 0;
+    }
+    else if (queue->writers)
+        stats->overflowed++;
+    ast_mutex_unlock(&queue->lock);
+    return ret;
+}
+
+bson_t* ast_mongo_doc_get(struct ast_mongo_queue* queue)
+{
+    bson_t *doc = NULL;
+
+    ast_mutex_lock(&queue->lock);
+    if (queue->spares_count)
+        doc = queue->spares[--queue->spares_count];
+    ast_mutex_unlock(&queue->lock);
+
+    if (doc) {
+        // keeps the buffer grown so far
+        bson_reinit(doc);
+        return doc;
+    }
+    return bson_sized_new(AST_MONGO_DOC_SIZE);
+}
+
+void ast_mongo_docs_put(struct ast_mongo_queue* queue, bson_t** docs, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        if (queue->spares_count < ARRAY_LEN(queue->spares))
+            queue->spares[queue->spares_count++] = docs[i];
+        else
+            bson_destroy(docs[i]);
+    }
+}
+
+unsigned ast_mongo_queue_drop(struct ast_mongo_queue* queue)
+{
+    unsigned count = queue->count;
+
+    for (; queue->count > 0; queue->count--) {
+        ast_mongo_docs_put(queue, &queue->docs[queue->head], 1);
+        queue->head = (queue->head + 1) % queue->capacity;
+    }
+    queue->stats->queued = 0;
+    ast_mongo_writer_count(queue->stats, NULL, 0, count);
+    return count;
+}
+
+void ast_mongo_write_opts_destroy(struct ast_mongo_write_opts* opts)
+{
+    if (opts->write_concern)
+        mongoc_write_concern_destroy(opts->write_concern);
+    if (opts->ordered)
+        bson_destroy(opts->ordered);
+    if (opts->unordered)
+        bson_destroy(opts->unordered);
+    opts->write_concern = NULL;
+    opts->ordered = NULL;
+    opts->unordered = NULL;
+}
+
+int ast_mongo_write_opts_build(struct ast_mongo_write_opts* opts,
+    struct ast_config* cfg, const char* category)
+{
+    opts->write_concern = ast_mongo_write_concern_new(cfg, category);
+    opts->ordered = bson_new();
+    opts->unordered = BCON_NEW("ordered", BCON_BOOL(false));
+    if (opts->write_concern && opts->ordered && opts->unordered) {
+        mongoc_write_concern_append(opts->write_concern, opts->ordered);
+        mongoc_write_concern_append(opts->write_concern, opts->unordered);
+    }
+    return opts->ordered && opts->unordered ? 0 : -1;
+}
+
 static int config(int reload)
 {
     int res = 0;
@@ -414,8 +1811,12 @@ static int reload(void)
 static int unload_module(void)
 {
     ast_log(LOG_DEBUG, "unloading...\n");
+    ast_cli_unregister_multiple(cli_mongodb, ARRAY_LEN(cli_mongodb));
     mongoc_log_set_handler(NULL, NULL);
     mongoc_cleanup();
+    ast_cond_destroy(&spool_cond);
+    ao2_cleanup(client_caches);
+    client_caches = NULL;
     return 0;
 }
 
@@ -434,8 +1835,14 @@ static int load_module(void)
     ast_log(LOG_DEBUG, "loading...\n");
     if (config(0))
         return AST_MODULE_LOAD_DECLINE;
+    client_caches = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_RWLOCK, 0,
+        CLIENT_CACHE_BUCKETS, client_cache_hash, NULL, client_cache_cmp);
+    if (!client_caches)
+        return AST_MODULE_LOAD_DECLINE;
     mongoc_init();
     mongoc_log_set_handler(mongoc_log_handler, NULL);
+    ast_cond_init(&spool_cond, NULL);
+    ast_cli_register_multiple(cli_mongodb, ARRAY_LEN(cli_mongodb));
     return 0;
 }
 
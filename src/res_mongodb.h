@@ -16,7 +16,347 @@
 #include <libbson-1.0/bson.h>
 #include <libmongoc-1.0/mongoc.h>
 
+#include "asterisk/lock.h"
+#include "asterisk/linkedlists.h"
+
+struct ast_config;
+
 extern void* ast_mongo_apm_start(mongoc_client_pool_t* pool);
 extern void ast_mongo_apm_stop(void* context);
 
+/*!
+ * \brief get a connection pool shared among the plugins connecting to the same uri.
+ * APM is attached to the pool when it is made, if any section of the config
+ * connecting to the uri enables 'apm' or a 'spool'.
+ * \param uri  is MongoDB connection URI.
+ * \param cfg  is ast_mongo.conf loaded by the plugin.
+ * \retval a pool to be released by ast_mongo_pool_release(), NULL if failed.
+ */
+extern mongoc_client_pool_t* ast_mongo_pool_acquire(const char* uri, struct ast_config* cfg);
+
+/*!
+ * \brief release a pool, which is destroyed when nobody uses it any longer.
+ */
+extern void ast_mongo_pool_release(mongoc_client_pool_t* pool);
+
+/*!
+ * \brief check if SDAM of the pool reports any writable server.
+ * \retval 0 if no writable server, non-zero if writable or unknown.
+ */
+extern int ast_mongo_pool_writable(mongoc_client_pool_t* pool);
+
+/*!
+ * \brief get a collection handle cached for a client popped from the pool.
+ * The handle is owned by the cache: do not destroy it, nor use it after
+ * pushing the client back by ast_mongo_client_push(). Only the most recently
+ * used handles are kept, and the cache is cleared when the pool is destroyed.
+ * \param pool        is returned by ast_mongo_pool_acquire().
+ * \param client      is popped from the pool.
+ * \param database    name.
+ * \param collection  name.
+ * \retval a collection handle, NULL if failed.
+ */
+extern mongoc_collection_t* ast_mongo_collection_get(mongoc_client_pool_t* pool,
+    mongoc_client_t* client, const char* database, const char* collection);
+
+/*!
+ * \brief push a client popped from the pool back, instead of mongoc_client_pool_push().
+ * The collection handles cached for the client are dropped if the pool may destroy it.
+ * \param pool    is returned by ast_mongo_pool_acquire().
+ * \param client  is popped from the pool.
+ */
+extern void ast_mongo_client_push(mongoc_client_pool_t* pool, mongoc_client_t* client);
+
+/*!
+ * \brief make a write concern from write_concern, journal and wtimeout of a category.
+ * write_concern is a number of nodes, e.g. 0 for unacknowledged writes, or majority.
+ * \param cfg       is the loaded ast_mongo.conf.
+ * \param category  is the section, e.g. cdr.
+ * \retval a write concern to be destroyed by mongoc_write_concern_destroy(),
+ * \retval NULL to use the driver default, if none is configured or invalid.
+ */
+extern mongoc_write_concern_t* ast_mongo_write_concern_new(struct ast_config* cfg, const char* category);
+
+enum {
+    AST_MONGO_HISTOGRAM_SUB_BITS = 3,   // 8 sub-buckets per power of two, i.e. 12.5% precision
+    AST_MONGO_HISTOGRAM_MAX_BITS = 40,  // up to 2^40 usec
+    AST_MONGO_HISTOGRAM_BUCKETS =
+        (AST_MONGO_HISTOGRAM_MAX_BITS - AST_MONGO_HISTOGRAM_SUB_BITS + 1) << AST_MONGO_HISTOGRAM_SUB_BITS,
+};
+
+/*!
+ * \brief log-linear histogram of latency in usec, updated without lock.
+ */
+struct ast_mongo_histogram {
+    volatile uint64_t counts[AST_MONGO_HISTOGRAM_BUCKETS];
+};
+
+/*!
+ * \brief record time elapsed since start.
+ */
+extern void ast_mongo_histogram_add(struct ast_mongo_histogram* histogram, struct timeval start);
+
+/*!
+ * \brief statistics of a writer plugin, shown by "mongodb show writers".
+ */
+struct ast_mongo_writer_stats {
+    const char *name;
+    volatile uint64_t acknowledged;     // records written with acknowledgement
+    volatile uint64_t unacknowledged;   // records written without acknowledgement
+    volatile uint64_t failed;           // records failed to be written
+    volatile uint64_t bytes;            // bytes of documents sent
+    volatile unsigned queued;           // records waiting in the queue
+    volatile unsigned queue_peak;       // max records ever waited in the queue
+    volatile uint64_t overflowed;       // records written synchronously as the queue was full
+    struct ast_mongo_histogram encode;  // to make a document from a record
+    struct ast_mongo_histogram pop;     // to pop a client from the pool
+    struct ast_mongo_histogram insert;  // to insert a batch of documents
+    struct timeval since;               // when registered
+    AST_LIST_ENTRY(ast_mongo_writer_stats) list;
+};
+
+extern void ast_mongo_writer_register(struct ast_mongo_writer_stats* stats);
+extern void ast_mongo_writer_unregister(struct ast_mongo_writer_stats* stats);
+
+/*!
+ * \brief count records written with the write concern, without any lock.
+ * \param succeeded  is 0 if the records failed to be written.
+ */
+extern void ast_mongo_writer_count(struct ast_mongo_writer_stats* stats,
+    const mongoc_write_concern_t* write_concern, int succeeded, size_t count);
+
+/*!
+ * \brief count bytes of documents sent, without any lock.
+ */
+extern void ast_mongo_writer_sent(struct ast_mongo_writer_stats* stats, const bson_t** docs, size_t count);
+
+/*!
+ * \brief name a collection by a strftime template in local time, e.g. cdr_%Y%m.
+ * A template without '%' is the name as it is.
+ */
+extern void ast_mongo_collection_name(const char* template, time_t time, char* name, size_t size);
+
+/*!
+ * \brief make specs of indexes from "index" lines of a category.
+ * Each line is a comma separated list of fields, '-' prefixed for descending order.
+ * \retval an array of index specs to be destroyed by bson_destroy(),
+ * \retval NULL if no index is configured.
+ */
+extern bson_t* ast_mongo_indexes_new(struct ast_config* cfg, const char* category);
+
+/*!
+ * \brief make a spec of an index named after its fields.
+ * \param fields  is a comma separated list, '-' prefixed for descending order.
+ * \retval a spec to be destroyed by bson_destroy(),
+ * \retval NULL if no field is listed.
+ */
+extern bson_t* ast_mongo_index_new(const char* fields);
+
+/*!
+ * \brief create indexes on a collection, which does nothing for existing ones.
+ * \param indexes  is an array of specs such as ast_mongo_index_new() returns.
+ * \retval 0 on success, -1 on failure.
+ */
+extern int ast_mongo_indexes_create(mongoc_client_pool_t* pool,
+    const char* database, const char* name, const bson_t* indexes);
+
+struct ast_mongo_indexer;
+
+/*!
+ * \brief start a background task which creates indexes on the current and
+ * upcoming collections named by a template, ahead of rolling over.
+ * \param pool        is returned by ast_mongo_pool_acquire().
+ * \param database    name.
+ * \param template    of collection names, see ast_mongo_collection_name().
+ * \param indexes     is returned by ast_mongo_indexes_new().
+ * \retval an indexer, NULL if failed.
+ */
+extern struct ast_mongo_indexer* ast_mongo_indexer_start(mongoc_client_pool_t* pool,
+    const char* database, const char* template, const bson_t* indexes);
+extern void ast_mongo_indexer_stop(struct ast_mongo_indexer* indexer);
+
+/*!
+ * \brief ask the indexer to provision a collection in use, without blocking.
+ */
+extern void ast_mongo_indexer_notify(struct ast_mongo_indexer* indexer, const char* name);
+
+struct ast_mongo_spool;
+
+/*!
+ * \brief callback to write spooled records back to MongoDB.
+ * \retval 0 if the records have been handled,
+ * \retval -1 to keep them in the spool and retry later.
+ */
+typedef int (*ast_mongo_spool_flush_fn)(const bson_t **docs, size_t count, void *data);
+
+/*!
+ * \brief open a memory-mapped spool file to keep records while MongoDB is unreachable.
+ * The records are replayed through flush once SDAM of the pool reports a writable server.
+ * \param path     of the spool file, created if not exist.
+ * \param size     of the spool file in bytes.
+ * \param pool     is returned by ast_mongo_pool_acquire().
+ * \param flush    to replay records.
+ * \param data     is passed to flush.
+ * \retval a spool, NULL if failed.
+ */
+extern struct ast_mongo_spool* ast_mongo_spool_open(const char* path, size_t size,
+    mongoc_client_pool_t* pool, ast_mongo_spool_flush_fn flush, void* data);
+extern void ast_mongo_spool_close(struct ast_mongo_spool* spool);
+extern int ast_mongo_spool_append(struct ast_mongo_spool* spool, const bson_t* doc);
+extern int ast_mongo_spool_is_empty(struct ast_mongo_spool* spool);
+
+enum {
+    AST_MONGO_DOC_SIZE = 1024,          // initial buffer size of a document
+    AST_MONGO_SPARES_SIZE = 1024,       // max number of documents kept for recycling
+    AST_MONGO_COLLECTION_NAME_SIZE = 128,
+};
+
+/*!
+ * \brief a field of records, i.e. its key in documents and where the value is in a record.
+ */
+struct ast_mongo_field {
+    const char *key;
+    int type;                           // defined by the plugin
+    size_t offset;
+};
+
+/*!
+ * \brief a field to be encoded, with its key in documents.
+ */
+struct ast_mongo_plan_entry {
+    const struct ast_mongo_field *field;
+    char *key;
+    int length;
+};
+
+/*!
+ * \brief fields of records to be encoded in order, built from fields and aliases.
+ * Encoders walk entries with lock held for reading.
+ */
+struct ast_mongo_plan {
+    ast_rwlock_t lock;
+    const struct ast_mongo_field *fields;   // all the known ones
+    size_t fields_count;
+    const char *time_field;             // to route documents by, e.g. start
+    struct ast_mongo_plan_entry *entries;
+    unsigned count;
+    const char *time_key;               // key of time_field in entries, or NULL
+};
+
+/*!
+ * \brief initialize a plan which encodes nothing until built.
+ * \param fields      known to the plugin.
+ * \param count       of fields.
+ * \param time_field  is the key of the field to route documents by.
+ */
+extern void ast_mongo_plan_init(struct ast_mongo_plan* plan,
+    const struct ast_mongo_field* fields, size_t count, const char* time_field);
+extern void ast_mongo_plan_destroy(struct ast_mongo_plan* plan);
+
+/*!
+ * \brief build the entries of the plan, replacing the current ones.
+ * \param fields   is a comma separated list of fields, or NULL for all of them.
+ * \param aliases  is a comma separated list of field:key, or NULL.
+ * \retval 0 on success, -1 on failure.
+ */
+extern int ast_mongo_plan_build(struct ast_mongo_plan* plan, const char* fields, const char* aliases);
+
+/*!
+ * \brief time to route a document by, i.e. the time field of the plan,
+ * or when the document was made if the time field is not written.
+ */
+extern time_t ast_mongo_doc_time(struct ast_mongo_plan* plan, const bson_t* doc);
+
+/*!
+ * \brief name the collection for leading documents, which are routed to the same one.
+ * \param template  of collection names, see ast_mongo_collection_name().
+ * \param indexer   to be notified of the collection, or NULL.
+ * \param docs
+ * \param count     is number of documents in docs.
+ * \param name      to be set.
+ * \param size      of name.
+ * \retval number of the leading documents.
+ */
+extern size_t ast_mongo_docs_route(struct ast_mongo_plan* plan, const char* template,
+    struct ast_mongo_indexer* indexer, const bson_t** docs, size_t count, char* name, size_t size);
+
+/*!
+ * \brief queue of documents for background writers of a plugin,
+ * with documents kept for recycling. Members are protected by lock.
+ */
+struct ast_mongo_queue {
+    ast_mutex_t lock;
+    ast_cond_t cond;                    // to wake up writers
+    bson_t **docs;                      // ring buffer
+    unsigned capacity;
+    unsigned head;
+    unsigned count;
+    struct timeval oldest;              // when the oldest document was queued
+    unsigned batch_size;                // to wake up a writer as many are queued
+    unsigned writers;                   // running, documents are queued only while any
+    struct ast_mongo_writer_stats *stats;
+    bson_t *spares[AST_MONGO_SPARES_SIZE];
+    unsigned spares_count;
+};
+
+extern void ast_mongo_queue_init(struct ast_mongo_queue* queue, struct ast_mongo_writer_stats* stats);
+
+/*!
+ * \brief free documents left in the queue and the spares.
+ * \note the writers must be stopped.
+ */
+extern void ast_mongo_queue_destroy(struct ast_mongo_queue* queue);
+
+/*!
+ * \brief change capacity of the queue, keeping documents in it.
+ * \note lock must be held.
+ * \retval 0 on success, -1 on failure.
+ */
+extern int ast_mongo_queue_resize(struct ast_mongo_queue* queue, unsigned size);
+
+/*!
+ * \brief put a document into the queue to be flushed by the writers.
+ * \retval 0 if queued, the queue owns the document.
+ * \retval -1 if no writer is running or the queue is full.
+ */
+extern int ast_mongo_queue_push(struct ast_mongo_queue* queue, bson_t* doc);
+
+/*!
+ * \brief get a document to encode a record into, recycled if possible.
+ */
+extern bson_t* ast_mongo_doc_get(struct ast_mongo_queue* queue);
+
+/*!
+ * \brief give documents back to be recycled.
+ * \note lock of the queue must be held.
+ */
+extern void ast_mongo_docs_put(struct ast_mongo_queue* queue, bson_t** docs, unsigned count);
+
+/*!
+ * \brief drop the documents left in the queue, counted as failed,
+ * e.g. on shutdown while the server is unreachable.
+ * \note lock of the queue must be held.
+ * \retval number of dropped documents.
+ */
+extern unsigned ast_mongo_queue_drop(struct ast_mongo_queue* queue);
+
+/*!
+ * \brief options of insertion with the write concern of a category.
+ */
+struct ast_mongo_write_opts {
+    mongoc_write_concern_t *write_concern;  // NULL for the driver default
+    bson_t *ordered;                    // { writeConcern }
+    bson_t *unordered;                  // { ordered: false, writeConcern }
+};
+
+/*!
+ * \brief build the options from write_concern, journal and wtimeout of a category
+ * into empty ones, to be swapped with those writers use. See ast_mongo_write_concern_new().
+ * \note whatever is built, even on failure, must be destroyed by the caller.
+ * \retval 0 on success, -1 on failure.
+ */
+extern int ast_mongo_write_opts_build(struct ast_mongo_write_opts* opts,
+    struct ast_config* cfg, const char* category);
+extern void ast_mongo_write_opts_destroy(struct ast_mongo_write_opts* opts);
+
 #endif /* _ASTERISK_RES_MONGODB_H */
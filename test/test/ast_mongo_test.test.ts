@@ -35,6 +35,8 @@ const ShortSound = 'demo-thanks';
 const LongSound = 'demo-instruct';
 const AstMakeAShortCall = `channel originate PJSIP/${MyID} application playback ${ShortSound}`;
 const AstMakeALongCall = `channel originate PJSIP/${MyID} application playback ${LongSound}`;
+const RealtimeTest = 'realtime_test';   // cached for 60 sec by ast_mongo.conf
+const PurgeCache = 'module reload res_config_mongodb.so';
 
 const LOG_LEVEL = ENV.LOG_LEVEL || ENV.npm_package_config_pjsua_loglevel || 3;
 const astMongoOptions: AstMongoOptions = {
@@ -84,6 +86,21 @@ function delay(sec: number): Promise<void> {
     return new Promise(resolve => setTimeout(resolve, sec * 1000));
 }
 
+/**
+ * Hits of cached results and of cached lookups which matched nothing.
+ */
+async function cacheHits(): Promise<{ hits: number, negative: number }> {
+    const result = await ast_utils.exec('mongodb show realtime cache');
+    return {
+        hits: parseInt(/\d+ results, .*?, (\d+) hits/.exec(result.Output)[1], 10),
+        negative: parseInt(/results which matched nothing, (\d+) hits/.exec(result.Output)[1], 10)
+    };
+}
+
+function realtimeLoad(family: string, field: string, value: string): Promise<any> {
+    return ast_utils.exec(`realtime load ${family} "${field}" ${value}`);
+}
+
 beforeAll( async () => {
 
     global.Promise = Promise;
@@ -305,3 +322,70 @@ describe('ast_mongo', () => {
         expect(objs).toMatchSnapshot();
     });
 });
+
+describe('realtime lookups', () => {
+
+    const rows = () => ast_mongo.Endpoint.db.collection(RealtimeTest) as any;
+
+    beforeAll(async () => {
+        await rows().deleteMany({});
+        await ast_utils.exec(`realtime store ${RealtimeTest} id r1 name alice n 1 note x`);
+        await ast_utils.exec(`realtime store ${RealtimeTest} id r2 name bob n 2 note y`);
+        await ast_utils.exec(`realtime store ${RealtimeTest} id r3 name carol n 3`);
+    });
+
+    afterAll(async () => {
+        await rows().deleteMany({});
+    });
+
+    test ('keep lookups which matched nothing on the table', async () => {
+        await realtimeLoad(RealtimeTest, 'id', BadID);
+        const before = await cacheHits();
+        const result = await realtimeLoad(RealtimeTest, 'id', BadID);
+        expect(result.Output).toMatch(/No rows found/);
+        const after = await cacheHits();
+        expect(after.negative).toBeGreaterThan(before.negative);
+
+        // but not on the others
+        await realtimeLoad('ps_endpoints', 'id', BadID);
+        await realtimeLoad('ps_endpoints', 'id', BadID);
+        expect((await cacheHits()).negative).toBe(after.negative);
+    });
+
+    test ('return cached results until a write or a reload', async () => {
+        expect((await realtimeLoad(RealtimeTest, 'id', 'r1')).Output).toMatch(/name\s+alice/);
+        const before = await cacheHits();
+
+        // a change apart from this module is not seen while cached
+        await rows().updateOne({ _id: 'r1' }, { $set: { name: 'alicia' } });
+        expect((await realtimeLoad(RealtimeTest, 'id', 'r1')).Output).toMatch(/name\s+alice\s*$/m);
+        const after = await cacheHits();
+        expect(after.hits).toBeGreaterThan(before.hits);
+
+        // a write to the table through this module drops its results
+        await ast_utils.exec(`realtime update ${RealtimeTest} id r2 n 2`);
+        expect((await realtimeLoad(RealtimeTest, 'id', 'r1')).Output).toMatch(/name\s+alicia/);
+
+        // so does a reload
+        await rows().updateOne({ _id: 'r1' }, { $set: { name: 'alice' } });
+        expect((await realtimeLoad(RealtimeTest, 'id', 'r1')).Output).toMatch(/name\s+alicia/);
+        await ast_utils.exec(PurgeCache);
+        expect((await realtimeLoad(RealtimeTest, 'id', 'r1')).Output).toMatch(/name\s+alice\s*$/m);
+    });
+
+    test ('match a prefix by LIKE', async () => {
+        expect((await realtimeLoad(RealtimeTest, 'name LIKE', 'bo%')).Output).toMatch(/name\s+bob/);
+        expect((await realtimeLoad(RealtimeTest, 'name LIKE', 'zz%')).Output).toMatch(/No rows found/);
+        expect((await realtimeLoad(RealtimeTest, 'name LIKE', '%')).Output).toMatch(/name\s+(alice|bob|carol)/);
+    });
+
+    test ('compare by >=, <, IN and IS NULL', async () => {
+        expect((await realtimeLoad(RealtimeTest, 'n >=', '3')).Output).toMatch(/name\s+carol/);
+        expect((await realtimeLoad(RealtimeTest, 'n >=', '4')).Output).toMatch(/No rows found/);
+        expect((await realtimeLoad(RealtimeTest, 'n <', '2')).Output).toMatch(/name\s+alice/);
+        expect((await realtimeLoad(RealtimeTest, 'n <', '1')).Output).toMatch(/No rows found/);
+        expect((await realtimeLoad(RealtimeTest, 'id IN', 'r2,zz')).Output).toMatch(/name\s+bob/);
+        expect((await realtimeLoad(RealtimeTest, 'id IN', 'yy,zz')).Output).toMatch(/No rows found/);
+        expect((await realtimeLoad(RealtimeTest, 'note IS NULL', '-')).Output).toMatch(/name\s+carol/);
+    });
+});